@@ -0,0 +1,472 @@
+#include "checksum.h"
+#include "iphlpr.h"
+#include "inflight.h"
+#include "probe.h"
+#include "probeio.h"
+#include "probetransport.h"
+#include "resultring.h"
+#include "simnetwork.h"
+#include "tracestate.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QHostAddress>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <time.h>
+
+//benchmarks for the probe hot path. writes one json document with a record per benchmark
+// to stdout (or --output) for a ci job to keep, and with --thresholds checks the numbers
+// against limits and exits 1 when one is crossed, so a regression fails the build
+// instead of showing up on the fleet
+
+namespace {
+
+//keeps the compiler from throwing away work whose result nobody reads
+volatile quint64 sink;
+
+qint64 cpuNs(clockid_t clock)
+{
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct Measurement
+{
+    QString name;
+    QString unit;               //what one op is
+    qint64 ops = 0;
+    qint64 cpuNs = 0;
+    qint64 wallNs = 0;
+    double p50Ns = -1;          //per op, -1 where there's no distribution to take them from
+    double p99Ns = -1;
+    QJsonObject extra;
+
+    QJsonObject toJson() const
+    {
+        QJsonObject json = extra;
+        json["name"] = name;
+        json["unit"] = unit;
+        json["ops"] = ops;
+        json["cpuSeconds"] = cpuNs / 1e9;
+        json["wallSeconds"] = wallNs / 1e9;
+        json["opsPerSec"] = wallNs ? ops * 1e9 / wallNs : 0.0;
+        json["nsPerOp"] = ops ? double(cpuNs) / ops : 0.0;
+        if (p50Ns >= 0) {
+            json["p50Ns"] = p50Ns;
+            json["p99Ns"] = p99Ns;
+        }
+        return json;
+    }
+};
+
+double percentile(const QVector<double>& sorted, int percent)
+{
+    if (sorted.isEmpty())
+        return 0;
+    return sorted[qMin(sorted.size() - 1, sorted.size() * percent / 100)];
+}
+
+//one op is too short to time on its own, so rounds of batch ops are timed on the
+// thread's cpu clock and each round gives one cost per op. p50/p99 are over the rounds
+template<typename Op>
+Measurement measure(const QString& name, const QString& unit, int rounds, int batch, Op op)
+{
+    Measurement m;
+    m.name = name;
+    m.unit = unit;
+
+    // a round to warm the caches up, not counted
+    for (int i = 0; i < batch; ++i)
+        op(i);
+
+    QVector<double> perOp;
+    perOp.reserve(rounds);
+    QElapsedTimer wall;
+    wall.start();
+    for (int round = 0; round < rounds; ++round) {
+        qint64 start = cpuNs(CLOCK_THREAD_CPUTIME_ID);
+        for (int i = 0; i < batch; ++i)
+            op(round * batch + i);
+        qint64 spent = cpuNs(CLOCK_THREAD_CPUTIME_ID) - start;
+        m.cpuNs += spent;
+        perOp.append(double(spent) / batch);
+    }
+    m.wallNs = wall.nsecsElapsed();
+    m.ops = qint64(rounds) * batch;
+
+    std::sort(perOp.begin(), perOp.end());
+    m.p50Ns = percentile(perOp, 50);
+    m.p99Ns = percentile(perOp, 99);
+    return m;
+}
+
+//the icmp socket's side of TraceScheduler::drainReplies: walk the outer ip, icmp, inner
+// ip and udp headers, then find the probe in flight. the replies come off a simulated
+// network so they look the way the kernel hands them over
+Measurement benchParse(int rounds, int batch)
+{
+    const int replies = 4096;
+    SimNetwork network;
+    SimTransport transport(&network);
+    transport.open(ProbeTransport::IcmpSocket, 0);
+    quint16 sourcePort = transport.sourcePort();
+
+    SendBatch sendBatch;
+    RecvBatch recvBatch;
+    InFlightTable inFlight(replies);
+    QVector<QByteArray> packets;
+    QVector<quint32> from;
+    char probe[64] = {0};
+    for (int i = 0; i < replies; ++i) {
+        quint32 destination = 0x2d000000 + (i / 16) * 4099;
+        int ttl = 1 + i % 16;
+        quint16 port = 33435 + i % 16;
+        sendBatch.add(destination, port, ttl, probe, sizeof (probe));
+
+        InFlightProbe record;
+        record.id = InFlightTable::probeId(destination, sourcePort, port);
+        record.ttl = ttl;
+        inFlight.insert(record, qint64(60) * 1000000000);
+
+        if (!sendBatch.isFull() && i + 1 < replies)
+            continue;
+        transport.send(sendBatch);
+        while (transport.wait(1000, false) & ProbeTransport::Replies) {
+            int received = transport.receive(recvBatch);
+            for (int k = 0; k < received; ++k) {
+                packets.append(QByteArray(recvBatch.data(k), recvBatch.length(k)));
+                from.append(recvBatch.from(k));
+            }
+        }
+    }
+
+    int matched = 0;
+    Measurement m = measure("parse", "reply", rounds, batch, [&](int i) {
+        int n = i % packets.size();
+        ProbeReply reply;
+        if (!parseProbeReply(packets[n].constData(), packets[n].size(), from[n], reply))
+            return;
+        InFlightProbe* probe = inFlight.find(InFlightTable::probeId(reply.destination, reply.sourcePort,
+                                                                     probeTag(reply, false)));
+        if (probe) {
+            sink += probe->ttl;
+            ++matched;
+        }
+    });
+    // every reply should find its probe, anything else means the numbers are for the wrong path
+    m.extra["matched"] = double(matched) / (m.ops + batch);
+    return m;
+}
+
+//a probe is short enough that the scalar loop does it whatever the cpu has. the self test
+// runs here as well, a kernel that disagrees with in_cksum is a regression however fast it is
+Measurement benchChecksum(int rounds, int batch)
+{
+    char probe[64];
+    for (int i = 0; i < int(sizeof (probe)); ++i)
+        probe[i] = char(i * 37);
+
+    Measurement m = measure("checksum", "64 byte probe", rounds, batch, [&](int i) {
+        probe[0] = char(i);
+        sink += checksum(probe, sizeof (probe));
+    });
+    m.extra["kernel"] = checksumKernelName(checksumKernel());
+    m.extra["mismatches"] = checksumSelfTest();
+    return m;
+}
+
+//a full size echo for a ping sweep, where the wide kernels come in
+Measurement benchEchoChecksum(int rounds, int batch)
+{
+    QVector<char> echo(1400);
+    for (int i = 0; i < echo.size(); ++i)
+        echo[i] = char(i * 37);
+
+    Measurement m = measure("echoChecksum", "1400 byte echo", rounds, batch, [&](int i) {
+        echo[0] = char(i);
+        sink += checksum(echo.constData(), echo.size());
+    });
+    m.extra["kernel"] = checksumKernelName(checksumKernel());
+    return m;
+}
+
+//what every probe of an asyncTrace costs before it reaches a pingResult listener
+Measurement benchResult(int rounds, int batch)
+{
+    return measure("result", "probe", rounds, batch, [&](int i) {
+        HopProbe probe;
+        probe.ttl = 1 + i % 30;
+        probe.address = 0x0a000000 + i;
+        probe.rttNs = 1000000 + i;
+        probe.icmpType = 11;
+        ProbeResult result = toProbeResult(probe, i & 0xff);
+        QVariantMap map;
+        result.toMap(map);
+        sink += map.size();
+    });
+}
+
+//pushes as fast as the ring takes them, each result's push time goes in a side table
+class Producer : public QThread
+{
+public:
+    Producer(ResultRing* ring, QVector<qint64>* stamps, const QElapsedTimer* clock)
+    : mRing(ring), mStamps(stamps), mClock(clock)
+    {}
+
+protected:
+    void run() override
+    {
+        ProbeResult result;
+        for (int i = 0; i < mStamps->size(); ++i) {
+            result.seq = i;
+            result.ttl = 1 + i % 30;
+            (*mStamps)[i] = mClock->nsecsElapsed();
+            mRing->push(result);
+        }
+    }
+
+private:
+    ResultRing* mRing;
+    QVector<qint64>* mStamps;
+    const QElapsedTimer* mClock;
+};
+
+//worker thread to consumer through the ResultRing the workers use. the consumer drains as
+// fast as it can, so the latency is the ring's own: the app's wakeups (watermark, drain
+// timer) come on top of it, the trace benchmark has those
+Measurement benchDelivery(int results)
+{
+    Measurement m;
+    m.name = "delivery";
+    m.unit = "result";
+
+    ResultRing ring;
+    QVector<qint64> stamps(results);
+    QVector<double> latencies;
+    latencies.reserve(results);
+    QVector<ProbeResult> drained;
+    QElapsedTimer clock;
+    clock.start();
+
+    qint64 cpuStart = cpuNs(CLOCK_PROCESS_CPUTIME_ID);
+    Producer producer(&ring, &stamps, &clock);
+    producer.start();
+    while (latencies.size() < results) {
+        drained.clear();
+        if (!ring.drain(drained, RESULT_RING_SIZE)) {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+        qint64 now = clock.nsecsElapsed();
+        for (const ProbeResult& result : drained)
+            latencies.append(now - stamps[result.seq]);
+    }
+    producer.wait();
+    m.wallNs = clock.nsecsElapsed();
+    m.cpuNs = cpuNs(CLOCK_PROCESS_CPUTIME_ID) - cpuStart;
+    m.ops = results;
+
+    std::sort(latencies.begin(), latencies.end());
+    m.p50Ns = percentile(latencies, 50);
+    m.p99Ns = percentile(latencies, 99);
+    m.extra["latency"] = true;  //p50/p99 are push to drain, not cpu per op
+    return m;
+}
+
+//a SimTransport that counts every probe the scheduler hands it
+class CountingTransport : public SimTransport
+{
+public:
+    CountingTransport(const SimNetwork* network, std::atomic<qint64>* probes)
+    : SimTransport(network), mProbes(probes)
+    {}
+
+    int send(SendBatch& batch) override
+    {
+        mProbes->fetch_add(batch.size(), std::memory_order_relaxed);
+        return SimTransport::send(batch);
+    }
+
+private:
+    std::atomic<qint64>* mProbes;
+};
+
+//asyncTraceBatch from start to batchFinal against a simulated network, through the
+// scheduler, the result ring and the signals, with no limit on the probe rate
+Measurement benchTrace(int targets)
+{
+    Measurement m;
+    m.name = "trace";
+    m.unit = "probe";
+
+    SimNetwork network;
+    SimNetwork::Synthetic synthetic;
+    synthetic.silentEvery = 8;
+    synthetic.unreachableEvery = 20;
+    synthetic.loss = 0.01;
+    network.setSynthetic(synthetic);
+
+    std::atomic<qint64> probes{0};
+    ProbeTransport::setFactory([&]() -> ProbeTransport* { return new CountingTransport(&network, &probes); });
+    IpHelperObject::setProbeRate(0);
+
+    QStringList addresses;
+    for (int i = 0; i < targets; ++i)
+        addresses.append(QHostAddress(quint32(0x2d000000 + i * 4099)).toString());
+
+    QVariantMap options;
+    options["probesPerHop"] = 1;
+    options["timeout"] = 1000;
+    options["lookup"] = false;      //the simulated hops have no names, and dns isn't what's measured
+
+    QEventLoop loop;
+    IpHelperObject* helper = IpHelperObject::Create(nullptr);
+    qint64 results = 0;
+    int traces = 0;
+    QObject::connect(helper, &IpHelperObject::probeResults, [&](const QVector<ProbeResult>& batch) {
+        results += batch.size();
+    });
+    QObject::connect(helper, &IpHelperObject::traceFinal, [&](const QVariantMap&) {
+        ++traces;
+    });
+    QObject::connect(helper, &IpHelperObject::batchFinal, &loop, &QEventLoop::quit);
+
+    QElapsedTimer wall;
+    wall.start();
+    qint64 cpuStart = cpuNs(CLOCK_PROCESS_CPUTIME_ID);
+    if (helper->asyncTraceBatch(addresses, options) >= 0)
+        loop.exec();
+    m.cpuNs = cpuNs(CLOCK_PROCESS_CPUTIME_ID) - cpuStart;
+    m.wallNs = wall.nsecsElapsed();
+    delete helper;
+    ProbeTransport::setFactory(ProbeTransport::Factory());
+    IpHelperObject::setProbeRate(DEFAULT_PROBE_RATE);
+
+    m.ops = probes.load();
+    m.extra["traces"] = traces;
+    m.extra["results"] = results;
+    m.extra["tracesPerSec"] = m.wallNs ? traces * 1e9 / m.wallNs : 0.0;
+    return m;
+}
+
+//thresholds: {"parse": {"minOpsPerSec": 1e6, "maxP99Ns": 500}, ...}. any of minOpsPerSec,
+// maxNsPerOp, maxP50Ns, maxP99Ns and maxMismatches, benchmarks that aren't listed aren't checked
+QStringList checkThresholds(const QJsonObject& result, const QJsonObject& limits)
+{
+    QStringList regressions;
+    QString name = result["name"].toString();
+    auto over = [&](const char* limit, const char* field, bool minimum) {
+        if (!limits.contains(limit) || !result.contains(field))
+            return;
+        double value = result[field].toDouble();
+        double bound = limits[limit].toDouble();
+        if (minimum ? value < bound : value > bound)
+            regressions.append(QString("%1: %2 %3 %4 %5").arg(name, field).arg(value)
+                               .arg(minimum ? "<" : ">").arg(bound));
+    };
+    over("minOpsPerSec", "opsPerSec", true);
+    over("maxNsPerOp", "nsPerOp", false);
+    over("maxP50Ns", "p50Ns", false);
+    over("maxP99Ns", "p99Ns", false);
+    over("maxMismatches", "mismatches", false);
+    return regressions;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("traceroute-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmarks the probe hot path and writes the results as JSON.");
+    parser.addHelpOption();
+    QCommandLineOption onlyOption("only", "Comma separated benchmarks to run: parse, checksum, echoChecksum, result, delivery, trace.", "names");
+    QCommandLineOption roundsOption("rounds", "Timed rounds per micro benchmark, p50/p99 are over these.", "n", "200");
+    QCommandLineOption batchOption("batch", "Ops per timed round.", "n", "1024");
+    QCommandLineOption resultsOption("results", "Results pushed through the ring for delivery.", "n", "1000000");
+    QCommandLineOption targetsOption("targets", "Traces in the end to end batch.", "n", "2000");
+    QCommandLineOption thresholdsOption({"t", "thresholds"}, "Limits to check the results against, exits 1 if one is crossed.", "file");
+    QCommandLineOption outputOption({"o", "output"}, "Write the results here instead of stdout.", "file");
+    parser.addOptions({onlyOption, roundsOption, batchOption, resultsOption, targetsOption,
+                       thresholdsOption, outputOption});
+    parser.process(app);
+
+    QJsonObject thresholds;
+    if (parser.isSet(thresholdsOption)) {
+        QFile file(parser.value(thresholdsOption));
+        QJsonParseError error;
+        QJsonDocument document;
+        if (file.open(QIODevice::ReadOnly))
+            document = QJsonDocument::fromJson(file.readAll(), &error);
+        if (!document.isObject()) {
+            fprintf(stderr, "traceroute-bench: %s: not a thresholds file\n", qPrintable(file.fileName()));
+            return 2;
+        }
+        thresholds = document.object();
+    }
+
+    #if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+    QStringList only = parser.value(onlyOption).split(',', Qt::SkipEmptyParts);
+    #else
+    QStringList only = parser.value(onlyOption).split(',', QString::SkipEmptyParts);
+    #endif
+    auto wanted = [&](const char* name) { return only.isEmpty() || only.contains(name); };
+    int rounds = qMax(1, parser.value(roundsOption).toInt());
+    int batch = qMax(1, parser.value(batchOption).toInt());
+
+    QVector<Measurement> measurements;
+    if (wanted("parse"))
+        measurements.append(benchParse(rounds, batch));
+    if (wanted("checksum"))
+        measurements.append(benchChecksum(rounds, batch));
+    if (wanted("echoChecksum"))
+        measurements.append(benchEchoChecksum(rounds, batch));
+    if (wanted("result"))
+        measurements.append(benchResult(rounds, batch));
+    if (wanted("delivery"))
+        measurements.append(benchDelivery(qMax(1, parser.value(resultsOption).toInt())));
+    if (wanted("trace"))
+        measurements.append(benchTrace(qMax(1, parser.value(targetsOption).toInt())));
+
+    QJsonArray benchmarks;
+    QStringList regressions;
+    for (const Measurement& m : measurements) {
+        QJsonObject json = m.toJson();
+        regressions += checkThresholds(json, thresholds[m.name].toObject());
+        benchmarks.append(json);
+    }
+
+    QJsonObject report;
+    report["benchmarks"] = benchmarks;
+    report["regressions"] = QJsonArray::fromStringList(regressions);
+    report["passed"] = regressions.isEmpty();
+
+    QFile out;
+    bool opened = parser.isSet(outputOption)
+                  ? (out.setFileName(parser.value(outputOption)), out.open(QIODevice::WriteOnly))
+                  : out.open(stdout, QIODevice::WriteOnly);
+    if (!opened) {
+        fprintf(stderr, "traceroute-bench: %s\n", qPrintable(out.errorString()));
+        return 2;
+    }
+    out.write(QJsonDocument(report).toJson());
+    out.close();
+
+    for (const QString& regression : regressions)
+        fprintf(stderr, "traceroute-bench: regression: %s\n", qPrintable(regression));
+    return regressions.isEmpty() ? 0 : 1;
+}
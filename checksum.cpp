@@ -0,0 +1,222 @@
+#include "checksum.h"
+#include "probe.h"
+
+#include <QVector>
+
+#include <atomic>
+#include <random>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+//whatever is left over once the wide loops are done, and the whole of it on other cpus
+static quint64 addScalar(const uchar* bytes, int length, quint64 sum)
+{
+    // two sums so the adds of one don't wait on the other's
+    quint64 even = 0, odd = 0;
+    for (; length >= 8; bytes += 8, length -= 8) {
+        quint32 words[2];
+        memcpy(words, bytes, 8);
+        even += words[0];
+        odd += words[1];
+    }
+    sum += even + odd;
+
+    if (length >= 4) {
+        quint32 word;
+        memcpy(&word, bytes, 4);
+        sum += word;
+        bytes += 4;
+        length -= 4;
+    }
+    if (length >= 2) {
+        quint16 word;
+        memcpy(&word, bytes, 2);
+        sum += word;
+        bytes += 2;
+        length -= 2;
+    }
+    // the odd byte is the first half of a word whose second half is 0
+    if (length) {
+        quint16 word = 0;
+        memcpy(&word, bytes, 1);
+        sum += word;
+    }
+    return sum;
+}
+
+#ifdef CHECKSUM_X86
+
+//16 bit words widened to 32 bit lanes. a lane takes one word per 16 (32) bytes, so it can't
+// carry out before 64k words, far past the largest packet; the loop adds up in blocks anyway
+static const int WIDE_BLOCK = 32768;
+//shorter than this goes to addScalar whatever the kernel, below it the wide loops lose
+// to the setup and the horizontal add
+static const int WIDE_MIN = 256;
+
+__attribute__((target("sse2")))
+static quint64 addSse2(const uchar* bytes, int length, quint64 sum)
+{
+    const __m128i zero = _mm_setzero_si128();
+    while (length >= 16) {
+        // low and high halves into sums of their own, the adds don't wait on each other
+        __m128i low = zero, high = zero;
+        int blocks = qMin(length / 16, WIDE_BLOCK);
+        for (int i = 0; i < blocks; ++i, bytes += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*) bytes);
+            low = _mm_add_epi32(low, _mm_unpacklo_epi16(v, zero));
+            high = _mm_add_epi32(high, _mm_unpackhi_epi16(v, zero));
+        }
+        length -= blocks * 16;
+
+        quint32 lanes[8];
+        _mm_storeu_si128((__m128i*) lanes, low);
+        _mm_storeu_si128((__m128i*) (lanes + 4), high);
+        for (quint32 lane : lanes)
+            sum += lane;
+    }
+    return addScalar(bytes, length, sum);
+}
+
+__attribute__((target("avx2")))
+static quint64 addAvx2(const uchar* bytes, int length, quint64 sum)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    while (length >= 32) {
+        __m256i low = zero, high = zero;
+        int blocks = qMin(length / 32, WIDE_BLOCK);
+        for (int i = 0; i < blocks; ++i, bytes += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*) bytes);
+            low = _mm256_add_epi32(low, _mm256_unpacklo_epi16(v, zero));
+            high = _mm256_add_epi32(high, _mm256_unpackhi_epi16(v, zero));
+        }
+        length -= blocks * 32;
+
+        quint32 lanes[16];
+        _mm256_storeu_si256((__m256i*) lanes, low);
+        _mm256_storeu_si256((__m256i*) (lanes + 8), high);
+        for (quint32 lane : lanes)
+            sum += lane;
+    }
+    // under 32 bytes left. not the sse2 loop: legacy sse code after avx code stalls on some cpus
+    return addScalar(bytes, length, sum);
+}
+
+#endif
+
+bool checksumSupported(ChecksumKernel kernel)
+{
+    switch (kernel) {
+    case ChecksumKernel::Scalar:
+        return true;
+#ifdef CHECKSUM_X86
+    case ChecksumKernel::Sse2:
+        return __builtin_cpu_supports("sse2");
+    case ChecksumKernel::Avx2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+ChecksumKernel checksumKernel()
+{
+    //the answer never changes, working it out twice from two threads does no harm
+    static std::atomic<int> picked{-1};
+    int kernel = picked.load(std::memory_order_relaxed);
+    if (kernel < 0) {
+        kernel = int(ChecksumKernel::Scalar);
+        if (checksumSupported(ChecksumKernel::Avx2))
+            kernel = int(ChecksumKernel::Avx2);
+        else if (checksumSupported(ChecksumKernel::Sse2))
+            kernel = int(ChecksumKernel::Sse2);
+        picked.store(kernel, std::memory_order_relaxed);
+    }
+    return ChecksumKernel(kernel);
+}
+
+const char* checksumKernelName(ChecksumKernel kernel)
+{
+    switch (kernel) {
+    case ChecksumKernel::Sse2:
+        return "sse2";
+    case ChecksumKernel::Avx2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+//kernel is one the cpu has
+static quint64 add(ChecksumKernel kernel, const void* data, int length, quint64 sum)
+{
+    const uchar* bytes = (const uchar*) data;
+    length = qMax(0, length);
+#ifdef CHECKSUM_X86
+    // the scalar loop keeps up with the wide ones on a probe, they pay off from an echo payload up
+    if (length >= WIDE_MIN) {
+        if (kernel == ChecksumKernel::Avx2)
+            return addAvx2(bytes, length, sum);
+        if (kernel == ChecksumKernel::Sse2)
+            return addSse2(bytes, length, sum);
+    }
+#else
+    Q_UNUSED(kernel);
+#endif
+    return addScalar(bytes, length, sum);
+}
+
+quint64 checksumAdd(ChecksumKernel kernel, const void* data, int length, quint64 sum)
+{
+    if (!checksumSupported(kernel))
+        kernel = ChecksumKernel::Scalar;
+    return add(kernel, data, length, sum);
+}
+
+quint64 checksumAdd(const void* data, int length, quint64 sum)
+{
+    return add(checksumKernel(), data, length, sum);
+}
+
+int checksumSelfTest()
+{
+    // past MAX_PACKET_SIZE, and the odd lengths and offsets that trip up the tails
+    const int maxLength = 2048;
+    QVector<char> buffer(maxLength + 64);
+    std::mt19937 rng(1);
+    for (int i = 0; i < buffer.size(); ++i)
+        buffer[i] = char(rng());
+
+    int mismatches = 0;
+    for (ChecksumKernel kernel : {ChecksumKernel::Scalar, ChecksumKernel::Sse2, ChecksumKernel::Avx2}) {
+        if (!checksumSupported(kernel))
+            continue;
+        for (int length = 0; length <= maxLength; length += length < 128 ? 1 : 61) {
+            for (int offset = 0; offset < 4; ++offset) {
+                // in_cksum reads u_shorts, give it a copy where it wants one
+                alignas(8) char aligned[maxLength + 8];
+                const char* data = buffer.constData() + offset;
+                memcpy(aligned, data, length);
+                quint16 expected = in_cksum((u_short*) aligned, length);
+                if (checksumFinish(checksumAdd(kernel, data, length)) != expected)
+                    ++mismatches;
+            }
+        }
+    }
+
+    // the fixed size and incremental versions, against the same reference
+    char header[20];
+    memcpy(header, buffer.constData() + 3, sizeof(header));
+    if (checksumFixed<20>(header) != in_cksum((u_short*) header, sizeof(header)))
+        ++mismatches;
+    quint16 before = in_cksum((u_short*) header, sizeof(header));
+    quint16 oldWord, newWord = quint16(rng());
+    memcpy(&oldWord, header + 6, 2);
+    memcpy(header + 6, &newWord, 2);
+    if (checksumUpdate(before, oldWord, newWord) != in_cksum((u_short*) header, sizeof(header)))
+        ++mismatches;
+    return mismatches;
+}
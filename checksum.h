@@ -0,0 +1,87 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <QtGlobal>
+
+#include <string.h>
+
+//the internet checksum (rfc 1071) over bytes as they sit in memory, so the result goes into
+// a header as is. in_cksum (probe.h) is the plain loop all of this is checked against, see
+// checksumSelfTest
+
+//the kernels checksumAdd picks from. the widest one the cpu has is picked on first use
+enum class ChecksumKernel {
+    Scalar,         //32 bits at a time into a 64 bit sum, any cpu
+    Sse2,
+    Avx2,
+};
+
+//one's complement sum of data added to sum, not folded. pieces that start on an even offset
+// of the packet add up to the sum of the whole, an odd length only works for the last piece
+quint64 checksumAdd(const void* data, int length, quint64 sum = 0);
+//the same with a kernel of the caller's choosing, false from checksumSupported runs Scalar
+quint64 checksumAdd(ChecksumKernel kernel, const void* data, int length, quint64 sum = 0);
+bool checksumSupported(ChecksumKernel kernel);
+ChecksumKernel checksumKernel();
+const char* checksumKernelName(ChecksumKernel kernel);
+
+//folds a sum to 16 bits, end around carry and all
+constexpr quint16 checksumFold(quint64 sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return quint16((sum & 0xffff) + (sum >> 16));
+}
+
+//what goes into the header for a sum
+constexpr quint16 checksumFinish(quint64 sum)
+{
+    return quint16(~checksumFold(sum));
+}
+
+inline quint16 checksum(const void* data, int length)
+{
+    return checksumFinish(checksumAdd(data, length));
+}
+
+//for the headers whose size we know, an ip or udp header, a pseudo header: the loop has a
+// constant trip count and comes out as a handful of loads and adds, no call, no dispatch
+template<int Length>
+inline quint64 checksumAddFixed(const void* data, quint64 sum = 0)
+{
+    static_assert(Length > 0 && Length % 4 == 0, "fixed size checksums are over whole 32 bit words");
+    const uchar* bytes = (const uchar*) data;
+    for (int i = 0; i < Length; i += 4) {
+        quint32 word;
+        memcpy(&word, bytes + i, 4);
+        sum += word;
+    }
+    return sum;
+}
+
+template<int Length>
+inline quint16 checksumFixed(const void* data)
+{
+    return checksumFinish(checksumAddFixed<Length>(data));
+}
+
+//rfc 1624: the checksum once a 16 bit word it covers changed from oldWord to newWord, both
+// as they are in memory. a probe that differs from the last one in its sequence number or
+// id costs an add instead of a pass over the packet
+constexpr quint16 checksumUpdate(quint16 checksum, quint16 oldWord, quint16 newWord)
+{
+    return checksumFinish(quint64(quint16(~checksum)) + quint16(~oldWord) + newWord);
+}
+
+static_assert(checksumFold(0x1ffffffffULL) == 0x0001, "end around carry");
+static_assert(checksumFinish(0) == 0xffff, "nothing sums to all ones");
+//a header of the words 0x4500 and 0x0073: sum 0x4573, checksum 0xba8c. change the second
+// to 0x0074 and it's 0xba8b
+static_assert(checksumUpdate(0xba8c, 0x0073, 0x0074) == 0xba8b, "incremental update");
+
+//every kernel against in_cksum over lengths up to a jumbo echo and every alignment.
+// returns the number of mismatches, 0 is what a build should see
+int checksumSelfTest();
+
+#endif // CHECKSUM_H
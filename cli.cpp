@@ -0,0 +1,214 @@
+#include "iphlpr.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+#include <QTimer>
+
+#include <cstdio>
+
+//headless front end: targets come one per line from files or stdin, go through
+// asyncTraceBatch, and out as one json object per line on stdout. a line per hop
+// once the trace has moved past it, a line per trace when it's done, a line per hop
+// address once its name is known and one last line for the batch
+
+namespace {
+
+//one name per line, blank lines and everything after a # are skipped, so a hosts
+// file or a list with comments can go in as it is
+void readTargets(QIODevice& device, QStringList& targets)
+{
+    QTextStream in(&device);
+    QString line;
+    while (in.readLineInto(&line)) {
+        int comment = line.indexOf('#');
+        if (comment >= 0)
+            line.truncate(comment);
+        QString name = line.simplified().section(' ', 0, 0);
+        if (!name.isEmpty())
+            targets.append(name);
+    }
+}
+
+QJsonObject probeJson(const ProbeResult& result)
+{
+    QJsonObject probe;
+    probe["address"] = result.addressString();
+    if (result.timedOut()) {
+        probe["timeout"] = true;
+    } else {
+        probe["rtt"] = result.rttUs / 1000.0;
+        probe["icmpType"] = result.icmpType;
+        probe["icmpCode"] = result.icmpCode;
+    }
+    if (result.flags & ProbeResult::Shared)
+        probe["shared"] = true;
+    return probe;
+}
+
+class JsonLines
+{
+public:
+    JsonLines()
+    {
+        mOut.open(stdout, QIODevice::WriteOnly);
+    }
+
+    void write(const QJsonObject& object)
+    {
+        mOut.write(QJsonDocument(object).toJson(QJsonDocument::Compact));
+        mOut.write("\n", 1);
+    }
+
+    //once per drained batch, not per line, cron jobs piping us into a file don't need more
+    void flush() { mOut.flush(); }
+
+private:
+    QFile mOut;
+};
+
+//a trace's results come in hop order, so a hop is complete when the next one starts
+struct PendingHop
+{
+    int ttl = 0;
+    QJsonArray probes;
+};
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("traceroute-cli");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Traces every target listed in the files (or stdin) and writes one JSON object per line.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("files", "Target lists, one host per line. - or nothing reads stdin.", "[files...]");
+    QCommandLineOption concurrencyOption({"c", "concurrency"}, "Traces in flight at once.", "n", QString::number(DEFAULT_BATCH_CONCURRENCY));
+    QCommandLineOption queriesOption({"q", "queries"}, "Probes per hop.", "n", "1");
+    QCommandLineOption waitOption({"w", "wait"}, "Per-hop timeout in ms.", "ms", "3000");
+    QCommandLineOption rateOption({"r", "rate"}, "Probes per second for the whole process, pings included, 0 is unlimited.", "pps", QString::number(DEFAULT_PROBE_RATE));
+    QCommandLineOption parisOption("paris", "Keep every probe of a trace on one flow.");
+    QCommandLineOption multipathOption("multipath", "Enumerate load-balanced interfaces at each hop.");
+    QCommandLineOption numericOption({"n", "numeric"}, "Don't look up the names of hop addresses.");
+    QCommandLineOption noDoubletreeOption("no-doubletree", "Probe every trace from the first hop instead of sharing near hops.");
+    QCommandLineOption archiveOption({"a", "archive"}, "Also append every finished trace to a binary trace archive.", "file");
+    QCommandLineOption metricsOption({"m", "metrics"}, "Keep engine metrics in this file, in Prometheus text format, rewritten every 10s and at the end.", "file");
+    parser.addOptions({concurrencyOption, queriesOption, waitOption, rateOption,
+                       parisOption, multipathOption, numericOption, noDoubletreeOption, archiveOption, metricsOption});
+    parser.process(app);
+
+    QStringList files = parser.positionalArguments();
+    if (files.isEmpty())
+        files.append("-");
+
+    QStringList targets;
+    for (const QString& name : files) {
+        QFile file;
+        bool opened = name == "-" ? file.open(stdin, QIODevice::ReadOnly)
+                                  : (file.setFileName(name), file.open(QIODevice::ReadOnly));
+        if (!opened) {
+            fprintf(stderr, "traceroute-cli: %s: %s\n", qPrintable(name), qPrintable(file.errorString()));
+            return 2;
+        }
+        readTargets(file, targets);
+    }
+    if (targets.isEmpty()) {
+        fprintf(stderr, "traceroute-cli: no targets\n");
+        return 2;
+    }
+
+    QVariantMap options;
+    options["maxConcurrent"] = parser.value(concurrencyOption).toInt();
+    options["probesPerHop"] = parser.value(queriesOption).toInt();
+    options["timeout"] = parser.value(waitOption).toInt();
+    options["paris"] = parser.isSet(parisOption);
+    options["multipath"] = parser.isSet(multipathOption);
+    if (parser.isSet(noDoubletreeOption))
+        options["doubletree"] = 0;
+    if (parser.isSet(numericOption))
+        options["lookup"] = false;
+    if (parser.isSet(archiveOption))
+        options["archive"] = parser.value(archiveOption);
+    IpHelperObject::setProbeRate(parser.value(rateOption).toInt());
+
+    JsonLines out;
+    QHash<int, PendingHop> pending;
+    int finished = 0;
+    int failed = 0;
+
+    auto flushHop = [&](int trace) {
+        auto it = pending.find(trace);
+        if (it == pending.end())
+            return;
+        out.write(QJsonObject{{"type", "hop"}, {"trace", trace}, {"destination", targets[trace]},
+                              {"ttl", it->ttl}, {"probes", it->probes}});
+        pending.erase(it);
+    };
+
+    IpHelperObject* helper = IpHelperObject::Create(&app);
+
+    QString metricsFile = parser.value(metricsOption);
+    QTimer metricsTimer;
+    if (!metricsFile.isEmpty()) {
+        QObject::connect(&metricsTimer, &QTimer::timeout, [&]() { IpHelperObject::writeMetrics(metricsFile); });
+        metricsTimer.start(10000);
+    }
+
+    //probeResults rather than pingResult, nobody has to build a QVariantMap per probe
+    QObject::connect(helper, &IpHelperObject::probeResults, [&](const QVector<ProbeResult>& results) {
+        for (const ProbeResult& result : results) {
+            auto it = pending.constFind(result.index);
+            if (it != pending.constEnd() && it->ttl != result.ttl)
+                flushHop(result.index);
+            PendingHop& hop = pending[result.index];
+            hop.ttl = result.ttl;
+            hop.probes.append(probeJson(result));
+        }
+        out.flush();
+    });
+
+    QObject::connect(helper, &IpHelperObject::traceFinal, [&](const QVariantMap& map) {
+        int trace = map.value("trace").toInt();
+        flushHop(trace);
+        ++finished;
+        if (map.contains("error"))
+            ++failed;
+        QJsonObject line = QJsonObject::fromVariantMap(map);
+        line["type"] = "trace";
+        out.write(line);
+        out.flush();
+    });
+
+    //once per address of the whole batch, the batch line waits for the last of them
+    QObject::connect(helper, &IpHelperObject::traceHost, [&](const QVariantMap& map) {
+        out.write(QJsonObject{{"type", "host"}, {"address", map.value("address").toString()},
+                              {"host", map.value("host").toString()}});
+        out.flush();
+    });
+
+    QObject::connect(helper, &IpHelperObject::batchFinal, [&](const QVariantMap& map) {
+        //a batch that died on a socket error never finished some of its traces
+        failed += targets.size() - finished;
+        QJsonObject line = QJsonObject::fromVariantMap(map);
+        line["type"] = "batch";
+        line["failed"] = failed;
+        out.write(line);
+        out.flush();
+        if (!metricsFile.isEmpty() && !IpHelperObject::writeMetrics(metricsFile))
+            fprintf(stderr, "traceroute-cli: couldn't write %s\n", qPrintable(metricsFile));
+        app.exit(failed ? 1 : 0);
+    });
+
+    if (helper->asyncTraceBatch(targets, options) < 0) {
+        fprintf(stderr, "traceroute-cli: couldn't start the batch\n");
+        return 2;
+    }
+    return app.exec();
+}
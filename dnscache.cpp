@@ -0,0 +1,232 @@
+#include "dnscache.h"
+
+#include <QCoreApplication>
+#include <QHostAddress>
+#include <QHostInfo>
+#include <QPointer>
+
+ReverseLookupCache::ReverseLookupCache(int maxEntries, int ttl, int negativeTtl, int maxLookups, QObject* parent)
+: QObject(parent)
+, mTtlMs(ttl * 1000)
+, mNegativeTtlMs(negativeTtl * 1000)
+, mMaxLookups(qMax(1, maxLookups))
+, mEntries(qMax(1, maxEntries))
+{
+    mClock.start();
+}
+
+ReverseLookupCache& ReverseLookupCache::global()
+{
+    static QPointer<ReverseLookupCache> cache;
+    if (!cache)
+        cache = new ReverseLookupCache(DNS_CACHE_ENTRIES, DNS_CACHE_TTL, DNS_NEGATIVE_TTL, DNS_MAX_LOOKUPS,
+                                       QCoreApplication::instance());
+    return *cache;
+}
+
+bool ReverseLookupCache::lookup(quint32 address, QString* name)
+{
+    Entry* entry = mEntries.object(address);
+    if (entry && entry->expiresMs > mClock.elapsed()) {
+        ++mHits;
+        if (name)
+            *name = entry->name;
+        return true;
+    }
+    if (entry)
+        mEntries.remove(address);
+
+    ++mMisses;
+    if (mPending.contains(address) || mQueue.size() >= mEntries.maxCost())
+        return false;
+    mPending.insert(address);
+    mQueue.enqueue(address);
+    startLookups();
+    return false;
+}
+
+void ReverseLookupCache::clear()
+{
+    // lookups that are out still land, they were asked for
+    mEntries.clear();
+}
+
+void ReverseLookupCache::startLookups()
+{
+    while (mLookups < mMaxLookups && !mQueue.isEmpty()) {
+        quint32 address = mQueue.dequeue();
+        QString literal = QHostAddress(address).toString();
+        ++mLookups;
+        // a literal is looked up in reverse. no name comes back as the literal itself
+        QHostInfo::lookupHost(literal, this, [this, address, literal](const QHostInfo& hostInfo) {
+            QString name;
+            if (hostInfo.error() == QHostInfo::NoError && hostInfo.hostName() != literal)
+                name = hostInfo.hostName();
+            finished(address, name);
+        });
+    }
+}
+
+void ReverseLookupCache::finished(quint32 address, const QString& name)
+{
+    --mLookups;
+    mPending.remove(address);
+
+    // a resolver that timed out is as good as no name, for the shorter ttl
+    Entry* entry = new Entry;
+    entry->name = name;
+    entry->expiresMs = mClock.elapsed() + (name.isEmpty() ? mNegativeTtlMs : mTtlMs);
+    mEntries.insert(address, entry);
+
+    startLookups();
+    emit resolved(address, name);
+}
+
+void HostResolver::Result::toMap(QVariantMap& map) const
+{
+    static const char* const sources[] = {"literal", "cached", "lookup"};
+    if (!address.isNull()) {
+        map["address"] = address.toString();
+        map["family"] = address.protocol() == QAbstractSocket::IPv6Protocol ? "ipv6" : "ipv4";
+    }
+    map["resolution"] = sources[source];
+    if (!error.isEmpty())
+        map["error"] = error;
+}
+
+HostResolver::HostResolver(int maxEntries, int ttl, int negativeTtl, int maxLookups, QObject* parent)
+: QObject(parent)
+, mTtlMs(ttl * 1000)
+, mNegativeTtlMs(negativeTtl * 1000)
+, mMaxLookups(qMax(1, maxLookups))
+, mEntries(qMax(1, maxEntries))
+{
+    mClock.start();
+}
+
+HostResolver& HostResolver::global()
+{
+    static QPointer<HostResolver> resolver;
+    if (!resolver)
+        resolver = new HostResolver(DNS_FORWARD_ENTRIES, DNS_FORWARD_TTL, DNS_FORWARD_NEGATIVE_TTL, DNS_MAX_LOOKUPS,
+                                    QCoreApplication::instance());
+    return *resolver;
+}
+
+bool HostResolver::resolveNow(const QString& name, Result* result)
+{
+    QHostAddress address;
+    if (address.setAddress(name)) {
+        result->address = address;
+        result->error = address.protocol() == QAbstractSocket::IPv4Protocol ? QString() : QString("no IPv4 address");
+        result->source = Result::Literal;
+        return true;
+    }
+
+    QString key = name.toLower();
+    Entry* entry = mEntries.object(key);
+    if (entry && entry->expiresMs > mClock.elapsed()) {
+        ++mHits;
+        result->address = entry->address;
+        result->error = entry->error;
+        result->source = Result::Cached;
+        return true;
+    }
+    if (entry)
+        mEntries.remove(key);
+    ++mMisses;
+    return false;
+}
+
+void HostResolver::resolve(const QStringList& names, QObject* context, Callback done)
+{
+    BatchPtr batch = std::make_shared<Batch>();
+    batch->context = context;
+    batch->done = done;
+    batch->results.resize(names.size());
+
+    for (int i = 0; i < names.size(); ++i) {
+        if (resolveNow(names[i], &batch->results[i]))
+            continue;
+
+        // a name that's out already, for this list or another one, isn't asked about twice
+        QString key = names[i].toLower();
+        auto it = mWaiting.find(key);
+        if (it == mWaiting.end()) {
+            it = mWaiting.insert(key, QVector<QPair<BatchPtr, int> >());
+            mQueue.enqueue(key);
+        }
+        it->append(qMakePair(batch, i));
+        ++batch->lookups;
+    }
+
+    // even with nothing to look up the answer comes from the event loop, the caller
+    // may not be ready for it before resolve returns
+    if (!batch->lookups) {
+        QMetaObject::invokeMethod(this, [batch]() {
+            if (batch->context)
+                batch->done(batch->results);
+        }, Qt::QueuedConnection);
+        return;
+    }
+    startLookups();
+}
+
+void HostResolver::clear()
+{
+    mEntries.clear();
+}
+
+void HostResolver::startLookups()
+{
+    while (mLookups < mMaxLookups && !mQueue.isEmpty()) {
+        QString name = mQueue.dequeue();
+        ++mLookups;
+        QHostInfo::lookupHost(name, this, [this, name](const QHostInfo& hostInfo) {
+            finished(name, hostInfo);
+        });
+    }
+}
+
+void HostResolver::finished(const QString& name, const QHostInfo& hostInfo)
+{
+    --mLookups;
+
+    // ipv4 is what gets probed. an ipv6 address only goes along to say what the name has
+    Result result;
+    result.source = Result::Lookup;
+    if (hostInfo.error() == QHostInfo::NoError) {
+        for (const QHostAddress& address : hostInfo.addresses()) {
+            if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+                result.address = address;
+                break;
+            }
+        }
+        if (result.address.isNull()) {
+            if (!hostInfo.addresses().isEmpty())
+                result.address = hostInfo.addresses().first();
+            result.error = "no IPv4 address";
+        }
+    } else {
+        result.error = hostInfo.errorString();
+    }
+
+    // a name that doesn't exist is kept for the shorter ttl. a resolver that failed to answer
+    // isn't kept at all, the next trace asks again
+    if (result.ok() || hostInfo.error() != QHostInfo::UnknownError) {
+        Entry* entry = new Entry;
+        entry->address = result.address;
+        entry->error = result.error;
+        entry->expiresMs = mClock.elapsed() + (result.ok() ? mTtlMs : mNegativeTtlMs);
+        mEntries.insert(name, entry);
+    }
+
+    const QVector<QPair<BatchPtr, int> > waiting = mWaiting.take(name);
+    startLookups();
+    for (const auto& slot : waiting) {
+        Batch& batch = *slot.first;
+        batch.results[slot.second] = result;
+        if (--batch.lookups == 0 && batch.context)
+            batch.done(batch.results);
+    }
+}
@@ -0,0 +1,154 @@
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include "iphlpr.h"
+
+#include <QCache>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QHostAddress>
+#include <QObject>
+#include <QPointer>
+#include <QQueue>
+#include <QSet>
+#include <QVariantMap>
+#include <QVector>
+
+#include <functional>
+#include <memory>
+
+class QHostInfo;
+
+//names for hop addresses, for every helper and session of the process. a sweep crosses the
+// same backbone interfaces thousands of times, each one is asked about once and then served
+// from here until it expires. addresses without a name are kept as well, for a shorter
+// while, or every trace through them would ask again. QHostInfo does the lookups on its
+// own threads, never more than maxLookups at once, the rest wait their turn. lives on the
+// gui thread and goes with the application, call it from there
+class ReverseLookupCache : public QObject
+{
+    Q_OBJECT
+public:
+    //ttls in seconds. getnameinfo doesn't tell us the record's own ttl, these stand in for it
+    ReverseLookupCache(int maxEntries, int ttl, int negativeTtl, int maxLookups, QObject* parent = nullptr);
+
+    static ReverseLookupCache& global();
+
+    //true with the name if the address is cached, an empty one if it has none. otherwise
+    // false, and the address is asked about unless it is already. resolved() says when
+    bool lookup(quint32 address, QString* name = nullptr);
+    //asked about or waiting its turn. the queue is bounded like the cache, an address that
+    // didn't fit isn't pending and lookup() will try again next time
+    bool isPending(quint32 address) const { return mPending.contains(address); }
+
+    void clear();
+
+    int size() const { return mEntries.size(); }
+    quint64 hits() const { return mHits; }
+    quint64 misses() const { return mMisses; }
+
+signals:
+    //once per lookup, to everyone who asked. name is empty if there is none
+    void resolved(quint32 address, const QString& name);
+
+private:
+    struct Entry
+    {
+        QString name;
+        qint64 expiresMs;
+    };
+
+    void startLookups();
+    void finished(quint32 address, const QString& name);
+
+    int mTtlMs;
+    int mNegativeTtlMs;
+    int mMaxLookups;
+    int mLookups = 0;                   //out with QHostInfo right now
+    QCache<quint32, Entry> mEntries;    //least recently used go first once it's full
+    QSet<quint32> mPending;             //out or queued
+    QQueue<quint32> mQueue;
+    QElapsedTimer mClock;
+    quint64 mHits = 0;
+    quint64 mMisses = 0;
+};
+
+//addresses for the names traces and pings are started with, for every helper and session of
+// the process. a literal is taken as it is, a name is looked up once and reused until it
+// expires, names that don't exist for a shorter while. a list of names is resolved as one
+// batch, each distinct name once however many lists ask for it, at most maxLookups out
+// at once. the engine probes ipv4, the first ipv4 address of a name is the one it gets.
+// lives on the gui thread and goes with the application, call it from there
+class HostResolver : public QObject
+{
+    Q_OBJECT
+public:
+    struct Result
+    {
+        enum Source {
+            Literal,        //the name was an address
+            Cached,
+            Lookup,
+        };
+
+        QHostAddress address;   //the chosen one. null if there's none, an ipv6 one if that's all there is
+        QString error;          //set whenever there's nothing to probe
+        Source source = Literal;
+
+        bool ok() const { return error.isEmpty() && !address.isNull(); }
+        //address, family (ipv4 or ipv6) and resolution (literal, cached or lookup), or error
+        void toMap(QVariantMap& map) const;
+    };
+    typedef std::function<void(const QVector<Result>& results)> Callback;
+
+    //ttls in seconds. getaddrinfo doesn't tell us the records' own ttls, these stand in for them
+    HostResolver(int maxEntries, int ttl, int negativeTtl, int maxLookups, QObject* parent = nullptr);
+
+    static HostResolver& global();
+
+    //done gets a result per name, in order. always from the event loop, never before resolve
+    // returns, even if every name is a literal or cached, and never once context is gone
+    void resolve(const QStringList& names, QObject* context, Callback done);
+    //a literal or a cached name, false if it would take a lookup
+    bool resolveNow(const QString& name, Result* result);
+
+    void clear();
+
+    int size() const { return mEntries.size(); }
+    quint64 hits() const { return mHits; }
+    quint64 misses() const { return mMisses; }
+
+private:
+    struct Entry
+    {
+        QHostAddress address;
+        QString error;
+        qint64 expiresMs;
+    };
+
+    //one resolve() call waiting on its lookups
+    struct Batch
+    {
+        QPointer<QObject> context;
+        Callback done;
+        QVector<Result> results;
+        int lookups = 0;
+    };
+    typedef std::shared_ptr<Batch> BatchPtr;
+
+    void startLookups();
+    void finished(const QString& name, const QHostInfo& hostInfo);
+
+    int mTtlMs;
+    int mNegativeTtlMs;
+    int mMaxLookups;
+    int mLookups = 0;
+    QCache<QString, Entry> mEntries;                    //by lower case name
+    QHash<QString, QVector<QPair<BatchPtr, int> > > mWaiting;  //name -> the batches and slots it's for
+    QQueue<QString> mQueue;
+    QElapsedTimer mClock;
+    quint64 mHits = 0;
+    quint64 mMisses = 0;
+};
+
+#endif // DNSCACHE_H
@@ -0,0 +1,160 @@
+#include "hopstats.h"
+
+#include <QHostAddress>
+
+#include <algorithm>
+#include <cmath>
+
+//weight of the newest probe in the recent loss
+static const double RECENT_LOSS_WEIGHT = 1.0 / 32;
+
+P2Quantile::P2Quantile(double p)
+: mP(p)
+{
+    for (int i = 0; i < 5; ++i) {
+        mHeights[i] = 0;
+        mPositions[i] = i + 1;
+    }
+    mDesired[0] = 1;
+    mDesired[1] = 1 + 2 * p;
+    mDesired[2] = 1 + 4 * p;
+    mDesired[3] = 3 + 2 * p;
+    mDesired[4] = 5;
+    mIncrements[0] = 0;
+    mIncrements[1] = p / 2;
+    mIncrements[2] = p;
+    mIncrements[3] = (1 + p) / 2;
+    mIncrements[4] = 1;
+}
+
+void P2Quantile::add(double x)
+{
+    //the first five are kept as they are
+    if (mCount < 5) {
+        mHeights[mCount++] = x;
+        std::sort(mHeights, mHeights + mCount);
+        return;
+    }
+    ++mCount;
+
+    int k;
+    if (x < mHeights[0]) {
+        mHeights[0] = x;
+        k = 0;
+    } else if (x >= mHeights[4]) {
+        mHeights[4] = x;
+        k = 3;
+    } else {
+        k = 0;
+        while (x >= mHeights[k + 1])
+            ++k;
+    }
+
+    for (int i = k + 1; i < 5; ++i)
+        mPositions[i] += 1;
+    for (int i = 0; i < 5; ++i)
+        mDesired[i] += mIncrements[i];
+
+    //nudge the middle markers toward where they should be, one position at a time
+    for (int i = 1; i < 4; ++i) {
+        double offset = mDesired[i] - mPositions[i];
+        if ((offset >= 1 && mPositions[i + 1] - mPositions[i] > 1)
+            || (offset <= -1 && mPositions[i - 1] - mPositions[i] < -1)) {
+            int d = offset > 0 ? 1 : -1;
+            double height = parabolic(i, d);
+            if (height <= mHeights[i - 1] || height >= mHeights[i + 1])
+                height = linear(i, d);
+            mHeights[i] = height;
+            mPositions[i] += d;
+        }
+    }
+}
+
+double P2Quantile::parabolic(int i, int d) const
+{
+    const double* n = mPositions;
+    const double* q = mHeights;
+    return q[i] + d / (n[i + 1] - n[i - 1])
+                  * ((n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) / (n[i + 1] - n[i])
+                     + (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+}
+
+double P2Quantile::linear(int i, int d) const
+{
+    return mHeights[i] + d * (mHeights[i + d] - mHeights[i]) / (mPositions[i + d] - mPositions[i]);
+}
+
+double P2Quantile::value() const
+{
+    if (!mCount)
+        return 0;
+    if (mCount <= 5)
+        return mHeights[qRound(mP * (mCount - 1))];
+    return mHeights[2];
+}
+
+HopStats::HopStats()
+: mP50(0.5)
+, mP90(0.9)
+, mP99(0.99)
+{
+}
+
+void HopStats::add(const ProbeResult& result, int cycle)
+{
+    mTTL = result.ttl;
+    mLastCycle = cycle;
+    ++mSent;
+
+    bool lost = result.timedOut();
+    mRecentLoss += ((lost ? 100.0 : 0.0) - mRecentLoss) * RECENT_LOSS_WEIGHT;
+    if (lost)
+        return;
+
+    //a hop that keeps changing its address is a path that keeps changing
+    if (mAddress && result.address != mAddress)
+        ++mAddressChanges;
+    mAddress = result.address;
+
+    double rttMS = result.rttUs / 1000.0;
+    if (!mReceived++) {
+        mMinMS = mMaxMS = rttMS;
+    } else {
+        mMinMS = qMin(mMinMS, rttMS);
+        mMaxMS = qMax(mMaxMS, rttMS);
+        mJitterMS += (std::fabs(rttMS - mLastMS) - mJitterMS) / 16;
+    }
+    mLastMS = rttMS;
+
+    double delta = rttMS - mMeanMS;
+    mMeanMS += delta / mReceived;
+    mM2 += delta * (rttMS - mMeanMS);
+
+    mP50.add(rttMS);
+    mP90.add(rttMS);
+    mP99.add(rttMS);
+}
+
+void HopStats::toMap(QVariantMap& map) const
+{
+    map["ttl"] = mTTL;
+    map["cycle"] = mLastCycle;
+    map["address"] = mAddress ? QHostAddress(mAddress).toString() : QString("*");
+    map["addressChanges"] = mAddressChanges;
+    map["sent"] = mSent;
+    map["received"] = mReceived;
+    map["loss"] = mSent ? 100.0 * (mSent - mReceived) / mSent : 0.0;
+    map["recentLoss"] = mRecentLoss;
+    if (!mReceived)
+        return;
+
+    map["last"] = mLastMS;
+    map["min"] = mMinMS;
+    map["avg"] = mMeanMS;
+    map["max"] = mMaxMS;
+    map["stddev"] = mReceived > 1 ? std::sqrt(mM2 / (mReceived - 1)) : 0.0;
+    map["jitter"] = mJitterMS;
+    map["p50"] = mP50.value();
+    map["p90"] = mP90.value();
+    map["p99"] = mP99.value();
+}
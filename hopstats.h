@@ -0,0 +1,70 @@
+#ifndef HOPSTATS_H
+#define HOPSTATS_H
+
+#include "iphlpr.h"
+
+#include <QVariantMap>
+
+//one quantile of a stream kept in five markers, the p-square estimator of jain and chlamtac.
+// exact until the fifth sample, after that the middle marker tracks the quantile without
+// storing the samples
+class P2Quantile
+{
+public:
+    explicit P2Quantile(double p = 0.5);
+
+    void add(double x);
+    double value() const;
+    int count() const { return mCount; }
+
+private:
+    double parabolic(int i, int d) const;
+    double linear(int i, int d) const;
+
+    double mP;
+    int mCount = 0;
+    double mHeights[5];
+    double mPositions[5];
+    double mDesired[5];
+    double mIncrements[5];
+};
+
+//running aggregates for one hop over every cycle of a trace, in constant memory however
+// long it runs. rtts in ms, jitter is the rfc 3550 interarrival estimate over consecutive
+// answers, recent loss an exponential average over the last few dozen probes
+class HopStats
+{
+public:
+    HopStats();
+
+    void add(const ProbeResult& result, int cycle);
+    int lastCycle() const { return mLastCycle; }
+    int sent() const { return mSent; }
+    quint32 address() const { return mAddress; }
+
+    //the traceHop map: ttl, cycle, address, addressChanges, sent, received, loss, recentLoss,
+    // and once something answered last, min, avg, max, stddev, jitter, p50, p90, p99
+    void toMap(QVariantMap& map) const;
+
+private:
+    int mTTL = 0;
+    int mLastCycle = -1;
+    int mSent = 0;
+    int mReceived = 0;
+    double mRecentLoss = 0;
+    quint32 mAddress = 0;
+    int mAddressChanges = 0;
+
+    double mLastMS = 0;
+    double mMinMS = 0;
+    double mMaxMS = 0;
+    double mMeanMS = 0;
+    double mM2 = 0;             //welford's sum of squared differences from the mean
+    double mJitterMS = 0;
+
+    P2Quantile mP50;
+    P2Quantile mP90;
+    P2Quantile mP99;
+};
+
+#endif // HOPSTATS_H
@@ -0,0 +1,134 @@
+#include "inflight.h"
+
+InFlightTable::InFlightTable(int expected)
+{
+    int buckets = 16;
+    while (buckets < expected * 2)
+        buckets <<= 1;
+    mBuckets.fill(Bucket{0, -1}, buckets);
+    mMask = buckets - 1;
+    mRecords.reserve(expected);
+}
+
+quint64 InFlightTable::hash(quint64 key)
+{
+    //splitmix64 finalizer, the ids are far from random
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+int InFlightTable::findSlot(quint64 id) const
+{
+    for (quint64 i = hash(id) & mMask; ; i = (i + 1) & mMask) {
+        const Bucket& b = mBuckets[i];
+        if (b.record < 0 || b.id == id)
+            return int(i);
+    }
+}
+
+void InFlightTable::grow()
+{
+    QVector<Bucket> old = mBuckets;
+    mBuckets.fill(Bucket{0, -1}, old.size() * 2);
+    mMask = mBuckets.size() - 1;
+    for (const Bucket& b : old) {
+        if (b.record >= 0)
+            mBuckets[findSlot(b.id)] = b;
+    }
+}
+
+bool InFlightTable::insert(const InFlightProbe& probe, qint64 deadlineNs)
+{
+    if ((mCount + 1) * 2 > mBuckets.size())
+        grow();
+
+    int slot = findSlot(probe.id);
+    if (mBuckets[slot].record >= 0)
+        return false;
+
+    int record;
+    if (!mFree.isEmpty()) {
+        record = mFree.takeLast();
+        mRecords[record] = probe;
+    } else {
+        record = mRecords.size();
+        mRecords.append(probe);
+    }
+
+    mBuckets[slot] = Bucket{probe.id, record};
+    ++mCount;
+    mWheel.schedule(record, deadlineNs);
+    return true;
+}
+
+InFlightProbe* InFlightTable::find(quint64 id)
+{
+    int slot = findSlot(id);
+    if (mBuckets[slot].record < 0)
+        return nullptr;
+    return &mRecords[mBuckets[slot].record];
+}
+
+void InFlightTable::eraseSlot(int slot)
+{
+    //pull later entries of the run back so lookups never hit a hole before their entry
+    quint64 hole = slot;
+    for (quint64 i = (hole + 1) & mMask; mBuckets[i].record >= 0; i = (i + 1) & mMask) {
+        quint64 home = hash(mBuckets[i].id) & mMask;
+        //move it if its home is not in (hole, i], cyclically
+        if (((i - home) & mMask) >= ((i - hole) & mMask)) {
+            mBuckets[hole] = mBuckets[i];
+            hole = i;
+        }
+    }
+    mBuckets[hole].record = -1;
+    --mCount;
+}
+
+void InFlightTable::release(int record)
+{
+    mRecords[record].owner = nullptr;
+    mFree.append(record);
+}
+
+bool InFlightTable::take(quint64 id, InFlightProbe* probe)
+{
+    int slot = findSlot(id);
+    int record = mBuckets[slot].record;
+    if (record < 0)
+        return false;
+
+    if (probe)
+        *probe = mRecords[record];
+    mWheel.cancel(record);
+    eraseSlot(slot);
+    release(record);
+    return true;
+}
+
+bool InFlightTable::reschedule(quint64 id, qint64 deadlineNs)
+{
+    int record = mBuckets[findSlot(id)].record;
+    if (record < 0)
+        return false;
+    mWheel.schedule(record, deadlineNs);
+    return true;
+}
+
+const QVector<InFlightProbe>& InFlightTable::expire(qint64 nowNs)
+{
+    mFired.resize(0);
+    mExpired.resize(0);
+    mWheel.advance(nowNs, mFired);
+    for (int record : mFired) {
+        const InFlightProbe& probe = mRecords[record];
+        mExpired.append(probe);
+        eraseSlot(findSlot(probe.id));
+        release(record);
+    }
+    return mExpired;
+}
@@ -0,0 +1,77 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include "timingwheel.h"
+
+#include <QtGlobal>
+#include <QVector>
+
+class TraceState;
+
+struct InFlightProbe
+{
+    quint64 id = 0;             //InFlightTable::probeId
+    TraceState* owner = nullptr;
+    int ttl = 0;
+    int index = 0;              //probe number within its ttl
+    qint64 sentNs = 0;          //monotonic, for the timeout
+    qint64 txNs = 0;            //probe clock, for the rtt
+};
+
+//every probe a worker has in flight, keyed by probe id, each with its timeout on a timing
+// wheel. lookup, insert, remove and arming or cancelling the timeout are all O(1), so
+// a reply costs the same with ten probes out or a few hundred thousand.
+// the index is a flat open addressing table (linear probing, backward shift deletion)
+// pointing into a pool of records that are reused through a free list
+class InFlightTable
+{
+public:
+    explicit InFlightTable(int expected = 64);
+
+    //a probe is identified by where it went and the ports it went with
+    static quint64 probeId(quint32 destination, quint16 sourcePort, quint16 destinationPort)
+    {
+        return (quint64(destination) << 32) | (quint32(sourcePort) << 16) | destinationPort;
+    }
+
+    int size() const { return mCount; }
+
+    //false if a probe with that id is already in flight
+    bool insert(const InFlightProbe& probe, qint64 deadlineNs);
+    //null if it isn't in flight (anymore)
+    InFlightProbe* find(quint64 id);
+    bool take(quint64 id, InFlightProbe* probe = nullptr);
+    //moves the timeout of a probe in flight
+    bool reschedule(quint64 id, qint64 deadlineNs);
+
+    //removes the probes whose deadline has passed and returns them, the list is
+    // good until the next call
+    const QVector<InFlightProbe>& expire(qint64 nowNs);
+    //earliest deadline, -1 if nothing is in flight
+    qint64 nextDeadline() const { return mWheel.nextDeadline(); }
+
+private:
+    static quint64 hash(quint64 key);
+    int findSlot(quint64 id) const;
+    void eraseSlot(int slot);
+    void grow();
+    void release(int record);
+
+    struct Bucket
+    {
+        quint64 id;
+        int record;             //-1 when empty
+    };
+
+    QVector<Bucket> mBuckets;   //power of two, kept at most half full
+    quint64 mMask;
+    int mCount = 0;
+
+    QVector<InFlightProbe> mRecords;
+    QVector<int> mFree;
+    TimingWheel mWheel;         //timer numbers are record numbers
+    QVector<int> mFired;
+    QVector<InFlightProbe> mExpired;
+};
+
+#endif // INFLIGHT_H
@@ -1,9 +1,75 @@
 #include "iphlpr.h"
+#include "metrics.h"
+#include "pacer.h"
+
+#include <QSaveFile>
+
+QString ProbeResult::addressString() const
+{
+    if (!address)
+        return "*";
+    return QHostAddress(address).toString();
+}
+
+void ProbeResult::toMap(QVariantMap& map) const
+{
+    map["session"] = session;
+    if (flags & Echo)
+        map["seq"] = seq;
+    else
+        map["ttl"] = ttl;
+    map["address"] = addressString();
+    if (timedOut()) {
+        map["timeout"] = true;
+    } else {
+        map["rtt"] = rttUs / 1000;
+        map["rttUs"] = rttUs;
+        map["icmpType"] = icmpType;
+        map["icmpCode"] = icmpCode;
+    }
+}
+
+IpSession::IpSession(int handle, IpHelperObject* helper)
+    : QObject{helper}
+    , mHelper(helper)
+    , mHandle(handle)
+{
+}
+
+int IpSession::cancel(bool bWait)
+{
+    return mHelper->cancelSession(mHandle, bWait);
+}
 
 IpHelperObject::IpHelperObject(QObject *parent)
     : QObject{parent}
 {
+    qRegisterMetaType<ProbeResult>();
+    qRegisterMetaType<QVector<ProbeResult> >();
+}
 
+void IpHelperObject::setProbeRate(int probesPerSecond, int burst)
+{
+    TokenBucket::global().setRate(probesPerSecond, burst);
+}
+
+QVariantMap IpHelperObject::metrics()
+{
+    return EngineMetrics::toMap(EngineMetrics::snapshot());
+}
+
+bool IpHelperObject::writeMetrics(const QString& fileName)
+{
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    file.write(EngineMetrics::toPrometheus(EngineMetrics::snapshot()));
+    return file.commit();
+}
+
+IpSession* IpHelperObject::session(int handle) const
+{
+    return nullptr;
 }
 
 int IpHelperObject::asyncPing(const QString& strAddress, const QVariantMap& mapOptions)
@@ -11,16 +77,31 @@ int IpHelperObject::asyncPing(const QString& strAddress, const QVariantMap& mapO
     return 0;
 }
 
+int IpHelperObject::asyncPingBatch(const QStringList& addresses, const QVariantMap& mapOptions)
+{
+    return 0;
+}
+
 int IpHelperObject::asyncTrace(const QString& strAddress, const QVariantMap& mapOptions)
 {
     return 0;
 }
 
+int IpHelperObject::asyncTraceBatch(const QStringList& addresses, const QVariantMap& mapOptions)
+{
+    return 0;
+}
+
 int IpHelperObject::cancelAsync(bool bWait)
 {
     return 0;
 }
 
+int IpHelperObject::cancelSession(int handle, bool bWait)
+{
+    return -1;
+}
+
 bool IpHelperObject::isAsync()
 {
     return false;
@@ -4,6 +4,8 @@
 #include <QObject>
 #include <QVariantMap>
 #include <QHostAddress>
+#include <QStringList>
+#include <QVector>
 
 #include <sys/socket.h>
 
@@ -23,11 +25,35 @@ const int ALLOCATE_ECHO_REPLIES         = 4; //incase its a broadcast address wh
 
 //now that we might be sending more packets concurrently, we want to do some randomization
 // and throttling a little bit
-const int PACKET_INTERVAL               = 250; //ms spacing between send batches
-const int MIN_PACKET_INTERVAL           = 20;
-const int PACKET_SEND_BATCHES           = 1; //batches of packets to send at once. we were sending more but default to 1
-const int MAX_CONSECUTIVE_NULL_HOPS     = 5; //
+const int PACKET_INTERVAL               = 250; //ms, widest spacing for probes to a rate-limiting responder
+const int MIN_PACKET_INTERVAL           = 20;  //ms, where that spacing starts
+const int PACKET_SEND_BATCHES           = 1; //probes per trace per pass of asyncTraceBatch. a single trace fills a whole sendmmsg
+const int MAX_CONSECUTIVE_NULL_HOPS     = 5; //silent hops in a row before a trace gives up
+const int MIN_HOP_TIMEOUT               = 500; //ms, the adaptive per-hop timeout never goes below this
+const int DEFAULT_PROBE_RATE            = 10000; //probes and ping echoes per second for the whole process, see IpHelperObject::setProbeRate
+const int PROBE_RATE_BURST              = 64;  //probes that can go out back to back after a quiet spell
+const int MAX_RATE_LIMIT_RETRIES        = 2;   //resends per hop for probes lost to a rate-limiting responder
+const int MDA_CONFIDENCE                = 95;  //percent, how sure a multipath trace is that it saw every interface of a hop
+const int MDA_MAX_PROBES_PER_HOP        = 96;  //enough for 16 interfaces at 95%
+const int DOUBLETREE_SPLIT_TTL          = 8;   //asyncTraceBatch probes outward from here, then back until a hop the batch knows
 const int MAX_NULL_HOPS_REMOVE_ATEND    = 5; //increased this to 5 recently
+const int DEFAULT_BATCH_CONCURRENCY     = 4096; //traces in flight at once for asyncTraceBatch
+const int TRACE_WORKERS_IDLE            = 4;    //trace threads kept up between traces, see TraceWorkerPool
+const int DEFAULT_PING_RATE             = 1000; //echoes per second for asyncPing, across all targets. the process-wide cap above still applies
+const int CONTINUOUS_CYCLE_INTERVAL     = 1000; //ms from the start of one cycle of a continuous trace to the next
+const int CONTINUOUS_TAG_BLOCKS         = 4;   //cycles in a row that tag their probes differently
+const int RESULT_RING_SIZE              = 4096; //results a worker can get ahead of the consumer
+const int RESULT_DRAIN_WATERMARK        = 256;  //queued results that wake the consumer early
+const int RESULT_DRAIN_INTERVAL         = 50;   //ms, the consumer drains at least this often
+const int ARCHIVE_INDEX_INTERVAL        = 1024; //traces between the index blocks of a trace archive
+const int DNS_CACHE_ENTRIES             = 65536; //hop names kept by ReverseLookupCache, least recently used go first
+const int DNS_CACHE_TTL                 = 3600; //s, how long a hop's name is trusted
+const int DNS_NEGATIVE_TTL              = 300;  //s, an address without a name isn't asked about again for this long
+const int DNS_MAX_LOOKUPS               = 32;   //lookups out at once per cache, reverse and forward, the rest queue
+const int DNS_LOOKUP_WAIT               = 5000; //ms TRACE_FLAGS_WAITFORLOOKUP holds a final back at most
+const int DNS_FORWARD_ENTRIES           = 16384; //target names kept by HostResolver
+const int DNS_FORWARD_TTL               = 300;  //s, how long a target's address is reused without asking again
+const int DNS_FORWARD_NEGATIVE_TTL      = 60;   //s, a name that doesn't exist isn't asked about again for this long
 
 // win specific: to be moved to win32hlpr.h
 //const int DEFAULT_IP_FLAGS              = IP_FLAG_DF;
@@ -127,6 +153,63 @@ public:
     void toHop(int hop, QVariantMap& map, int startTTL);
 };
 
+//one probe's outcome as it comes off a worker, plain data so it's cheap to queue across threads.
+// the string and QVariantMap forms are only built for whoever asks for them
+struct ProbeResult
+{
+    enum Flags {
+        TimedOut        = 0x01,         //no reply, for traces address is 0 as well
+        Echo            = 0x02,         //an asyncPing echo, seq is set instead of ttl
+        Shared          = 0x04,         //not probed, taken from another trace of the batch that crossed the same hop
+    };
+
+    qint32 session = 0;         //the handle of the async call it belongs to
+    qint32 index = 0;           //trace or target within a batch
+    quint32 address = 0;        //responder, host order
+    quint32 rttUs = 0;
+    quint32 seq = 0;
+    quint16 ttl = 0;
+    quint8 icmpType = 0;
+    quint8 icmpCode = 0;
+    quint8 recvTTL = 0;         //ttl left on the reply's ip header, 0 if unknown
+    quint8 flags = 0;
+
+    bool timedOut() const { return flags & TimedOut; }
+    QString addressString() const;
+    //the keys pingResult has always carried: ttl or seq, address, rtt (ms), rttUs or timeout. and session
+    void toMap(QVariantMap& map) const;
+};
+Q_DECLARE_METATYPE(ProbeResult)
+
+class IpHelperObject;
+
+//one asyncTrace, asyncTraceBatch or asyncPing(Batch) of a helper, for whoever started it: it
+// hears only its own results, where the helper's signals carry every session's. connect
+// right after the call, nothing is delivered before the event loop runs. it's deleted
+// (deleteLater) once finished is out, keep a QPointer to it rather than a plain one
+class IpSession : public QObject
+{
+    Q_OBJECT
+public:
+    IpSession(int handle, IpHelperObject* helper);
+
+    int handle() const { return mHandle; }
+public slots:
+    //IpHelperObject::cancelSession for this one
+    int cancel(bool bWait = true);
+signals:
+    void probeResults(const QVector<ProbeResult>& results);
+    void traceHop(const QVariantMap& map);
+    void traceHost(const QVariantMap& map);     //a hop address' name, once it's known
+    void traceFinal(const QVariantMap& map);    //per trace, a batch has one per address
+    void pingFinal(const QVariantMap& map);     //per target
+    //the last thing it says. a single trace's traceFinal map, a batch's batchFinal map,
+    // "canceled" if it was
+    void finished(const QVariantMap& map);
+private:
+    IpHelperObject* mHelper;
+    int mHandle;
+};
 
 class IpHelperObject : public QObject
 {
@@ -136,6 +219,17 @@ public:
     virtual ~IpHelperObject() = default;
 
     static IpHelperObject* Create(QObject* parent);
+    //caps probes per second across every trace, batch and ping of the process, <= 0 is unlimited
+    static void setProbeRate(int probesPerSecond, int burst = PROBE_RATE_BURST);
+    //probes sent, replies matched, timeouts and the like, with latency histograms, for every
+    // trace and batch of the process so far. see EngineMetrics
+    static QVariantMap metrics();
+    //the same in prometheus text format. the file is replaced whole, a collector reading it
+    // never sees half of it
+    static bool writeMetrics(const QString& fileName);
+
+    //what an async call's handle stands for, null once it has finished
+    virtual IpSession* session(int handle) const;
 public:
     bool isTraceable(const QHostAddress& addr)
     {
@@ -152,10 +246,21 @@ public:
     #endif
     }
 public slots:
+    //the async calls return a session handle, -1 if they couldn't start. any number of sessions
+    // run at once, every result and every map they emit carries "session". names go through
+    // HostResolver, literals don't wait on it: the finals say what each target came to with
+    // "address", "family" and "resolution" (literal, cached or lookup), or "error". a session
+    // whose sockets failed says so with "error" in traceFinal, batchFinal or its finished map
     virtual int asyncPing(const QString& strAddress, const QVariantMap& mapOptions = QVariantMap());
+    //pings every address, pingResult per echo and pingFinal per target, both carry "target" (index into addresses)
+    virtual int asyncPingBatch(const QStringList& addresses, const QVariantMap& mapOptions = QVariantMap());
     virtual int asyncTrace(const QString& strAddress, const QVariantMap& mapOptions = QVariantMap());
+    //traces every address on one thread, results carry "trace" (index into addresses) and "destination"
+    virtual int asyncTraceBatch(const QStringList& addresses, const QVariantMap& mapOptions = QVariantMap());
 
+    //every session, cancelSession for one. a canceled session still ends with its finals
     virtual int cancelAsync(bool bWait = true);
+    virtual int cancelSession(int handle, bool bWait = true);
     virtual bool isAsync();
     virtual bool isCanceled();
     virtual bool isRunning();
@@ -163,14 +268,24 @@ signals:
     //you can connect up to intermediate signals of
     // the pings of a trace and the hops
     void pingResult(const QVariantMap& map); //indivdual ping
+    void probeResult(const ProbeResult& result); //the same, without the map. batches get index, not destination
+    void probeResults(const QVector<ProbeResult>& results); //every probeResult of one drain, in order
     void pingFinal(const QVariantMap& map);	//ping final
 
-    //for trace you get a pingResult, then traceHop, then traceFinal
+    //for trace you get a pingResult, then traceHop, then traceFinal.
+    // traceHop comes once per hop and cycle with the hop's running stats, see HopStats,
+    // and the name of its address if that's known by then
     void traceHop(const QVariantMap& map);
+    //the name of a hop address once a lookup found one: session, address, host. a session
+    // hears of an address once, sooner if the name was cached. turn lookups off with mapOptions
+    // "lookup" false, mapOptions "flags" without TRACE_FLAGS_WAITFORLOOKUP doesn't hold the
+    // final back for them
     void traceHost(const QVariantMap& map);		//trace host lookup
     void traceFinished(const QVariantMap& map); //trace part is done but we may still ping or connect
     void traceFinal(const QVariantMap& map);	//trace final after everything
+    void batchFinal(const QVariantMap& map);    //every trace of an asyncTraceBatch is done
 
+    //every reverse lookup a session of this helper waited on: address, host (empty if it has none)
     void hostLookup(const QVariantMap& map);
 };
 
@@ -1,5 +1,4 @@
 #include "mainwindow.h"
-#include "traceroute.h"
 
 #include <QVBoxLayout>
 #include <QHBoxLayout>
@@ -40,18 +39,30 @@ public:
         connect(edit, &QLineEdit::returnPressed, [=](){
             QString hostname = edit->text();
 
-            connect(helper, &IpHelperObject::pingResult, [=](const QVariantMap& map){
-                int ttl = map["ttl"].toInt();
-                QString address = map["address"].toString();
-                int rtt = map["rtt"].toInt();
-                QString log = QString("%1  %2     %3")
-                                .arg(ttl, 2)
-                                .arg(address)
-                                .arg(!rtt ? "" : QString("%1 ms").arg(rtt));
-                te->append(log);
+            //a session per trace, its connections go with it once it's finished
+            IpSession* session = helper->session(helper->asyncTrace(hostname));
+            if (!session)
+                return;
+
+            //one append per drained batch, not one layout pass per probe
+            connect(session, &IpSession::probeResults, te, [=](const QVector<ProbeResult>& results){
+                QStringList lines;
+                lines.reserve(results.size());
+                for (const ProbeResult& result : results) {
+                    lines.append(QString("%1  %2     %3")
+                                    .arg(result.ttl, 2)
+                                    .arg(result.addressString())
+                                    .arg(result.timedOut() ? "" : QString("%1 ms").arg(result.rttUs / 1000.0, 0, 'f', 3)));
+                }
+                te->append(lines.join('\n'));
             });
 
-            connect(helper, &IpHelperObject::traceFinal, [=](){
+            //names come in after the hops, the final waits for them
+            connect(session, &IpSession::traceHost, te, [=](const QVariantMap& map){
+                te->append(QString("%1  %2").arg(map.value("address").toString(), map.value("host").toString()));
+            });
+
+            connect(session, &IpSession::finished, this, [=](){
 //                QMessageBox msgBox;
 //                msgBox.setText("failed");
 //                msgBox.exec();
@@ -64,9 +75,11 @@ public:
                 edit->setFocus();
             });
 
-            edit->setDisabled(true);
+            connect(cancel, &QPushButton::clicked, session, [=]() {
+                session->cancel();
+            });
 
-            helper->asyncTrace(hostname);
+            edit->setDisabled(true);
 
             cancel->setDisabled(false);
 
@@ -74,10 +87,6 @@ public:
         });
 
         cancel->setDisabled(true);
-
-        connect(cancel, &QPushButton::clicked, [=]() {
-            helper->cancelAsync();
-        });
     }
 };
 
@@ -0,0 +1,217 @@
+#include "metrics.h"
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QVector>
+
+#include <chrono>
+
+namespace {
+
+struct Shard
+{
+    std::atomic<quint64> counters[EngineMetrics::CounterCount];
+    std::atomic<quint64> counts[EngineMetrics::HistogramCount];
+    std::atomic<quint64> sumsNs[EngineMetrics::HistogramCount];
+    std::atomic<quint64> buckets[EngineMetrics::HistogramCount][EngineMetrics::Buckets];
+
+    Shard()
+    {
+        for (auto& counter : counters)
+            counter.store(0, std::memory_order_relaxed);
+        for (int h = 0; h < EngineMetrics::HistogramCount; ++h) {
+            counts[h].store(0, std::memory_order_relaxed);
+            sumsNs[h].store(0, std::memory_order_relaxed);
+            for (auto& bucket : buckets[h])
+                bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    //only the owning thread writes, a load and a store is all an increment needs
+    static void bump(std::atomic<quint64>& value, quint64 by)
+    {
+        value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    void addTo(EngineMetrics::Snapshot& snapshot) const
+    {
+        for (int c = 0; c < EngineMetrics::CounterCount; ++c)
+            snapshot.counters[c] += counters[c].load(std::memory_order_relaxed);
+        for (int h = 0; h < EngineMetrics::HistogramCount; ++h) {
+            snapshot.counts[h] += counts[h].load(std::memory_order_relaxed);
+            snapshot.sumsNs[h] += sumsNs[h].load(std::memory_order_relaxed);
+            for (int b = 0; b < EngineMetrics::Buckets; ++b)
+                snapshot.buckets[h][b] += buckets[h][b].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+//every live shard, and what the threads that are gone left behind
+struct Registry
+{
+    QMutex lock;
+    QVector<Shard*> shards;
+    EngineMetrics::Snapshot retired;
+};
+
+Registry& registry()
+{
+    static Registry registry;
+    return registry;
+}
+
+//registers on a thread's first count, folds into retired when the thread exits
+struct ThreadShard
+{
+    Shard shard;
+
+    ThreadShard()
+    {
+        Registry& r = registry();
+        QMutexLocker locker(&r.lock);
+        r.shards.append(&shard);
+    }
+
+    ~ThreadShard()
+    {
+        Registry& r = registry();
+        QMutexLocker locker(&r.lock);
+        shard.addTo(r.retired);
+        r.shards.removeOne(&shard);
+    }
+};
+
+Shard& shard()
+{
+    thread_local ThreadShard threadShard;
+    return threadShard.shard;
+}
+
+int bucketFor(qint64 ns)
+{
+    int bucket = 0;
+    for (quint64 v = quint64(qMax<qint64>(0, ns)); v && bucket < EngineMetrics::Buckets - 1; v >>= 1)
+        ++bucket;
+    return bucket;
+}
+
+const char* const counterNames[EngineMetrics::CounterCount] = {
+    "probes_sent",
+    "replies_received",
+    "replies_matched",
+    "foreign_icmp",
+    "unmatched_replies",
+    "probe_timeouts",
+};
+
+const char* const counterHelp[EngineMetrics::CounterCount] = {
+    "Probes handed to the kernel.",
+    "ICMP messages read, ours or not.",
+    "Replies matched to a probe in flight.",
+    "ICMP messages that answer no probe of ours.",
+    "Replies to our probes that came late or twice.",
+    "Probes that never got an answer.",
+};
+
+const char* const histogramNames[EngineMetrics::HistogramCount] = {
+    "syscall",
+    "wakeup_to_parse",
+    "result_to_consumer",
+};
+
+const char* const histogramHelp[EngineMetrics::HistogramCount] = {
+    "Time in each send, receive or error queue read.",
+    "Time from the wait returning to a batch of replies being parsed.",
+    "Time from a result being queued to the consumer taking it.",
+};
+
+}
+
+void EngineMetrics::add(Counter counter, quint64 count)
+{
+    if (count)
+        Shard::bump(shard().counters[counter], count);
+}
+
+void EngineMetrics::record(Histogram histogram, qint64 ns)
+{
+    Shard& s = shard();
+    Shard::bump(s.counts[histogram], 1);
+    Shard::bump(s.sumsNs[histogram], quint64(qMax<qint64>(0, ns)));
+    Shard::bump(s.buckets[histogram][bucketFor(ns)], 1);
+}
+
+qint64 EngineMetrics::clockNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+EngineMetrics::Snapshot EngineMetrics::snapshot()
+{
+    Registry& r = registry();
+    QMutexLocker locker(&r.lock);
+    Snapshot snapshot = r.retired;
+    for (const Shard* s : r.shards)
+        s->addTo(snapshot);
+    return snapshot;
+}
+
+qint64 EngineMetrics::Snapshot::percentileNs(Histogram histogram, int percent) const
+{
+    quint64 rank = (counts[histogram] * quint64(percent) + 99) / 100;
+    quint64 seen = 0;
+    for (int b = 0; b < Buckets; ++b) {
+        seen += buckets[histogram][b];
+        if (seen && seen >= rank)
+            return qint64(1) << b;
+    }
+    return 0;
+}
+
+QVariantMap EngineMetrics::toMap(const Snapshot& snapshot)
+{
+    QVariantMap map;
+    for (int c = 0; c < CounterCount; ++c)
+        map[counterNames[c]] = snapshot.counters[c];
+    for (int h = 0; h < HistogramCount; ++h) {
+        QVariantMap histogram;
+        histogram["count"] = snapshot.counts[h];
+        histogram["sumNs"] = snapshot.sumsNs[h];
+        histogram["p50Ns"] = snapshot.percentileNs(Histogram(h), 50);
+        histogram["p99Ns"] = snapshot.percentileNs(Histogram(h), 99);
+        map[histogramNames[h]] = histogram;
+    }
+    return map;
+}
+
+QByteArray EngineMetrics::toPrometheus(const Snapshot& snapshot)
+{
+    QByteArray text;
+    for (int c = 0; c < CounterCount; ++c) {
+        QByteArray name = QByteArray("traceroute_") + counterNames[c] + "_total";
+        text += "# HELP " + name + ' ' + counterHelp[c] + '\n';
+        text += "# TYPE " + name + " counter\n";
+        text += name + ' ' + QByteArray::number(snapshot.counters[c]) + '\n';
+    }
+
+    // buckets in seconds as prometheus wants them, cumulative, up to the last one in use
+    for (int h = 0; h < HistogramCount; ++h) {
+        QByteArray name = QByteArray("traceroute_") + histogramNames[h] + "_seconds";
+        text += "# HELP " + name + ' ' + histogramHelp[h] + '\n';
+        text += "# TYPE " + name + " histogram\n";
+        int last = Buckets - 2;
+        while (last > 0 && !snapshot.buckets[h][last])
+            --last;
+        quint64 cumulative = 0;
+        for (int b = 0; b <= last; ++b) {
+            cumulative += snapshot.buckets[h][b];
+            text += name + "_bucket{le=\"" + QByteArray::number((qint64(1) << b) / 1e9, 'g', 6) + "\"} "
+                    + QByteArray::number(cumulative) + '\n';
+        }
+        text += name + "_bucket{le=\"+Inf\"} " + QByteArray::number(snapshot.counts[h]) + '\n';
+        text += name + "_sum " + QByteArray::number(snapshot.sumsNs[h] / 1e9, 'g', 9) + '\n';
+        text += name + "_count " + QByteArray::number(snapshot.counts[h]) + '\n';
+    }
+    return text;
+}
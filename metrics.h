@@ -0,0 +1,67 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QByteArray>
+#include <QDebug>
+#include <QVariantMap>
+
+#include <atomic>
+
+//per-probe logging. compiled out of release builds (QT_NO_DEBUG): in the hot loop even a
+// qDebug that goes nowhere formats its arguments
+#ifdef QT_NO_DEBUG
+#define probeDebug() QT_NO_QDEBUG_MACRO()
+#else
+#define probeDebug() qDebug()
+#endif
+
+//counters and latency histograms of the probe engine, for the whole process. every thread
+// writes to a shard of its own with plain relaxed stores, no lock and no shared cache line;
+// snapshot() adds the shards up. a thread that exits folds its shard into the total, so
+// nothing counted is lost. the hot loops count into locals and add once per batch
+class EngineMetrics
+{
+public:
+    enum Counter {
+        ProbesSent,             //handed to the kernel (or the simulated network)
+        RepliesReceived,        //icmp messages read, ours or not
+        RepliesMatched,         //a reply to a probe in flight
+        ForeignIcmp,            //not an answer to any probe of ours
+        UnmatchedReplies,       //ours, but late or a duplicate
+        Timeouts,               //probes that never got an answer
+        CounterCount
+    };
+
+    enum Histogram {
+        SyscallNs,              //each send, receive or error queue read
+        WakeupToParseNs,        //from the wait returning to a batch of replies being parsed
+        ResultToConsumerNs,     //from a result going into the ring to the consumer taking it
+        HistogramCount
+    };
+
+    //bucket i holds values below 2^i ns and at least 2^(i-1), the last one everything above
+    static const int Buckets = 40;
+
+    struct Snapshot
+    {
+        quint64 counters[CounterCount] = {};
+        quint64 counts[HistogramCount] = {};
+        quint64 sumsNs[HistogramCount] = {};
+        quint64 buckets[HistogramCount][Buckets] = {};
+
+        //upper bound of the bucket the percentile falls in, 0 with nothing recorded
+        qint64 percentileNs(Histogram histogram, int percent) const;
+    };
+
+    static void add(Counter counter, quint64 count = 1);
+    static void record(Histogram histogram, qint64 ns);
+    //monotonic, whatever clock the trace itself runs on
+    static qint64 clockNs();
+
+    static Snapshot snapshot();
+    static QVariantMap toMap(const Snapshot& snapshot);
+    //prometheus text exposition format, for node_exporter's textfile collector and the like
+    static QByteArray toPrometheus(const Snapshot& snapshot);
+};
+
+#endif // METRICS_H
@@ -0,0 +1,118 @@
+#include "pacer.h"
+
+#include <QMutexLocker>
+
+#include <chrono>
+
+//answers in a row before a responder's spacing is halved
+static const int RESPONDER_RECOVERY_RUN = 16;
+//responders tracked at once, past that the table starts over
+static const int RESPONDER_PACER_SIZE = 65536;
+
+TokenBucket::TokenBucket(int ratePerSecond, int burst)
+{
+    setRate(ratePerSecond, burst);
+}
+
+TokenBucket& TokenBucket::global()
+{
+    static TokenBucket bucket;
+    return bucket;
+}
+
+qint64 TokenBucket::clockNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TokenBucket::setRate(int ratePerSecond, int burst)
+{
+    qint64 interval = ratePerSecond > 0 ? qMax<qint64>(1, 1000000000 / ratePerSecond) : 0;
+    mIntervalNs.store(interval, std::memory_order_relaxed);
+    mBurstNs.store(interval * qMax(1, burst), std::memory_order_relaxed);
+}
+
+int TokenBucket::take(int wanted)
+{
+    qint64 interval = mIntervalNs.load(std::memory_order_relaxed);
+    if (!interval || wanted <= 0)
+        return qMax(0, wanted);
+
+    qint64 burst = mBurstNs.load(std::memory_order_relaxed);
+    qint64 now = clockNs();
+    qint64 empty = mEmptyNs.load(std::memory_order_relaxed);
+    for (;;) {
+        //a bucket that ran dry in the past is full again, not owed the difference
+        qint64 from = qMax(empty, now);
+        qint64 available = (now + burst - from) / interval;
+        if (available <= 0)
+            return 0;
+        int count = (int) qMin<qint64>(available, wanted);
+        if (mEmptyNs.compare_exchange_weak(empty, from + count * interval, std::memory_order_relaxed))
+            return count;
+    }
+}
+
+void TokenBucket::giveBack(int count)
+{
+    qint64 interval = mIntervalNs.load(std::memory_order_relaxed);
+    if (interval && count > 0)
+        mEmptyNs.fetch_sub(count * interval, std::memory_order_relaxed);
+}
+
+qint64 TokenBucket::waitNs() const
+{
+    qint64 interval = mIntervalNs.load(std::memory_order_relaxed);
+    if (!interval)
+        return 0;
+    qint64 wait = mEmptyNs.load(std::memory_order_relaxed) + interval
+                  - mBurstNs.load(std::memory_order_relaxed) - clockNs();
+    return qMax<qint64>(0, wait);
+}
+
+ResponderPacer& ResponderPacer::global()
+{
+    static ResponderPacer pacer;
+    return pacer;
+}
+
+qint64 ResponderPacer::answered(quint32 responder)
+{
+    QMutexLocker locker(&mLock);
+    auto it = mResponders.find(responder);
+    if (it == mResponders.end())
+        return 0;
+
+    if (++it->answered < RESPONDER_RECOVERY_RUN)
+        return it->spacingNs;
+
+    it->answered = 0;
+    it->spacingNs /= 2;
+    if (it->spacingNs < qint64(MIN_PACKET_INTERVAL) * 1000000) {
+        mResponders.erase(it);
+        return 0;
+    }
+    return it->spacingNs;
+}
+
+bool ResponderPacer::lost(quint32 responder, qint64& spacingNs)
+{
+    const qint64 minSpacingNs = qint64(MIN_PACKET_INTERVAL) * 1000000;
+    const qint64 maxSpacingNs = qint64(PACKET_INTERVAL) * 1000000;
+
+    QMutexLocker locker(&mLock);
+    if (mResponders.size() >= RESPONDER_PACER_SIZE && !mResponders.contains(responder))
+        mResponders.clear();
+
+    Responder& r = mResponders[responder];
+    r.answered = 0;
+    if (r.spacingNs >= maxSpacingNs) {
+        //as slow as we go and still losing, that's not a rate limit
+        spacingNs = r.spacingNs;
+        return false;
+    }
+    r.spacingNs = r.spacingNs ? qMin(2 * r.spacingNs, maxSpacingNs) : minSpacingNs;
+    spacingNs = r.spacingNs;
+    return true;
+}
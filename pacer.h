@@ -0,0 +1,67 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include "iphlpr.h"
+
+#include <QHash>
+#include <QMutex>
+
+#include <atomic>
+
+//the probe budget of the whole process, every trace, batch and ping sweep draws from it.
+// kept as the time the bucket runs dry (gcra) rather than a token count, so taking
+// tokens is one compare-and-swap and it refills without anyone ticking it
+class TokenBucket
+{
+public:
+    explicit TokenBucket(int ratePerSecond = DEFAULT_PROBE_RATE, int burst = PROBE_RATE_BURST);
+
+    static TokenBucket& global();
+
+    //probes per second, <= 0 lifts the limit
+    void setRate(int ratePerSecond, int burst = PROBE_RATE_BURST);
+
+    //takes up to wanted tokens and returns how many it got
+    int take(int wanted);
+    //returns tokens taken but not spent
+    void giveBack(int count);
+    //ns until the next token, 0 if there is one now
+    qint64 waitNs() const;
+
+private:
+    static qint64 clockNs();
+
+    std::atomic<qint64> mEmptyNs{0};    //the bucket is empty until then, full burst before it
+    std::atomic<qint64> mIntervalNs{0}; //0 is unlimited
+    std::atomic<qint64> mBurstNs{0};
+};
+
+//routers answer ttl exceeded out of a token bucket of their own, often a slow one, so a
+// burst of probes through one can come back with a "*" that has nothing to do with the path.
+// a responder that answers some probes of a hop and drops others gets its probes spaced,
+// from MIN_PACKET_INTERVAL doubling up to PACKET_INTERVAL, and the lost ones sent again.
+// loss that survives the widest spacing is real and isn't retried. a run of answers
+// halves the spacing again
+class ResponderPacer
+{
+public:
+    static ResponderPacer& global();
+
+    //an answer from the responder, returns the spacing its probes get from now on
+    qint64 answered(quint32 responder);
+    //a probe to a hop the responder answers was lost. true if that looks like its rate
+    // limit and the probe is worth sending again, spacingNs apart
+    bool lost(quint32 responder, qint64& spacingNs);
+
+private:
+    struct Responder
+    {
+        qint64 spacingNs = 0;
+        int answered = 0;       //since the spacing last changed
+    };
+
+    QMutex mLock;
+    QHash<quint32, Responder> mResponders;  //only the ones that are spaced out
+};
+
+#endif // PACER_H
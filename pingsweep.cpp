@@ -0,0 +1,341 @@
+#include "pingsweep.h"
+#include "checksum.h"
+#include "pacer.h"
+#include "probe.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QThread>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cmath>
+#include <random>
+
+//what we put after the icmp header, it comes back to us verbatim
+struct EchoPayload
+{
+    quint32 nonce;
+    quint32 target;
+    quint32 seq;
+    qint64 sentNs;
+};
+
+//an ip header with options in front of the largest echo we send
+static const int ECHO_REPLY_SIZE = 60 + ICMP_MINLEN + MAX_PACKET_SIZE;
+
+PingSweeper::PingSweeper(const PingOptions& options, const QVector<QHostAddress>& targets, ResultRing* results)
+: QObject()
+, mOptions(options)
+, mResults(results)
+, mSendBatch(PROBE_IO_BATCH, ICMP_MINLEN + MAX_PACKET_SIZE)
+, mRecvBatch(PROBE_IO_BATCH, ECHO_REPLY_SIZE)
+{
+    mOptions.count = qMax(1, mOptions.count);
+    mOptions.size = qBound((int) sizeof(EchoPayload), mOptions.size, MAX_PACKET_SIZE);
+    mOptions.rate = qMax(1, mOptions.rate);
+
+    mTargets.resize(targets.size());
+    for (int i = 0; i < targets.size(); ++i) {
+        mTargets[i].address = targets[i].toIPv4Address();
+        mTargets[i].answered.resize(mOptions.count);
+    }
+}
+
+void PingSweeper::stop()
+{
+    mShouldStop = true;
+    mWakeup.signal();
+}
+
+bool PingSweeper::openSocket()
+{
+    mSock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_ICMP);
+    if (mSock < 0)
+        return false;
+
+    int bufsize = 4 * 1024 * 1024;
+    setsockopt(mSock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(mSock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    enableRxTimestamps(mSock);
+
+    //linux ping sockets use the bound port as the echo id, and only hand us replies carrying it
+    sockaddr_in bindsa;
+    memset(&bindsa, 0, sizeof (bindsa));
+    bindsa.sin_family = AF_INET;
+    socklen_t bindlen = sizeof (bindsa);
+    if (bind(mSock, (sockaddr*) &bindsa, sizeof (bindsa)) == 0
+        && getsockname(mSock, (sockaddr*) &bindsa, &bindlen) == 0)
+        mIdent = ntohs(bindsa.sin_port);
+
+    std::random_device random;
+    if (!mIdent)
+        mIdent = random() & 0xffff;
+    mNonce = random();
+    return true;
+}
+
+bool PingSweeper::lastEchoSent(int target) const
+{
+    return mRound >= mOptions.count
+           || (mRound == mOptions.count - 1 && target < mCursor);
+}
+
+void PingSweeper::sendDue(qint64 nowNs)
+{
+    //whatever didn't fit last time goes first
+    mSendBatch.flush(mSock);
+    if (!mSendBatch.isEmpty())
+        return;
+
+    char packet[ICMP_MINLEN + MAX_PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    int length = ICMP_MINLEN + mOptions.size;
+
+    icmp* icmphdr = (icmp*) packet;
+    icmphdr->icmp_type = ICMP_ECHO;
+    icmphdr->icmp_code = 0;
+    icmphdr->icmp_id = htons(mIdent);
+
+    //echoes count against the process-wide probe budget like any trace probe
+    int tokens = 0;
+    while (mRound < mOptions.count && !mTargets.isEmpty()) {
+        if (!tokens && !(tokens = TokenBucket::global().take(mSendBatch.capacity())))
+            break;
+
+        if (mCursor == 0) {
+            if (nowNs < mRoundStartNs)
+                break;
+            mRoundStartNs = nowNs;
+        }
+
+        //the first echo goes out right away, after that rate per second. compared as time, the
+        // echoes due by now would overflow at high rates on a long run
+        if (mTotalSent * 1000000000 / mOptions.rate > nowNs)
+            break;
+
+        Target& t = mTargets[mCursor];
+
+        EchoPayload payload;
+        payload.nonce = mNonce;
+        payload.target = mCursor;
+        payload.seq = t.sent;
+        payload.sentNs = probeClockNs();
+        memcpy(packet + ICMP_MINLEN, &payload, sizeof(payload));
+
+        icmphdr->icmp_seq = htons(++mSeq);
+        icmphdr->icmp_cksum = 0;
+        icmphdr->icmp_cksum = checksum(packet, length);
+        mSendBatch.add(t.address, 0, -1, packet, length);
+        --tokens;
+
+        ++t.sent;
+        t.lastSentNs = nowNs;
+        ++mTotalSent;
+
+        if (++mCursor == mTargets.size()) {
+            mCursor = 0;
+            ++mRound;
+            mRoundStartNs += qint64(mOptions.intervalMS) * 1000000;
+        }
+
+        if (mSendBatch.isFull()) {
+            mSendBatch.flush(mSock);
+            //the rest goes out once the buffer drains
+            if (!mSendBatch.isEmpty())
+                break;
+        }
+    }
+
+    TokenBucket::global().giveBack(tokens);
+    mSendBatch.flush(mSock);
+}
+
+void PingSweeper::drainReplies()
+{
+    int received;
+    do {
+        received = mRecvBatch.receive(mSock);
+        for (int i = 0; i < received; ++i) {
+            const char* reply = mRecvBatch.data(i);
+            int bytesRead = mRecvBatch.length(i);
+
+            //bsd hands us the ip header, linux doesn't
+            if (bytesRead > 0 && (reply[0] & 0xf0) == 0x40) {
+                int iphdrlen = (reply[0] & 0x0f) << 2;
+                reply += iphdrlen;
+                bytesRead -= iphdrlen;
+            }
+
+            if (bytesRead < ICMP_MINLEN + (int) sizeof(EchoPayload))
+                continue;
+
+            const icmp* icmphdr = (const icmp*) reply;
+            if (icmphdr->icmp_type != ICMP_ECHOREPLY || ntohs(icmphdr->icmp_id) != mIdent)
+                continue;
+
+            EchoPayload payload;
+            memcpy(&payload, reply + ICMP_MINLEN, sizeof(payload));
+            if (payload.nonce != mNonce
+                || payload.target >= (quint32) mTargets.size()
+                || payload.seq >= (quint32) mOptions.count)
+                continue;
+
+            //kernel receive time when we have it, so a busy thread doesn't show up in the rtt
+            qint64 receivedNs = mRecvBatch.timestamp(i);
+            if (!receivedNs)
+                receivedNs = probeClockNs();
+
+            Target& t = mTargets[payload.target];
+            if (t.finished
+                || t.answered[payload.seq]
+                || t.address != mRecvBatch.from(i)
+                || payload.sentNs > receivedNs)
+                continue;
+
+            qint64 rttNs = receivedNs - payload.sentNs;
+            double rttMS = rttNs / 1000000.0;
+            t.answered[payload.seq] = true;
+            if (!t.received++ || rttNs < t.minNs)
+                t.minNs = rttNs;
+            t.maxNs = qMax(t.maxNs, rttNs);
+            t.sumMS += rttMS;
+            t.sumSqMS += rttMS * rttMS;
+
+            emitEcho(payload.target, payload.seq, rttNs);
+
+            if (t.received == mOptions.count)
+                finalize(payload.target);
+        }
+    } while (received == mRecvBatch.capacity());
+}
+
+void PingSweeper::emitEcho(int target, int seq, qint64 rttNs)
+{
+    //the address stays set for a lost echo, it's the target either way
+    ProbeResult result;
+    result.index = target;
+    result.address = mTargets[target].address;
+    result.seq = seq;
+    result.flags = ProbeResult::Echo;
+    if (rttNs < 0) {
+        result.flags |= ProbeResult::TimedOut;
+    } else {
+        result.rttUs = rttNs / 1000;
+        result.icmpType = ICMP_ECHOREPLY;
+    }
+    mResults->push(result);
+}
+
+void PingSweeper::finalize(int target)
+{
+    Target& t = mTargets[target];
+    for (int seq = 0; seq < t.sent; ++seq) {
+        if (!t.answered[seq])
+            emitEcho(target, seq, -1);
+    }
+
+    QVariantMap stats;
+    stats["sent"] = t.sent;
+    stats["received"] = t.received;
+    stats["loss"] = t.sent ? 100.0 * (t.sent - t.received) / t.sent : 100.0;
+    if (t.received) {
+        double avg = t.sumMS / t.received;
+        stats["min"] = t.minNs / 1000000.0;
+        stats["avg"] = avg;
+        stats["max"] = t.maxNs / 1000000.0;
+        stats["stddev"] = std::sqrt(qMax(0.0, t.sumSqMS / t.received - avg * avg));
+    }
+    emit targetDone(target, stats);
+
+    t.finished = true;
+    t.answered = QVector<bool>();
+    ++mFinished;
+}
+
+void PingSweeper::finalizeExpired(qint64 nowNs)
+{
+    //targets get their last echo in order, so they expire in order too
+    qint64 timeoutNs = qint64(mOptions.timeoutMS) * 1000000;
+    while (mFinalizeCursor < mTargets.size() && lastEchoSent(mFinalizeCursor)) {
+        Target& t = mTargets[mFinalizeCursor];
+        if (!t.finished) {
+            if (nowNs - t.lastSentNs < timeoutNs)
+                return;
+            finalize(mFinalizeCursor);
+        }
+        ++mFinalizeCursor;
+    }
+}
+
+int PingSweeper::waitTimeoutMS(qint64 nowNs) const
+{
+    //with a batch still queued we wait on POLLOUT instead of the send schedule
+    qint64 wake = -1;
+    if (mRound < mOptions.count && mSendBatch.isEmpty()) {
+        wake = mTotalSent * 1000000000 / mOptions.rate;
+        if (mCursor == 0)
+            wake = qMax(wake, mRoundStartNs);
+        wake = qMax(wake, nowNs + TokenBucket::global().waitNs());
+    }
+
+    if (mFinalizeCursor < mTargets.size() && lastEchoSent(mFinalizeCursor)) {
+        qint64 expiry = mTargets[mFinalizeCursor].lastSentNs + qint64(mOptions.timeoutMS) * 1000000;
+        if (wake < 0 || expiry < wake)
+            wake = expiry;
+    }
+
+    //nothing due is a full send buffer, POLLOUT ends that wait. stop() signals the wakeup
+    if (wake < 0)
+        return -1;
+    return (int) qBound<qint64>(0, (wake - nowNs + 999999) / 1000000, INT_MAX);
+}
+
+void PingSweeper::process()
+{
+    if (!openSocket()) {
+        emit error("can't open the icmp socket");
+        return;
+    }
+
+    qDebug() << "Begin ping sweep of" << mTargets.size() << "targets at" << mOptions.rate << "echoes/s";
+
+    QElapsedTimer clock;
+    clock.start();
+
+    while (!mShouldStop && mFinished < mTargets.size()) {
+        sendDue(clock.nsecsElapsed());
+
+        //a leftover batch means the send buffer was full, wake up once it drains
+        pollfd pfd[2];
+        pfd[0].fd = mSock;
+        pfd[0].events = mSendBatch.isEmpty() ? POLLIN : POLLIN | POLLOUT;
+        pfd[0].revents = 0;
+        pfd[1].fd = mWakeup.fd();
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        int nready = poll(pfd, 2, waitTimeoutMS(clock.nsecsElapsed()));
+        if (nready < 0 && errno != EINTR) {
+            emit error("waiting on the icmp socket failed: " + qt_error_string());
+            break;
+        }
+
+        if (nready > 0 && (pfd[0].revents & POLLIN))
+            drainReplies();
+
+        finalizeExpired(clock.nsecsElapsed());
+        if (mResults->needsWakeup())
+            emit resultsReady();
+    }
+
+    close(mSock);
+    mSock = -1;
+
+    thread()->quit();
+}
@@ -0,0 +1,83 @@
+#ifndef PINGSWEEP_H
+#define PINGSWEEP_H
+
+#include "iphlpr.h"
+#include "probeio.h"
+#include "resultring.h"
+
+#include <QObject>
+#include <QHostAddress>
+#include <QVector>
+
+struct PingOptions
+{
+    int count = DEFAULT_ICMP_COUNT;         //echoes per target
+    int size = DEFAULT_ICMP_SIZE;           //icmp payload bytes
+    int timeoutMS = DEFAULT_ICMP_TIMEOUT;   //how long we wait on the last echo of a target
+    int intervalMS = PACKET_INTERVAL;       //spacing between rounds, a target sees one echo per round
+    int rate = DEFAULT_PING_RATE;           //echoes per second across all targets, each also takes a token from TokenBucket::global()
+};
+
+//pings a list of targets from one icmp socket. echoes go out in rounds, one per
+// target per round, paced to the configured rate. the payload carries the target,
+// the echo number and the send time, so any number of echoes can be in flight and
+// a reply is matched without a lookup table
+class PingSweeper: public QObject
+{
+    Q_OBJECT
+
+    struct Target
+    {
+        quint32 address = 0;
+        int sent = 0;
+        int received = 0;
+        qint64 lastSentNs = 0;
+        qint64 minNs = 0;
+        qint64 maxNs = 0;
+        double sumMS = 0;
+        double sumSqMS = 0;
+        bool finished = false;
+        QVector<bool> answered;
+    };
+
+    PingOptions mOptions;
+    QVector<Target> mTargets;
+    ResultRing* mResults;
+    int mSock = -1;
+    quint16 mIdent = 0;
+    quint32 mNonce = 0;
+    quint16 mSeq = 0;
+    std::atomic_bool mShouldStop{false};
+    Wakeup mWakeup;                     //polled with the socket, stop() signals it
+    SendBatch mSendBatch;
+    RecvBatch mRecvBatch;
+
+    //send position, round r goes to every target in order
+    int mRound = 0;
+    int mCursor = 0;
+    qint64 mRoundStartNs = 0;
+    qint64 mTotalSent = 0;
+    int mFinalizeCursor = 0;
+    int mFinished = 0;
+
+    bool openSocket();
+    void sendDue(qint64 nowNs);
+    void drainReplies();
+    void finalizeExpired(qint64 nowNs);
+    void finalize(int target);
+    void emitEcho(int target, int seq, qint64 rttNs);
+    bool lastEchoSent(int target) const;
+    int waitTimeoutMS(qint64 nowNs) const;
+public:
+    PingSweeper(const PingOptions& options, const QVector<QHostAddress>& targets, ResultRing* results);
+    virtual ~PingSweeper() {}
+public slots:
+    void process();
+    void stop();
+signals:
+    void resultsReady();                            //the ring crossed its watermark. index is the target, lost echoes are flagged TimedOut
+    void targetDone(int target, const QVariantMap& stats);  //its echoes are in the ring by now
+    void error(const QString& message);             //the sweep stops, targets still out never finish
+};
+
+#endif // PINGSWEEP_H
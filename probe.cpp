@@ -0,0 +1,164 @@
+#include "probe.h"
+#include "checksum.h"
+#include "probeio.h"
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Checksum routine for Internet Protocol family headers (C Version)
+ */
+u_short
+in_cksum(u_short *addr, int len)
+{
+    int nleft = len;
+    u_short *w = addr;
+    u_short answer;
+    int sum = 0;
+    
+    /*
+     *  Our algorithm is simple, using a 32 bit accumulator (sum),
+     *  we add sequential 16 bit words to it, and at the end, fold
+     *  back all the carry bits from the top 16 bits into the lower
+     *  16 bits.
+     */
+    while (nleft > 1)  {
+        sum += *w++;
+        nleft -= 2;
+    }
+    
+    /* mop up an odd byte, if necessary */
+    if (nleft == 1)
+        sum += *(u_char *)w;
+    
+    /*
+     * add back carry outs from top 16 bits to low 16 bits
+     */
+    sum = (sum >> 16) + (sum & 0xffff);	/* add hi 16 to low 16 */
+    sum += (sum >> 16);			/* add carry */
+    answer = ~sum;				/* truncate to 16 bits */
+    return (answer);
+}
+
+qint64 probeClockNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+//time exceeded in transit or any kind of unreachable, nothing else answers a probe
+static bool isProbeError(int type, int code)
+{
+    return (type == ICMP_TIMXCEED && code == ICMP_TIMXCEED_INTRANS) || type == ICMP_UNREACH;
+}
+
+bool parseProbeReply(const char* packet, int length, quint32 from, ProbeReply& reply)
+{
+    if (length < (int) sizeof(ip))
+        return false;
+
+    //the raw socket hands us the ip header. anything else is refused rather than
+    // read at the wrong offsets, icmp types we take all have a zero top nibble
+    const ip* iphdr = (const ip*) packet;
+    if (iphdr->ip_v != 4)
+        return false;
+    int iphdrlen = iphdr->ip_hl << 2;
+    if (iphdrlen < (int) sizeof(ip))
+        return false;
+
+    if (length - iphdrlen < ICMP_MINLEN)
+        return false;
+
+    const icmp* icmphdr = (const icmp*) (packet + iphdrlen);
+    if (!isProbeError(icmphdr->icmp_type, icmphdr->icmp_code))
+        return false;
+
+    //the quoted header starts 8 bytes into the icmp message
+    int innerOffset = iphdrlen + ICMP_MINLEN;
+    if (length - innerOffset < (int) sizeof(ip))
+        return false;
+
+    const ip* innerIpHdr = (const ip*) (packet + innerOffset);
+    int innerIpHdrLen = innerIpHdr->ip_hl << 2;
+
+    //routers only have to quote the first 8 bytes past the ip header, which is the whole udp header
+    if (length - innerOffset - innerIpHdrLen < (int) sizeof(udphdr)
+        || innerIpHdr->ip_p != IPPROTO_UDP)
+        return false;
+
+    const udphdr* udp = (const udphdr*) (packet + innerOffset + innerIpHdrLen);
+
+    reply.from = from;
+    reply.destination = ntohl(innerIpHdr->ip_dst.s_addr);
+    reply.sourcePort = ntohs(udp->uh_sport);
+    reply.destinationPort = ntohs(udp->uh_dport);
+    reply.checksum = ntohs(udp->uh_sum);
+    reply.icmpType = icmphdr->icmp_type;
+    reply.icmpCode = icmphdr->icmp_code;
+    reply.recvTTL = iphdr->ip_ttl;
+    return true;
+}
+
+bool probeReplyFromError(const QueuedError& error, quint16 sourcePort, ProbeReply& reply)
+{
+    if (!error.isIcmp || !isProbeError(error.icmpType, error.icmpCode))
+        return false;
+
+    //the outer ttl isn't on the error queue, nor is the quoted udp header.
+    // a paris probe has its tag in the payload too, which is there
+    reply.from = error.from;
+    reply.destination = error.destination;
+    reply.sourcePort = sourcePort;
+    reply.destinationPort = error.port;
+    reply.checksum = error.payloadTag;
+    reply.icmpType = error.icmpType;
+    reply.icmpCode = error.icmpCode;
+    reply.recvTTL = 0;
+    reply.timestampNs = error.timestampNs;
+    return true;
+}
+
+void fillParisProbe(char* payload, int length, quint32 source, quint32 destination,
+                    quint16 sourcePort, quint16 destinationPort, quint16 tag)
+{
+    Q_ASSERT(length >= 4);
+
+    //udp pseudo header followed by the udp header, checksum 0
+    struct {
+        quint32 source;
+        quint32 destination;
+        quint8 zero;
+        quint8 protocol;
+        quint16 udpLength;
+        quint16 sourcePort;
+        quint16 destinationPort;
+        quint16 length;
+        quint16 checksum;
+    } header;
+    header.source = htonl(source);
+    header.destination = htonl(destination);
+    header.zero = 0;
+    header.protocol = IPPROTO_UDP;
+    header.udpLength = header.length = htons(sizeof(udphdr) + length);
+    header.sourcePort = htons(sourcePort);
+    header.destinationPort = htons(destinationPort);
+    header.checksum = 0;
+
+    quint16 field = htons(tag);
+    memcpy(payload, &field, 2);
+    memset(payload + 2, 0, 2);
+
+    //one's complement sum of everything so far, the header's size is fixed so it's a few adds
+    quint16 sum = checksumFold(checksumAdd(payload, length, checksumAddFixed<sizeof(header)>(&header)));
+
+    //the checksum is ~(sum + fix), for it to be the tag fix has to be ~tag - sum
+    quint32 fix = quint16(~field) + quint16(~sum);
+    fix = (fix & 0xffff) + (fix >> 16);
+    quint16 word = fix;
+    memcpy(payload + 2, &word, 2);
+}
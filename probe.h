@@ -0,0 +1,53 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <QtGlobal>
+
+#include <sys/types.h>
+
+struct QueuedError;
+
+//what we could pull out of an icmp error that quotes one of our udp probes
+struct ProbeReply
+{
+    quint32 from = 0;           //responding router, host order
+    quint32 destination = 0;    //inner ip_dst of the quoted probe, host order
+    quint16 sourcePort = 0;     //inner udp sport
+    quint16 destinationPort = 0;//inner udp dport, this is what identifies the probe
+    quint16 checksum = 0;       //inner udp checksum, what identifies a paris probe instead
+    quint8 icmpType = 0;
+    quint8 icmpCode = 0;
+    quint8 recvTTL = 0;         //ttl left on the outer ip header
+    qint64 timestampNs = 0;     //kernel receive time on the probe clock, 0 if we don't have one
+};
+
+//what a reply is matched on: the destination port, or for paris probes, which all go to
+// the same port, the udp checksum
+inline quint16 probeTag(const ProbeReply& reply, bool paris)
+{
+    return paris ? reply.checksum : reply.destinationPort;
+}
+
+//parses an ip packet (header included, as the raw icmp socket hands it to us)
+// returns false if it isn't a time exceeded / unreachable quoting a udp probe
+bool parseProbeReply(const char* packet, int length, quint32 from, ProbeReply& reply);
+
+//the same for an icmp error taken off the udp socket's error queue. the kernel already
+// matched it to our socket, so the source port is ours
+bool probeReplyFromError(const QueuedError& error, quint16 sourcePort, ProbeReply& reply);
+
+//paris traceroute: every probe of a flow goes out with the same five tuple, so per-flow load
+// balancers keep it on one path. the tag goes in the first two bytes of the payload, the next
+// two are set so the udp checksum comes out as the tag as well; routers quote the udp header,
+// not necessarily the payload. source is the address the kernel sends from, see sourceAddressFor
+void fillParisProbe(char* payload, int length, quint32 source, quint32 destination,
+                    quint16 sourcePort, quint16 destinationPort, quint16 tag);
+
+//CLOCK_REALTIME in ns. it's what the kernel stamps packets with, so rtts are
+// measured on it; timeouts stay on the monotonic clock
+qint64 probeClockNs();
+
+//internet checksum over len bytes, the result goes into the header as is
+u_short in_cksum(u_short *addr, int len);
+
+#endif // PROBE_H
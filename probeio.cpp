@@ -0,0 +1,439 @@
+#include "probeio.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <sys/eventfd.h>
+
+static const int TTL_CONTROL_SPACE = CMSG_SPACE(sizeof(int));
+static const int RX_CONTROL_SPACE = CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(int));
+
+static qint64 toNs(const timespec& ts)
+{
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+bool enableRxTimestamps(int fd)
+{
+    int on = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0;
+}
+
+bool enableTxTimestamps(int fd)
+{
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE
+                | SOF_TIMESTAMPING_SOFTWARE
+                | SOF_TIMESTAMPING_OPT_ID
+                | SOF_TIMESTAMPING_OPT_TSONLY;
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+}
+
+bool enableIcmpErrors(int fd)
+{
+    int on = 1;
+    return setsockopt(fd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on)) == 0;
+}
+
+bool attachProbeFilter(int fd, quint16 sourcePortLow, quint16 sourcePortHigh)
+{
+    //offsets are from the outer ip header. X holds its length, then outer plus quoted
+    // ip header length, so the icmp header is at x+0 and the quoted udp header at x+8.
+    // a load past the end of the packet ends the program with 0, which drops it
+    sock_filter code[] = {
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                             //x = outer ip header length
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),                              //icmp type
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 3, 3, 0),                       //unreachable, any code
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 11, 0, 13),                     //time exceeded...
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 1),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 11),                      //...in transit
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8 + 9),                          //quoted ip protocol
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 9),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8),                              //quoted ip header length
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x0f),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 8),                              //quoted udp source port
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, sourcePortLow, 0, 2),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, sourcePortHigh, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, PROBE_REPLY_SIZE),                        //keep what a reply slot holds
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+
+    sock_fprog program;
+    program.len = sizeof(code) / sizeof(code[0]);
+    program.filter = code;
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) == 0;
+}
+
+quint32 sourceAddressFor(quint32 destination)
+{
+    //connecting a udp socket sends nothing, it only has the kernel pick the route
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return 0;
+
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(destination);
+    sa.sin_port = htons(9);
+    socklen_t length = sizeof(sa);
+    quint32 source = 0;
+    if (::connect(fd, (sockaddr*) &sa, sizeof(sa)) == 0
+        && getsockname(fd, (sockaddr*) &sa, &length) == 0)
+        source = ntohl(sa.sin_addr.s_addr);
+    close(fd);
+    return source;
+}
+
+SendBatch::SendBatch(int capacity, int maxLength)
+: mCapacity(qMax(1, capacity))
+, mMaxLength(qMax(1, maxLength))
+{
+    mData.resize(mCapacity * mMaxLength);
+    mLength.resize(mCapacity);
+    mTTL.resize(mCapacity);
+    mTag.resize(mCapacity);
+    mAddr.resize(mCapacity);
+    mControl.resize(mCapacity * TTL_CONTROL_SPACE);
+    mIov.resize(mCapacity);
+    mMsgs.resize(mCapacity);
+}
+
+void SendBatch::compact()
+{
+    if (!mHead)
+        return;
+
+    int n = size();
+    memmove(mData.data(), mData.constData() + mHead * mMaxLength, n * mMaxLength);
+    for (int i = 0; i < n; ++i) {
+        mLength[i] = mLength[mHead + i];
+        mTTL[i] = mTTL[mHead + i];
+        mTag[i] = mTag[mHead + i];
+        mAddr[i] = mAddr[mHead + i];
+    }
+    mHead = 0;
+    mCount = n;
+}
+
+void SendBatch::add(quint32 destination, quint16 port, int ttl, const char* data, int length, quint16 tag)
+{
+    if (mCount == mCapacity)
+        compact();
+    Q_ASSERT(mCount < mCapacity);
+
+    int i = mCount++;
+    length = qMin(length, mMaxLength);
+    memcpy(mData.data() + i * mMaxLength, data, length);
+    mLength[i] = length;
+    mTTL[i] = ttl;
+    mTag[i] = tag ? tag : port;
+
+    sockaddr_in& sa = mAddr[i];
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(destination);
+    sa.sin_port = htons(port);
+}
+
+int SendBatch::flush(int fd)
+{
+    int n = size();
+    if (!n)
+        return 0;
+
+    for (int i = 0; i < n; ++i) {
+        int e = mHead + i;
+        mIov[i].iov_base = mData.data() + e * mMaxLength;
+        mIov[i].iov_len = mLength[e];
+
+        msghdr& msg = mMsgs[i].msg_hdr;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &mAddr[e];
+        msg.msg_namelen = sizeof(sockaddr_in);
+        msg.msg_iov = &mIov[i];
+        msg.msg_iovlen = 1;
+
+        if (mTTL[e] >= 0) {
+            char* control = mControl.data() + i * TTL_CONTROL_SPACE;
+            memset(control, 0, TTL_CONTROL_SPACE);
+            msg.msg_control = control;
+            msg.msg_controllen = TTL_CONTROL_SPACE;
+
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = IPPROTO_IP;
+            cmsg->cmsg_type = IP_TTL;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &mTTL[e], sizeof(int));
+        }
+    }
+
+    //done counts what left the queue, sent or dropped
+    int sent = 0;
+    int done = 0;
+    bool retried = false;
+    while (done < n) {
+        int rc = sendmmsg(fd, mMsgs.data() + done, n - done, 0);
+        if (rc > 0) {
+            recordSent(mHead + done, rc);
+            done += rc;
+            sent += rc;
+            retried = false;
+            continue;
+        }
+
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+            break;
+        //with IP_RECVERR an icmp error for an earlier probe is also reported by the next
+        // send, which clears it. give the message a second go before deciding it's bad
+        if (!retried) {
+            retried = true;
+            continue;
+        }
+        //this one is never going out (unreachable net and such), skip it and keep the rest
+        ++done;
+        retried = false;
+    }
+
+    mHead += done;
+    if (mHead == mCount)
+        mHead = mCount = 0;
+    return sent;
+}
+
+void SendBatch::take(int count)
+{
+    count = qBound(0, count, size());
+    recordSent(mHead, count);
+    mHead += count;
+    if (mHead == mCount)
+        mHead = mCount = 0;
+}
+
+void SendBatch::trackTxTimestamps(int ringSize)
+{
+    mSentRing.resize(qMax(1, ringSize));
+    mTxKey = 0;
+}
+
+void SendBatch::recordSent(int first, int count)
+{
+    if (mSentRing.isEmpty())
+        return;
+
+    for (int i = first; i < first + count; ++i) {
+        SentProbe& sent = mSentRing[mTxKey % mSentRing.size()];
+        sent.key = mTxKey++;
+        sent.destination = ntohl(mAddr[i].sin_addr.s_addr);
+        sent.port = mTag[i];
+    }
+}
+
+int SendBatch::readErrorQueue(int fd, QueuedError* out, int max)
+{
+    int n = 0;
+    while (n < max) {
+        //the payload of an icmp error is our own datagram, only a paris tag in front is of interest
+        char control[512];
+        quint16 head = 0;
+        iovec iov;
+        iov.iov_base = &head;
+        iov.iov_len = sizeof(head);
+        sockaddr_in name;
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &name;
+        msg.msg_namelen = sizeof(name);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        qint64 stampedNs = 0;
+        qint64 receivedNs = 0;
+        const sock_extended_err* err = nullptr;
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                scm_timestamping ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                stampedNs = toNs(ts.ts[0]);
+            } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                receivedNs = toNs(ts);
+            } else if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) {
+                err = (const sock_extended_err*) CMSG_DATA(cmsg);
+            }
+        }
+
+        if (!err)
+            continue;
+
+        QueuedError& entry = out[n];
+        entry = QueuedError();
+
+        if (err->ee_origin == SO_EE_ORIGIN_ICMP) {
+            //msg_name is the quoted destination and port, the offender is whoever sent the error
+            const sockaddr_in* offender = (const sockaddr_in*) SO_EE_OFFENDER(err);
+            if (msg.msg_namelen < sizeof(sockaddr_in) || offender->sin_family != AF_INET)
+                continue;
+            entry.isIcmp = true;
+            entry.destination = ntohl(name.sin_addr.s_addr);
+            entry.port = ntohs(name.sin_port);
+            entry.timestampNs = receivedNs ? receivedNs : stampedNs;
+            entry.from = ntohl(offender->sin_addr.s_addr);
+            entry.icmpType = err->ee_type;
+            entry.icmpCode = err->ee_code;
+            entry.payloadTag = ntohs(head);
+            ++n;
+            continue;
+        }
+
+        if (!stampedNs || err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING || mSentRing.isEmpty())
+            continue;
+
+        //too old, the ring has wrapped past it
+        const SentProbe& sent = mSentRing[err->ee_data % mSentRing.size()];
+        if (sent.key != err->ee_data)
+            continue;
+
+        entry.destination = sent.destination;
+        entry.port = sent.port;
+        entry.timestampNs = stampedNs;
+        ++n;
+    }
+    return n;
+}
+
+RecvBatch::RecvBatch(int capacity, int slotSize)
+: mCapacity(qMax(1, capacity))
+, mSlotSize(qMax(1, slotSize))
+{
+    mData.resize(mCapacity * mSlotSize);
+    mControl.resize(mCapacity * RX_CONTROL_SPACE);
+    mAddr.resize(mCapacity);
+    mIov.resize(mCapacity);
+    mMsgs.resize(mCapacity);
+
+    for (int i = 0; i < mCapacity; ++i) {
+        mIov[i].iov_base = mData.data() + i * mSlotSize;
+        mIov[i].iov_len = mSlotSize;
+    }
+}
+
+int RecvBatch::receive(int fd)
+{
+    //recvmmsg writes the lengths back, so the headers need resetting every time
+    for (int i = 0; i < mCapacity; ++i) {
+        msghdr& msg = mMsgs[i].msg_hdr;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &mAddr[i];
+        msg.msg_namelen = sizeof(sockaddr_in);
+        msg.msg_iov = &mIov[i];
+        msg.msg_iovlen = 1;
+        msg.msg_control = mControl.data() + i * RX_CONTROL_SPACE;
+        msg.msg_controllen = RX_CONTROL_SPACE;
+        mMsgs[i].msg_len = 0;
+    }
+
+    while (true) {
+        int rc = recvmmsg(fd, mMsgs.data(), mCapacity, MSG_DONTWAIT, nullptr);
+        if (rc >= 0)
+            return rc;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return -1;
+    }
+}
+
+qint64 RecvBatch::timestamp(int i) const
+{
+    msghdr* msg = const_cast<msghdr*>(&mMsgs[i].msg_hdr);
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return toNs(ts);
+        }
+    }
+    return 0;
+}
+
+void RecvBatch::setMessage(int i, int length, quint32 from)
+{
+    msghdr& msg = mMsgs[i].msg_hdr;
+    memset(&msg, 0, sizeof(msg));
+    mMsgs[i].msg_len = qBound(0, length, mSlotSize);
+    mAddr[i].sin_family = AF_INET;
+    mAddr[i].sin_addr.s_addr = htonl(from);
+}
+
+Wakeup::Wakeup()
+    : mFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+}
+
+Wakeup::~Wakeup()
+{
+    if (mFd >= 0)
+        close(mFd);
+}
+
+void Wakeup::signal()
+{
+    // the flag is what clear() goes by, the eventfd is only there to end a poll
+    mSignalled.store(true, std::memory_order_release);
+    if (mFd >= 0) {
+        quint64 one = 1;
+        ssize_t written = write(mFd, &one, sizeof(one));
+        Q_UNUSED(written);      //EAGAIN is a counter already at its max, as good as signalled
+    }
+}
+
+bool Wakeup::clear()
+{
+    if (mFd >= 0) {
+        quint64 count;
+        ssize_t drained = read(mFd, &count, sizeof(count));
+        Q_UNUSED(drained);
+    }
+    return mSignalled.exchange(false, std::memory_order_acq_rel);
+}
+
+bool Wakeup::wait(int timeoutMS)
+{
+    if (isSignalled())
+        return true;
+
+    if (mFd < 0) {
+        // no eventfd, nap in short steps and look at the flag in between
+        for (int left = qMax(0, timeoutMS); left > 0 && !isSignalled(); left -= 10)
+            usleep(qMin(left, 10) * 1000);
+        return isSignalled();
+    }
+
+    pollfd pfd;
+    pfd.fd = mFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, qMax(0, timeoutMS));
+    return isSignalled();
+}
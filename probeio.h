@@ -0,0 +1,176 @@
+#ifndef PROBEIO_H
+#define PROBEIO_H
+
+#include <QtGlobal>
+#include <QVector>
+
+#include <atomic>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+const int PROBE_IO_BATCH        = 64;   //messages per sendmmsg/recvmmsg
+const int PROBE_REPLY_SIZE      = 576;  //routers quote at most this much, rfc 1812
+const int PROBE_TX_RING         = 4096; //sends remembered while their transmit timestamp is pending
+
+//kernel receive timestamps (SO_TIMESTAMPNS), read back with RecvBatch::timestamp
+bool enableRxTimestamps(int fd);
+//software transmit timestamps on the error queue, one per send (SO_TIMESTAMPING with OPT_ID),
+// read back with SendBatch::readErrorQueue
+bool enableTxTimestamps(int fd);
+//icmp errors for datagrams sent from this udp socket land on its error queue (IP_RECVERR),
+// which needs no privileges and no icmp socket. read back with SendBatch::readErrorQueue
+bool enableIcmpErrors(int fd);
+//classic bpf on a raw icmp socket (ip header included) that lets through only time
+// exceeded / unreachable messages quoting a udp header with a source port in [low, high].
+// everyone else's icmp is dropped in the kernel, before it wakes us up or gets copied
+bool attachProbeFilter(int fd, quint16 sourcePortLow, quint16 sourcePortHigh);
+
+//the local address the kernel would send to destination from, 0 if there's no route.
+// host order in and out
+quint32 sourceAddressFor(quint32 destination);
+
+//one entry off a socket's error queue, either the transmit timestamp of a send
+// or an icmp error the kernel matched to one of our datagrams
+struct QueuedError
+{
+    bool isIcmp = false;
+    quint32 destination = 0;    //host order, where the datagram went
+    quint16 port = 0;
+    qint64 timestampNs = 0;     //probe clock, when it was sent or when the icmp error arrived, 0 if unknown
+    quint32 from = 0;           //icmp only, who sent the error, host order
+    quint8 icmpType = 0;
+    quint8 icmpCode = 0;
+    quint16 payloadTag = 0;     //icmp only, the first two bytes of the datagram, a paris probe's tag
+};
+
+//probes queued up for one sendmmsg. every message carries its own destination and
+// ttl (as IP_TTL ancillary data), so a batch can mix ttls and traces without a
+// setsockopt per probe. whatever the kernel doesn't take stays queued for the next flush
+class SendBatch
+{
+public:
+    SendBatch(int capacity = PROBE_IO_BATCH, int maxLength = 64);
+
+    int capacity() const { return mCapacity; }
+    int size() const { return mCount - mHead; }
+    bool isEmpty() const { return mCount == mHead; }
+    bool isFull() const { return size() == mCapacity; }
+
+    //copies data in, ttl < 0 sends with the socket's ttl. tag is what readErrorQueue reports
+    // as the port of its transmit timestamp, 0 is the port itself
+    void add(quint32 destination, quint16 port, int ttl, const char* data, int length, quint16 tag = 0);
+
+    //sends as much as the socket takes and returns how many went out. if anything is
+    // left queued afterwards the send buffer is full. a message the kernel refuses
+    // outright (unreachable and such) is dropped so it can't wedge the queue
+    int flush(int fd);
+    void clear() { mHead = mCount = 0; }
+
+    //the i-th queued message, for a transport that doesn't send through a socket.
+    // take() then drops the first count of them as sent
+    quint32 destination(int i) const { return ntohl(mAddr[mHead + i].sin_addr.s_addr); }
+    quint16 port(int i) const { return ntohs(mAddr[mHead + i].sin_port); }
+    int ttl(int i) const { return mTTL[mHead + i]; }
+    const char* data(int i) const { return mData.constData() + (mHead + i) * mMaxLength; }
+    int length(int i) const { return mLength[mHead + i]; }
+    void take(int count);
+
+    //remembers what every send went to so the transmit timestamps can be matched up,
+    // only useful on a socket with enableTxTimestamps
+    void trackTxTimestamps(int ringSize = PROBE_TX_RING);
+    //drains up to max entries off the error queue, returns how many landed in out.
+    // timestamps we can't match to a send are skipped
+    int readErrorQueue(int fd, QueuedError* out, int max);
+
+private:
+    void compact();
+    void recordSent(int first, int count);
+
+    struct SentProbe
+    {
+        quint32 key;
+        quint32 destination;
+        quint16 port;
+    };
+
+    int mCapacity;
+    int mMaxLength;
+    int mHead = 0;
+    int mCount = 0;
+
+    QVector<char> mData;
+    QVector<int> mLength;
+    QVector<int> mTTL;
+    QVector<quint16> mTag;
+    QVector<sockaddr_in> mAddr;
+    QVector<char> mControl;
+    QVector<iovec> mIov;
+    QVector<mmsghdr> mMsgs;
+
+    //the kernel numbers sends from 0 once OPT_ID is on
+    QVector<SentProbe> mSentRing;
+    quint32 mTxKey = 0;
+};
+
+//a reusable set of small receive buffers filled by one recvmmsg
+class RecvBatch
+{
+public:
+    RecvBatch(int capacity = PROBE_IO_BATCH, int slotSize = PROBE_REPLY_SIZE);
+
+    //reads whatever is queued, up to capacity, without blocking.
+    // returns the number of messages, 0 if there was nothing, -1 on error
+    int receive(int fd);
+
+    int capacity() const { return mCapacity; }
+    int slotSize() const { return mSlotSize; }
+    const char* data(int i) const { return mData.constData() + i * mSlotSize; }
+    int length(int i) const { return mMsgs[i].msg_len; }
+    quint32 from(int i) const { return ntohl(mAddr[i].sin_addr.s_addr); }
+    //kernel receive time on the probe clock, 0 unless the socket has enableRxTimestamps
+    qint64 timestamp(int i) const;
+
+    //for a transport that doesn't read a socket: writes a message into slot i (up to
+    // slotSize bytes) the way receive would have, without a timestamp
+    char* slot(int i) { return mData.data() + i * mSlotSize; }
+    void setMessage(int i, int length, quint32 from);
+
+private:
+    int mCapacity;
+    int mSlotSize;
+
+    QVector<char> mData;
+    QVector<char> mControl;
+    QVector<sockaddr_in> mAddr;
+    QVector<iovec> mIov;
+    QVector<mmsghdr> mMsgs;
+};
+
+//an eventfd a loop polls next to its sockets. stop() and new work signal it from any thread,
+// so a worker sleeps as long as its next deadline and still hears about them at once.
+// the fd lives as long as the Wakeup, nobody closes it out from under a poll
+class Wakeup
+{
+public:
+    Wakeup();
+    ~Wakeup();
+
+    //-1 if there's no eventfd to be had, signal and wait still work then, only slower
+    int fd() const { return mFd; }
+    //thread safe. signals don't count, any number of them wakes one wait
+    void signal();
+    bool isSignalled() const { return mSignalled.load(std::memory_order_acquire); }
+    //resets it, true if it was signalled
+    bool clear();
+    //up to timeoutMS for a signal, true if there was one. the signal stays set
+    bool wait(int timeoutMS);
+
+private:
+    Q_DISABLE_COPY(Wakeup)
+
+    int mFd;
+    std::atomic_bool mSignalled{false};
+};
+
+#endif // PROBEIO_H
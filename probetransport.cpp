@@ -0,0 +1,199 @@
+#include "probetransport.h"
+
+#include <QDebug>
+#include <QThread>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+static ProbeTransport::Factory& factory()
+{
+    static ProbeTransport::Factory factory;
+    return factory;
+}
+
+ProbeTransport* ProbeTransport::create()
+{
+    if (factory())
+        return factory()();
+    return new SocketTransport();
+}
+
+void ProbeTransport::setFactory(const Factory& f)
+{
+    factory() = f;
+}
+
+SocketTransport::~SocketTransport()
+{
+    close();
+}
+
+bool SocketTransport::open(Receive receive, int receiveBuffer)
+{
+    close();
+    mClock.start();
+
+    mSndsock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    mEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (mSndsock < 0 || mEpoll < 0) {
+        close();
+        return false;
+    }
+
+    // a raw icmp socket, unless we were asked for the error queue. raw, not an unprivileged
+    // ping socket: that one only sees echo replies to its own ident and no ip header, never
+    // the time exceeded and unreachables our probes draw. without the privileges for one
+    // we fall back to the error queue if that's allowed
+    if (receive != ErrorQueue) {
+        mRcvsock = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_ICMP);
+        if (mRcvsock < 0) {
+            if (receive == IcmpSocket) {
+                close();
+                return false;
+            }
+            qDebug() << "no icmp socket, reading replies off the error queue";
+        }
+    }
+
+    int replySocket = mRcvsock < 0 ? mSndsock : mRcvsock;
+    setsockopt(replySocket, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof (receiveBuffer));
+    if (mRcvsock < 0 && !enableIcmpErrors(mSndsock)) {
+        close();
+        return false;
+    }
+
+    // let the kernel pick the source port, a fixed one collides with any other trace in the process
+    sockaddr_in bindsa;
+    memset(&bindsa, 0, sizeof (bindsa));
+    bindsa.sin_family = AF_INET;
+    socklen_t bindlen = sizeof (bindsa);
+    if (bind(mSndsock, (sockaddr*) &bindsa, sizeof (bindsa)) < 0
+        || getsockname(mSndsock, (sockaddr*) &bindsa, &bindlen) < 0) {
+        close();
+        return false;
+    }
+    mSourcePort = ntohs(bindsa.sin_port);
+
+    // the icmp socket sees every icmp message on the box, have the kernel drop the ones that aren't ours
+    if (mRcvsock >= 0 && !attachProbeFilter(mRcvsock, mSourcePort, mSourcePort))
+        qDebug() << "no probe filter, foreign icmp is filtered in userspace";
+
+    // rtts come from kernel timestamps so they don't include our own wakeup latency.
+    // transmit timestamps queue up on the send socket, it needs the room as well
+    enableRxTimestamps(replySocket);
+    mTxTimestamps = enableTxTimestamps(mSndsock);
+    if (mTxTimestamps && replySocket != mSndsock)
+        setsockopt(mSndsock, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof (receiveBuffer));
+
+    // the send socket reports EPOLLERR without asking, and is only armed for EPOLLOUT while
+    // a send was cut short
+    epoll_event ev;
+    memset(&ev, 0, sizeof (ev));
+    ev.data.fd = mSndsock;
+    if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, mSndsock, &ev) < 0) {
+        close();
+        return false;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = mRcvsock;
+    if (mRcvsock >= 0 && epoll_ctl(mEpoll, EPOLL_CTL_ADD, mRcvsock, &ev) < 0) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void SocketTransport::close()
+{
+    if (mEpoll != -1)
+        ::close(mEpoll);
+    if (mRcvsock != -1)
+        ::close(mRcvsock);
+    if (mSndsock != -1)
+        ::close(mSndsock);
+    mEpoll = mRcvsock = mSndsock = -1;
+    mWakeupFd = -1;
+    mWantWritable = false;
+    mTxTimestamps = false;
+}
+
+quint32 SocketTransport::sourceAddressFor(quint32 destination)
+{
+    return ::sourceAddressFor(destination);
+}
+
+qint64 SocketTransport::clockNs()
+{
+    return mClock.nsecsElapsed();
+}
+
+void SocketTransport::sleepMs(int ms)
+{
+    if (mWakeup)
+        mWakeup->wait(ms);
+    else
+        QThread::msleep(qMax(0, ms));
+}
+
+int SocketTransport::send(SendBatch& batch)
+{
+    return batch.flush(mSndsock);
+}
+
+int SocketTransport::wait(int timeoutMS, bool wantWritable)
+{
+    // the wakeup can be set after open, it joins the set the first time we wait with it
+    epoll_event ev;
+    memset(&ev, 0, sizeof (ev));
+    int wakeupFd = mWakeup ? mWakeup->fd() : -1;
+    if (wakeupFd != mWakeupFd) {
+        if (mWakeupFd >= 0)
+            epoll_ctl(mEpoll, EPOLL_CTL_DEL, mWakeupFd, &ev);
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeupFd;
+        if (wakeupFd >= 0 && epoll_ctl(mEpoll, EPOLL_CTL_ADD, wakeupFd, &ev) < 0)
+            return -1;
+        mWakeupFd = wakeupFd;
+    }
+    if (wantWritable != mWantWritable) {
+        ev.events = wantWritable ? uint32_t(EPOLLOUT) : 0u;
+        ev.data.fd = mSndsock;
+        if (epoll_ctl(mEpoll, EPOLL_CTL_MOD, mSndsock, &ev) < 0)
+            return -1;
+        mWantWritable = wantWritable;
+    }
+
+    // transmit timestamps, and replies on the error queue backend, show up as EPOLLERR on the send socket
+    epoll_event events[3];
+    int nready = epoll_wait(mEpoll, events, 3, timeoutMS);
+    if (nready < 0)
+        return errno == EINTR ? 0 : -1;
+
+    int ready = 0;
+    if (mWakeup && mWakeup->isSignalled() && mWakeup->clear())
+        ready |= Woken;
+    for (int i = 0; i < nready; ++i) {
+        if (events[i].data.fd == mRcvsock && (events[i].events & EPOLLIN))
+            ready |= Replies;
+        if (events[i].data.fd != mSndsock)
+            continue;
+        if (events[i].events & EPOLLERR)
+            ready |= Errors;
+        if (events[i].events & EPOLLOUT)
+            ready |= Writable;
+    }
+    return ready;
+}
+
+int SocketTransport::receive(RecvBatch& batch)
+{
+    return batch.receive(mRcvsock);
+}
+
+int SocketTransport::readErrors(SendBatch& batch, QueuedError* out, int max)
+{
+    return batch.readErrorQueue(mSndsock, out, max);
+}
@@ -0,0 +1,109 @@
+#ifndef PROBETRANSPORT_H
+#define PROBETRANSPORT_H
+
+#include "probeio.h"
+
+#include <QElapsedTimer>
+
+#include <functional>
+
+//what a trace sends its probes through and reads the answers from. the worker and the
+// batch scheduler only ever talk to this, so the same loops run against the network
+// (SocketTransport) or against a network in memory (SimTransport, see simnetwork.h).
+// the transport owns the clock as well, a simulated one runs as fast as the cpu allows
+class ProbeTransport
+{
+public:
+    enum Receive {
+        IcmpSocket,                 //a raw icmp socket, needs CAP_NET_RAW
+        ErrorQueue,                 //icmp errors off the send socket, needs no privileges
+        IcmpSocketOrErrorQueue,     //the error queue when there's no icmp socket to be had
+    };
+
+    enum Ready {
+        Replies         = 0x01,     //receive has something
+        Errors          = 0x02,     //readErrors has something
+        Writable        = 0x04,     //a send that was cut short can go on
+        Woken           = 0x08,     //the Wakeup was signalled, it's been reset since
+    };
+
+    typedef std::function<ProbeTransport*()> Factory;
+
+    virtual ~ProbeTransport() = default;
+
+    //a new transport from the factory, a SocketTransport if nobody set one
+    static ProbeTransport* create();
+    //for the whole process, before any trace starts. an empty one goes back to sockets
+    static void setFactory(const Factory& factory);
+
+    //wait and sleepMs return early once this is signalled, from whatever thread. the loop
+    // that owns the transport keeps the Wakeup for its whole life, transports come and go
+    void setWakeup(Wakeup* wakeup) { mWakeup = wakeup; }
+
+    //receiveBuffer is how much the kernel may queue for us, in bytes
+    virtual bool open(Receive receive, int receiveBuffer) = 0;
+    virtual void close() = 0;
+
+    //where replies come from once open, readErrors rather than receive with ErrorQueue
+    virtual bool usesErrorQueue() const = 0;
+    //a SendBatch needs trackTxTimestamps for readErrors to match these up
+    virtual bool hasTxTimestamps() const = 0;
+    virtual quint16 sourcePort() const = 0;
+    //what the probes to destination go out from, for paris checksums. host order
+    virtual quint32 sourceAddressFor(quint32 destination) = 0;
+
+    //timeouts and send times are on this clock, ns from open
+    virtual qint64 clockNs() = 0;
+    //lets time pass on that clock, less of it if the Wakeup is signalled
+    virtual void sleepMs(int ms) = 0;
+
+    //as SendBatch::flush, whatever doesn't go out stays queued
+    virtual int send(SendBatch& batch) = 0;
+    //up to timeoutMS until something is ready or the Wakeup is signalled, returns Ready flags,
+    // 0 on timeout, -1 on error. wantWritable asks to hear when a send that was cut short can go on
+    virtual int wait(int timeoutMS, bool wantWritable) = 0;
+    //ip packets with their icmp error, as RecvBatch::receive
+    virtual int receive(RecvBatch& batch) = 0;
+    //as SendBatch::readErrorQueue
+    virtual int readErrors(SendBatch& batch, QueuedError* out, int max) = 0;
+
+protected:
+    Wakeup* mWakeup = nullptr;
+};
+
+//udp probes out of a socket bound to a port of the kernel's choosing, answers off an icmp
+// socket with the probe filter on it, or off the send socket's error queue
+class SocketTransport : public ProbeTransport
+{
+public:
+    SocketTransport() = default;
+    virtual ~SocketTransport();
+
+    virtual bool open(Receive receive, int receiveBuffer) override;
+    virtual void close() override;
+
+    virtual bool usesErrorQueue() const override { return mRcvsock < 0; }
+    virtual bool hasTxTimestamps() const override { return mTxTimestamps; }
+    virtual quint16 sourcePort() const override { return mSourcePort; }
+    virtual quint32 sourceAddressFor(quint32 destination) override;
+
+    virtual qint64 clockNs() override;
+    virtual void sleepMs(int ms) override;
+
+    virtual int send(SendBatch& batch) override;
+    virtual int wait(int timeoutMS, bool wantWritable) override;
+    virtual int receive(RecvBatch& batch) override;
+    virtual int readErrors(SendBatch& batch, QueuedError* out, int max) override;
+
+private:
+    int mEpoll = -1;
+    int mRcvsock = -1;
+    int mSndsock = -1;
+    int mWakeupFd = -1;             //registered with mEpoll
+    bool mWantWritable = false;     //mSndsock is armed for EPOLLOUT
+    quint16 mSourcePort = 0;
+    bool mTxTimestamps = false;
+    QElapsedTimer mClock;           //from open, the timing wheels count from 0
+};
+
+#endif // PROBETRANSPORT_H
@@ -0,0 +1,104 @@
+#include "resultring.h"
+#include "metrics.h"
+
+#include <QThread>
+
+static int roundUpToPowerOfTwo(int n)
+{
+    int p = 1;
+    while (p < n && p < (1 << 24))
+        p <<= 1;
+    return p;
+}
+
+ResultRing::ResultRing(int capacity, Overflow overflow, int watermark)
+: mCapacity(roundUpToPowerOfTwo(qMax(2, capacity)))
+, mMask(mCapacity - 1)
+, mOverflow(overflow)
+, mWatermark(qBound(1, watermark, mCapacity))
+{
+    mSlots.resize(mCapacity);
+    mBuffer = mSlots.data();
+    mStamps.resize(mCapacity);
+    mStampBuffer = mStamps.data();
+}
+
+bool ResultRing::push(const ProbeResult& result)
+{
+    quint64 head = mHead.load(std::memory_order_relaxed);
+    int spins = 0;
+
+    while (true) {
+        quint64 tail = mTail.load(std::memory_order_acquire);
+        if (head - tail < quint64(mCapacity))
+            break;
+
+        if (mOverflow == CountDropped || mClosed.load(std::memory_order_relaxed)) {
+            mDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        if (mOverflow == DropOldest) {
+            //the consumer might be reading that slot right now, its own tail update fails then and it reads again
+            if (mTail.compare_exchange_weak(tail, tail + 1, std::memory_order_acq_rel))
+                mDropped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        //Block: spin a little, then get out of the consumer's way
+        if (++spins < 64)
+            QThread::yieldCurrentThread();
+        else
+            QThread::usleep(100);
+    }
+
+    mBuffer[head & mMask] = result;
+    mStampBuffer[head & mMask] = EngineMetrics::clockNs();
+    mHead.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+bool ResultRing::needsWakeup()
+{
+    quint64 queued = mHead.load(std::memory_order_relaxed) - mTail.load(std::memory_order_relaxed);
+    if (queued < quint64(mWatermark) || mWakeupPending.load(std::memory_order_relaxed))
+        return false;
+    return !mWakeupPending.exchange(true, std::memory_order_acq_rel);
+}
+
+int ResultRing::drain(QVector<ProbeResult>& out, int max)
+{
+    //anything pushed from here on deserves a new wakeup
+    mWakeupPending.store(false, std::memory_order_release);
+
+    int base = out.size();
+    while (true) {
+        quint64 tail = mTail.load(std::memory_order_acquire);
+        quint64 head = mHead.load(std::memory_order_acquire);
+        int n = (int) qMin<quint64>(head - tail, quint64(qMax(0, max)));
+        if (!n)
+            return 0;
+
+        out.resize(base + n);
+        mDrainStamps.resize(n);
+        for (int i = 0; i < n; ++i) {
+            out[base + i] = mBuffer[(tail + i) & mMask];
+            mDrainStamps[i] = mStampBuffer[(tail + i) & mMask];
+        }
+
+        if (mTail.compare_exchange_strong(tail, tail + n, std::memory_order_acq_rel)) {
+            qint64 now = EngineMetrics::clockNs();
+            for (int i = 0; i < n; ++i)
+                EngineMetrics::record(EngineMetrics::ResultToConsumerNs, now - mDrainStamps[i]);
+            return n;
+        }
+
+        //the producer dropped the oldest while we copied, what we read may be half overwritten
+        out.resize(base);
+    }
+}
+
+void ResultRing::close()
+{
+    mClosed.store(true, std::memory_order_release);
+}
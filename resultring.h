@@ -0,0 +1,60 @@
+#ifndef RESULTRING_H
+#define RESULTRING_H
+
+#include "iphlpr.h"
+
+#include <QVector>
+
+#include <atomic>
+
+//hands probe results from one worker thread to one consumer thread without a lock or
+// a queued signal per result. the worker pushes, and asks for a wakeup only when the ring
+// crosses the watermark; the consumer drains whatever is there in one go, on that
+// wakeup or on its own timer
+class ResultRing
+{
+public:
+    //what push does when the consumer has fallen behind and the ring is full
+    enum Overflow {
+        Block,              //wait for room, nothing is lost unless the ring gets closed
+        DropOldest,         //make room by throwing away the oldest unread result
+        CountDropped,       //throw away the new result and count it
+    };
+
+    explicit ResultRing(int capacity = RESULT_RING_SIZE, Overflow overflow = Block, int watermark = RESULT_DRAIN_WATERMARK);
+
+    //producer side. returns false if the result didn't make it in
+    bool push(const ProbeResult& result);
+    //true once the ring holds watermark results and no wakeup is pending since the last drain
+    bool needsWakeup();
+
+    //consumer side. appends up to max results to out and returns how many
+    int drain(QVector<ProbeResult>& out, int max);
+
+    //wakes up a blocked producer for good, pushes after this are dropped
+    void close();
+
+    int capacity() const { return mCapacity; }
+    quint64 dropped() const { return mDropped.load(std::memory_order_relaxed); }
+
+private:
+    int mCapacity;
+    quint64 mMask;
+    Overflow mOverflow;
+    int mWatermark;
+    QVector<ProbeResult> mSlots;
+    ProbeResult* mBuffer;       //mSlots' storage, touched from both threads so never through QVector
+    QVector<qint64> mStamps;    //when each slot was pushed, for EngineMetrics::ResultToConsumerNs
+    qint64* mStampBuffer;
+    QVector<qint64> mDrainStamps;   //consumer only, the stamps of what it's draining
+
+    //free running, slot is index & mask. tail is moved by the consumer, and by the
+    // producer too when it drops the oldest
+    alignas(64) std::atomic<quint64> mHead{0};
+    alignas(64) std::atomic<quint64> mTail{0};
+    alignas(64) std::atomic<quint64> mDropped{0};
+    std::atomic_bool mWakeupPending{false};
+    std::atomic_bool mClosed{false};
+};
+
+#endif // RESULTRING_H
@@ -0,0 +1,307 @@
+#include "simnetwork.h"
+#include "checksum.h"
+#include "probe.h"
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+#include <string.h>
+
+#include <algorithm>
+
+//splitmix64's finalizer, everything made up below comes out of it
+static quint64 mix(quint64 x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+SimNetwork::SimNetwork(quint64 seed)
+    : mSeed(seed)
+{
+}
+
+SimPath SimNetwork::path(quint32 destination) const
+{
+    auto it = mPaths.constFind(destination);
+    if (it != mPaths.constEnd())
+        return *it;
+
+    const Synthetic& s = mSynthetic;
+    quint64 hash = mix(mSeed ^ destination);
+    int spread = qMax(1, s.maxLength - s.minLength + 1);
+    int length = qMax(1, s.minLength + int(hash % quint64(spread)));
+
+    SimPath path;
+    path.hops.resize(length);
+    for (int i = 0; i < length; ++i) {
+        SimHop& hop = path.hops[i];
+        hop.rttNs = (i + 1) * s.hopRttNs;
+        hop.loss = s.loss;
+        hop.icmpRate = s.icmpRate;
+        hop.icmpBurst = s.icmpBurst;
+
+        //the router at hop i is shared by every destination in the same prefix, the
+        // prefix getting longer the further out the hop is. the shared hops are /0
+        int prefix = i < s.sharedHops ? 0 : qMin(24, 4 * (i - s.sharedHops + 1));
+        quint32 network = prefix ? destination >> (32 - prefix) : 0;
+        quint64 router = mix(mSeed + (quint64(i) << 40) + (quint64(prefix) << 32) + network);
+
+        if (s.silentEvery > 0 && i >= s.sharedHops && router % quint64(s.silentEvery) == 0)
+            continue;
+
+        //routers live in 100.64/10 so they never collide with a destination of the caller's
+        int width = s.ecmpEvery > 0 && (i + 1) % s.ecmpEvery == 0 ? qMax(1, s.ecmpWidth) : 1;
+        quint32 base = 0x64400000 | (quint32(router >> 16) & 0x003fffff);
+        for (int k = 0; k < width; ++k)
+            hop.interfaces.append(0x64400000 | ((base + k) & 0x003fffff));
+    }
+
+    path.destinationRttNs = (length + 1) * s.hopRttNs;
+    if (s.unreachableEvery > 0 && (hash >> 32) % quint64(s.unreachableEvery) == 0) {
+        path.reachable = false;
+        path.unreachableCode = (hash >> 48) & 1 ? ICMP_UNREACH_HOST : -1;
+    }
+    return path;
+}
+
+SimTransport::SimTransport(const SimNetwork* network, quint16 sourcePort)
+    : mNetwork(network),
+      mSourcePort(sourcePort),
+      mRng(mix(network->seed() ^ sourcePort) | 1)
+{
+}
+
+bool SimTransport::open(Receive receive, int receiveBuffer)
+{
+    Q_UNUSED(receive);
+    Q_UNUSED(receiveBuffer);
+    close();
+    // the clock counts from open, as a socket transport's does
+    mNowNs = 0;
+    mLimiters.clear();
+    return true;
+}
+
+void SimTransport::close()
+{
+    mAnswers.clear();
+}
+
+quint32 SimTransport::sourceAddressFor(quint32 destination)
+{
+    Q_UNUSED(destination);
+    return mNetwork->sourceAddress();
+}
+
+void SimTransport::sleepMs(int ms)
+{
+    mNowNs += qint64(qMax(0, ms)) * 1000000;
+}
+
+int SimTransport::send(SendBatch& batch)
+{
+    int count = batch.size();
+    for (int i = 0; i < count; ++i)
+        probe(batch.destination(i), batch.port(i), batch.ttl(i), batch.data(i), batch.length(i));
+    batch.take(count);
+    return count;
+}
+
+int SimTransport::wait(int timeoutMS, bool wantWritable)
+{
+    // a send never stops short, the socket is always writable
+    int ready = wantWritable ? Writable : 0;
+    if (mWakeup && mWakeup->isSignalled() && mWakeup->clear())
+        return ready | Woken;
+    if (!mAnswers.isEmpty() && mAnswers.first().dueNs <= mNowNs)
+        return ready | Replies;
+
+    // nothing due, skip ahead to whatever comes first, the next answer or the timeout
+    qint64 untilNs = mNowNs + qint64(qMax(0, timeoutMS)) * 1000000;
+    if (!mAnswers.isEmpty() && mAnswers.first().dueNs <= untilNs) {
+        mNowNs = mAnswers.first().dueNs;
+        return ready | Replies;
+    }
+    mNowNs = untilNs;
+    return ready;
+}
+
+int SimTransport::receive(RecvBatch& batch)
+{
+    quint32 source = htonl(mNetwork->sourceAddress());
+
+    int count = 0;
+    while (count < batch.capacity() && !mAnswers.isEmpty() && mAnswers.first().dueNs <= mNowNs) {
+        std::pop_heap(mAnswers.begin(), mAnswers.end(), laterThan);
+        Answer a = mAnswers.takeLast();
+
+        // what the icmp socket reads: outer ip header, icmp header, the probe's ip and udp headers
+        const int length = sizeof(ip) + ICMP_MINLEN + sizeof(ip) + sizeof(udphdr);
+        char* packet = batch.slot(count);
+        memset(packet, 0, length);
+
+        ip* outer = (ip*) packet;
+        outer->ip_v = 4;
+        outer->ip_hl = sizeof(ip) >> 2;
+        outer->ip_len = htons(length);
+        outer->ip_ttl = a.recvTTL;
+        outer->ip_p = IPPROTO_ICMP;
+        outer->ip_src.s_addr = htonl(a.from);
+        outer->ip_dst.s_addr = source;
+
+        icmp* message = (icmp*) (packet + sizeof(ip));
+        message->icmp_type = a.icmpType;
+        message->icmp_code = a.icmpCode;
+
+        ip* inner = (ip*) (packet + sizeof(ip) + ICMP_MINLEN);
+        inner->ip_v = 4;
+        inner->ip_hl = sizeof(ip) >> 2;
+        inner->ip_len = htons(sizeof(ip) + sizeof(udphdr) + a.length);
+        inner->ip_ttl = 1;
+        inner->ip_p = IPPROTO_UDP;
+        inner->ip_src.s_addr = source;
+        inner->ip_dst.s_addr = htonl(a.destination);
+
+        udphdr* udp = (udphdr*) (packet + sizeof(ip) + ICMP_MINLEN + sizeof(ip));
+        udp->uh_sport = htons(mSourcePort);
+        udp->uh_dport = htons(a.destinationPort);
+        udp->uh_ulen = htons(sizeof(udphdr) + a.length);
+        udp->uh_sum = a.checksum;
+
+        batch.setMessage(count++, length, a.from);
+        ++mAnswered;
+    }
+    return count;
+}
+
+int SimTransport::readErrors(SendBatch& batch, QueuedError* out, int max)
+{
+    Q_UNUSED(batch);
+    Q_UNUSED(out);
+    Q_UNUSED(max);
+    return 0;
+}
+
+void SimTransport::probe(quint32 destination, quint16 port, int ttl, const char* data, int length)
+{
+    ++mSent;
+    const SimPath& path = pathTo(destination);
+    int hopCount = path.hops.size();
+    if (ttl <= 0)
+        return;
+
+    Answer a;
+    a.destination = destination;
+    a.destinationPort = port;
+    a.length = length;
+    qint64 rttNs;
+
+    if (ttl <= hopCount) {
+        const SimHop& hop = path.hops[ttl - 1];
+        if (hop.interfaces.isEmpty() || (hop.loss > 0 && uniform() < hop.loss))
+            return;
+
+        // an ecmp hop picks its interface by the flow, so a paris trace always sees the same one
+        a.from = hop.interfaces[0];
+        if (hop.interfaces.size() > 1) {
+            quint64 flow = (quint64(destination) << 32) ^ (quint64(mSourcePort) << 16) ^ port;
+            a.from = hop.interfaces[mix(flow ^ (quint64(ttl) << 56)) % quint64(hop.interfaces.size())];
+        }
+        if (!allowAnswer(a.from, hop))
+            return;
+        a.icmpType = ICMP_TIMXCEED;
+        a.icmpCode = ICMP_TIMXCEED_INTRANS;
+        a.recvTTL = 255 - ttl;
+        rttNs = hop.rttNs + (hop.jitterNs > 0 ? qint64(uniform() * hop.jitterNs) : 0);
+    } else if (path.reachable) {
+        if (hopCount && path.hops.last().loss > 0 && uniform() < path.hops.last().loss)
+            return;
+        a.from = destination;
+        a.icmpType = ICMP_UNREACH;
+        a.icmpCode = ICMP_UNREACH_PORT;
+        a.recvTTL = qMax(1, 64 - hopCount);
+        rttNs = path.destinationRttNs;
+    } else {
+        if (path.unreachableCode < 0 || !hopCount)
+            return;
+        const SimHop& hop = path.hops.last();
+        if (hop.interfaces.isEmpty() || !allowAnswer(hop.interfaces[0], hop))
+            return;
+        a.from = hop.interfaces[0];
+        a.icmpType = ICMP_UNREACH;
+        a.icmpCode = path.unreachableCode;
+        a.recvTTL = 255 - hopCount;
+        rttNs = hop.rttNs;
+    }
+
+    // the probe's udp checksum comes back quoted, paris traces match on it
+    struct {
+        quint32 source;
+        quint32 destination;
+        quint8 zero;
+        quint8 protocol;
+        quint16 udpLength;
+        quint16 sourcePort;
+        quint16 destinationPort;
+        quint16 length;
+        quint16 checksum;
+        char payload[64];
+    } datagram;
+    length = qBound(0, length, int(sizeof(datagram.payload)));
+    datagram.source = htonl(mNetwork->sourceAddress());
+    datagram.destination = htonl(destination);
+    datagram.zero = 0;
+    datagram.protocol = IPPROTO_UDP;
+    datagram.udpLength = datagram.length = htons(sizeof(udphdr) + length);
+    datagram.sourcePort = htons(mSourcePort);
+    datagram.destinationPort = htons(port);
+    datagram.checksum = 0;
+    memcpy(datagram.payload, data, length);
+    a.checksum = checksum(&datagram, 20 + length);
+    if (!a.checksum)
+        a.checksum = 0xffff;
+
+    a.dueNs = mNowNs + rttNs;
+    mAnswers.append(a);
+    std::push_heap(mAnswers.begin(), mAnswers.end(), laterThan);
+}
+
+const SimPath& SimTransport::pathTo(quint32 destination)
+{
+    auto it = mPaths.find(destination);
+    if (it == mPaths.end())
+        it = mPaths.insert(destination, mNetwork->path(destination));
+    return *it;
+}
+
+bool SimTransport::allowAnswer(quint32 router, const SimHop& hop)
+{
+    if (hop.icmpRate <= 0)
+        return true;
+
+    // a token bucket per router in simulated time, as the kernel's icmp_ratelimit
+    Limiter& limiter = mLimiters[router];
+    double burst = qMax(1, hop.icmpBurst);
+    if (limiter.lastNs < 0)
+        limiter.tokens = burst;
+    else
+        limiter.tokens = qMin(burst, limiter.tokens + (mNowNs - limiter.lastNs) * 1e-9 * hop.icmpRate);
+    limiter.lastNs = mNowNs;
+    if (limiter.tokens < 1)
+        return false;
+    limiter.tokens -= 1;
+    return true;
+}
+
+quint64 SimTransport::random()
+{
+    //xorshift64*
+    mRng ^= mRng >> 12;
+    mRng ^= mRng << 25;
+    mRng ^= mRng >> 27;
+    return mRng * 0x2545f4914f6cdd1dULL;
+}
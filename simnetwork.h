@@ -0,0 +1,139 @@
+#ifndef SIMNETWORK_H
+#define SIMNETWORK_H
+
+#include "probetransport.h"
+
+#include <QHash>
+#include <QVector>
+
+//one router of a simulated path
+struct SimHop
+{
+    QVector<quint32> interfaces;    //host order. more than one is an ecmp hop, each flow hashes
+                                    // to one of them. none is a hop that never answers
+    qint64 rttNs = 1000000;         //round trip from the source to here
+    qint64 jitterNs = 0;            //added to every answer, uniform in [0, jitterNs)
+    double loss = 0;                //chance a probe dies here or on its way back
+    int icmpRate = 0;               //icmp errors per second the router sends at most, 0 is no limit
+    int icmpBurst = 1;
+};
+
+struct SimPath
+{
+    QVector<SimHop> hops;           //hops[i] answers ttl i + 1
+    //past the last hop the destination answers port unreachable
+    bool reachable = true;
+    qint64 destinationRttNs = 0;    //0 is a hop's worth past the last one
+    //for an unreachable destination: -1 has nothing answer past the last hop, anything else
+    // has the last hop answer destination unreachable with this code (ICMP_UNREACH_HOST and such)
+    int unreachableCode = -1;
+};
+
+//an internet in memory. destinations given a path of their own get it, everyone else gets
+// one made up from the address: a few hops every path shares, then routers shared by ever
+// smaller prefixes down to the destination's /24, the way doubletree expects
+class SimNetwork
+{
+public:
+    struct Synthetic
+    {
+        int minLength = 6;          //hops before the destination
+        int maxLength = 18;
+        int sharedHops = 3;         //the same for every destination, the access network
+        int ecmpEvery = 4;          //every so many hops is load balanced, 0 for none
+        int ecmpWidth = 2;
+        int silentEvery = 0;        //and one in so many past the shared ones never answers, 0 for none
+        int unreachableEvery = 0;   //one in so many destinations doesn't answer, 0 for none
+        qint64 hopRttNs = 1000000;  //each hop adds this much
+        double loss = 0;
+        int icmpRate = 0;           //per router, see SimHop
+        int icmpBurst = 1;
+    };
+
+    explicit SimNetwork(quint64 seed = 1);
+
+    void setSynthetic(const Synthetic& synthetic) { mSynthetic = synthetic; }
+    void addPath(quint32 destination, const SimPath& path) { mPaths.insert(destination, path); }
+    //host order, what every probe goes out from
+    void setSourceAddress(quint32 address) { mSourceAddress = address; }
+    quint32 sourceAddress() const { return mSourceAddress; }
+    quint64 seed() const { return mSeed; }
+
+    //thread safe once the network is set up, transports on different threads all ask
+    SimPath path(quint32 destination) const;
+
+private:
+    quint64 mSeed;
+    quint32 mSourceAddress = 0x0a000002;    //10.0.0.2
+    Synthetic mSynthetic;
+    QHash<quint32, SimPath> mPaths;
+};
+
+//probes into a SimNetwork and its answers out as the ip packets an icmp socket would hand
+// over. time is its own: a wait with nothing due moves the clock ahead instead of sleeping,
+// so a trace takes as long as the cpu needs for it and goes the same way every time for the
+// same seed. rate limits are kept per transport, not per network
+class SimTransport : public ProbeTransport
+{
+public:
+    explicit SimTransport(const SimNetwork* network, quint16 sourcePort = 33000);
+
+    virtual bool open(Receive receive, int receiveBuffer) override;
+    virtual void close() override;
+
+    virtual bool usesErrorQueue() const override { return false; }
+    virtual bool hasTxTimestamps() const override { return false; }
+    virtual quint16 sourcePort() const override { return mSourcePort; }
+    virtual quint32 sourceAddressFor(quint32 destination) override;
+
+    virtual qint64 clockNs() override { return mNowNs; }
+    virtual void sleepMs(int ms) override;
+
+    virtual int send(SendBatch& batch) override;
+    virtual int wait(int timeoutMS, bool wantWritable) override;
+    virtual int receive(RecvBatch& batch) override;
+    virtual int readErrors(SendBatch& batch, QueuedError* out, int max) override;
+
+    quint64 probesSent() const { return mSent; }
+    quint64 probesAnswered() const { return mAnswered; }
+
+private:
+    struct Answer
+    {
+        qint64 dueNs;
+        quint32 from;
+        quint32 destination;
+        quint16 destinationPort;
+        quint16 checksum;       //as it goes on the wire
+        quint16 length;         //of the udp payload
+        quint8 icmpType;
+        quint8 icmpCode;
+        quint8 recvTTL;
+    };
+
+    struct Limiter
+    {
+        qint64 lastNs = -1;
+        double tokens = 0;
+    };
+
+    static bool laterThan(const Answer& a, const Answer& b) { return a.dueNs > b.dueNs; }
+    void probe(quint32 destination, quint16 port, int ttl, const char* data, int length);
+    const SimPath& pathTo(quint32 destination);
+    bool allowAnswer(quint32 router, const SimHop& hop);
+    quint64 random();
+    double uniform() { return (random() >> 11) * (1.0 / 9007199254740992.0); }
+
+    const SimNetwork* mNetwork;
+    quint16 mSourcePort;
+    qint64 mNowNs = 0;
+    quint64 mRng;
+    quint64 mSent = 0;
+    quint64 mAnswered = 0;
+
+    QVector<Answer> mAnswers;           //a heap, the earliest on top
+    QHash<quint32, SimPath> mPaths;     //what we've asked the network so far
+    QHash<quint32, Limiter> mLimiters;  //by router address
+};
+
+#endif // SIMNETWORK_H
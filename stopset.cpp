@@ -0,0 +1,27 @@
+#include "stopset.h"
+
+bool StopSet::nearSide(int ttl, quint32 address, QVector<HopProbe>& hops) const
+{
+    auto it = mIndex.constFind(key(ttl, address));
+    if (it == mIndex.constEnd())
+        return false;
+    hops = mPaths[it->path].mid(0, it->length);
+    return true;
+}
+
+void StopSet::learn(int startTTL, const QVector<HopProbe>& path)
+{
+    int pathIndex = -1;
+    for (int i = 0; i < path.size(); ++i) {
+        const HopProbe& hop = path[i];
+        if (hop.timedOut || !hop.address || mIndex.contains(key(startTTL + i, hop.address)))
+            continue;
+
+        //stored once, shared by every hop learned from it
+        if (pathIndex < 0) {
+            pathIndex = mPaths.size();
+            mPaths.append(path);
+        }
+        mIndex.insert(key(startTTL + i, hop.address), Entry{pathIndex, i});
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef STOPSET_H
+#define STOPSET_H
+
+#include "tracestate.h"
+
+#include <QHash>
+#include <QVector>
+
+//doubletree's local stop set: every (ttl, interface) a batch has seen so far, each with
+// the hops in front of it as the trace that found it saw them. near the vantage point
+// every trace crosses the same routers, so once a trace probing backwards reaches a
+// hop in here it can stop and take the rest of its near side from the set
+class StopSet
+{
+public:
+    int size() const { return mIndex.size(); }
+
+    //the hops from the first ttl up to, not including, ttl on the path through address.
+    // false if the set doesn't know the hop
+    bool nearSide(int ttl, quint32 address, QVector<HopProbe>& hops) const;
+
+    //learns every answering hop of a near side that starts at startTTL
+    void learn(int startTTL, const QVector<HopProbe>& path);
+
+private:
+    static quint64 key(int ttl, quint32 address) { return (quint64(ttl) << 32) | address; }
+
+    struct Entry
+    {
+        int path;
+        int length;             //hops of that path in front of the key's ttl
+    };
+
+    QHash<quint64, Entry> mIndex;
+    QVector<QVector<HopProbe> > mPaths;
+};
+
+#endif // STOPSET_H
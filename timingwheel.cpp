@@ -0,0 +1,138 @@
+#include "timingwheel.h"
+
+TimingWheel::TimingWheel(int tickShift)
+: mTickShift(tickShift)
+{
+    for (int& head : mHeads)
+        head = -1;
+}
+
+void TimingWheel::link(int timer)
+{
+    Timer& t = mTimers[timer];
+
+    //past deadlines go in the very next slot
+    quint64 tick = qMax(t.tick, mNextTick);
+    quint64 delta = tick - mNextTick;
+
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (quint64(1) << (SLOT_BITS * (level + 1))))
+        ++level;
+    //beyond the outermost wheel, park it in its last slot, it gets re-filed from there
+    if (delta >= (quint64(1) << (SLOT_BITS * LEVELS)))
+        tick = mNextTick + (quint64(1) << (SLOT_BITS * LEVELS)) - 1;
+
+    int slot = level * SLOTS + int((tick >> (SLOT_BITS * level)) & SLOT_MASK);
+    if (level)
+        ++mOuter;
+    t.slot = slot;
+    t.prev = -1;
+    t.next = mHeads[slot];
+    if (t.next >= 0)
+        mTimers[t.next].prev = timer;
+    mHeads[slot] = timer;
+}
+
+void TimingWheel::unlink(int timer)
+{
+    Timer& t = mTimers[timer];
+    if (t.slot >= SLOTS)
+        --mOuter;
+    if (t.prev >= 0)
+        mTimers[t.prev].next = t.next;
+    else
+        mHeads[t.slot] = t.next;
+    if (t.next >= 0)
+        mTimers[t.next].prev = t.prev;
+    t.slot = t.prev = t.next = -1;
+}
+
+void TimingWheel::schedule(int timer, qint64 deadlineNs)
+{
+    if (timer >= mTimers.size())
+        mTimers.resize(qMax(timer + 1, mTimers.size() * 2));
+
+    if (mTimers[timer].slot >= 0)
+        unlink(timer);
+    else
+        ++mArmed;
+
+    //round up, firing at tick t means t << shift has passed
+    quint64 tick = (quint64(qMax<qint64>(0, deadlineNs)) + (quint64(1) << mTickShift) - 1) >> mTickShift;
+    mTimers[timer].tick = tick;
+    link(timer);
+}
+
+void TimingWheel::cancel(int timer)
+{
+    if (!isArmed(timer))
+        return;
+    unlink(timer);
+    --mArmed;
+}
+
+int TimingWheel::cascade(int level)
+{
+    int index = int((mNextTick >> (SLOT_BITS * level)) & SLOT_MASK);
+    int slot = level * SLOTS + index;
+
+    int timer = mHeads[slot];
+    mHeads[slot] = -1;
+    while (timer >= 0) {
+        int next = mTimers[timer].next;
+        --mOuter;
+        link(timer);
+        timer = next;
+    }
+    return index;
+}
+
+void TimingWheel::advance(qint64 nowNs, QVector<int>& expired)
+{
+    quint64 nowTick = quint64(qMax<qint64>(0, nowNs)) >> mTickShift;
+
+    //nothing to walk past
+    if (!mArmed) {
+        mNextTick = qMax(mNextTick, nowTick + 1);
+        return;
+    }
+
+    while (mNextTick <= nowTick && mArmed) {
+        int index = int(mNextTick & SLOT_MASK);
+        for (int level = 1; !index && level < LEVELS; ++level)
+            index = cascade(level);
+
+        int slot = int(mNextTick & SLOT_MASK);
+        int timer = mHeads[slot];
+        mHeads[slot] = -1;
+        while (timer >= 0) {
+            Timer& t = mTimers[timer];
+            int next = t.next;
+            t.slot = t.prev = t.next = -1;
+            --mArmed;
+            expired.append(timer);
+            timer = next;
+        }
+        ++mNextTick;
+    }
+
+    if (!mArmed)
+        mNextTick = qMax(mNextTick, nowTick + 1);
+}
+
+qint64 TimingWheel::nextDeadline() const
+{
+    if (!mArmed)
+        return -1;
+
+    //the inner wheel holds the next SLOTS ticks. with timers further out, anything
+    // past the next cascade might be beaten by one of them once it's re-filed
+    quint64 cascadeTick = (mNextTick + SLOT_MASK) & ~quint64(SLOT_MASK);
+    for (quint64 tick = mNextTick; tick < mNextTick + SLOTS; ++tick) {
+        if (mHeads[tick & SLOT_MASK] >= 0)
+            return qint64(tick << mTickShift);
+        if (mOuter && tick >= cascadeTick)
+            break;
+    }
+    return qint64(cascadeTick << mTickShift);
+}
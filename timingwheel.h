@@ -0,0 +1,60 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <QtGlobal>
+#include <QVector>
+
+//hierarchical timing wheel, the classic cascading kind. timers are small ints the caller
+// hands out (a pool index, say), scheduling and cancelling one is O(1) whatever the
+// number armed, and advance only touches the timers that are actually due.
+// deadlines are rounded up to the tick, a timer never fires early
+class TimingWheel
+{
+public:
+    //tick is 2^tickShift ns, the default is just over a millisecond
+    explicit TimingWheel(int tickShift = 20);
+
+    int size() const { return mArmed; }
+    bool isArmed(int timer) const { return timer < mTimers.size() && mTimers[timer].slot >= 0; }
+
+    //arms timer for deadlineNs (monotonic), rearming it if it was already armed
+    void schedule(int timer, qint64 deadlineNs);
+    void cancel(int timer);
+
+    //fires everything due by nowNs: appends the timers to expired, in deadline order
+    // to within a tick, and disarms them
+    void advance(qint64 nowNs, QVector<int>& expired);
+
+    //no timer fires before this, -1 if none is armed. it can be a little early
+    // when the next timer still sits in an outer wheel
+    qint64 nextDeadline() const;
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int SLOT_MASK = SLOTS - 1;
+
+    struct Timer
+    {
+        quint64 tick = 0;
+        int slot = -1;              //level * SLOTS + index, -1 when not armed
+        int prev = -1;
+        int next = -1;
+    };
+
+    void link(int timer);
+    void unlink(int timer);
+    //re-files the timers of one outer slot, returns the slot index so the caller
+    // knows whether the next level up wraps too
+    int cascade(int level);
+
+    int mTickShift;
+    quint64 mNextTick = 0;          //the tick advance processes next
+    int mArmed = 0;
+    int mOuter = 0;                 //armed timers in the outer wheels
+    int mHeads[LEVELS * SLOTS];
+    QVector<Timer> mTimers;
+};
+
+#endif // TIMINGWHEEL_H
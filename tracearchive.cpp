@@ -0,0 +1,605 @@
+#include "tracearchive.h"
+
+#include <QDateTime>
+
+#include <algorithm>
+#include <cstring>
+
+#include <netinet/ip_icmp.h>
+
+//bytes a writer holds before it writes them
+static const int ARCHIVE_WRITE_BUFFER = 64 * 1024;
+
+static const char ARCHIVE_MAGIC[4] = {'T', 'R', 'A', 'R'};
+static const quint8 ARCHIVE_VERSION = 1;
+static const int ARCHIVE_HEADER_SIZE = 8;       //magic, version, 3 reserved
+static const int ARCHIVE_FOOTER_SIZE = 16;      //'F', 3 reserved, offset of the last index, magic
+
+static const char BLOCK_RECORD = 'R';
+static const char BLOCK_INDEX = 'I';
+static const char BLOCK_FOOTER = 'F';
+
+//how a probe is coded, on top of ArchiveHop::Flags
+enum HopCoding {
+    SameAddress         = 0x10,     //no address, it's the last one that answered
+    TimeExceeded        = 0x20,     //no icmp status, it's ttl exceeded in transit
+    HasStatus           = 0x40,     //status and recvTTL follow
+};
+static const quint16 TIME_EXCEEDED_STATUS = ICMP_TIMXCEED << 8;
+
+namespace {
+
+void putVarint(QByteArray& out, quint64 value)
+{
+    while (value >= 0x80) {
+        out.append(char(value | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+quint64 zigzag(qint64 value)
+{
+    return (quint64(value) << 1) ^ quint64(value >> 63);
+}
+
+qint64 unzigzag(quint64 value)
+{
+    return qint64(value >> 1) ^ -qint64(value & 1);
+}
+
+void putFixed(QByteArray& out, quint64 value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+        out.append(char(value >> (8 * i)));
+}
+
+//everything reading the map goes through these, a corrupt or cut off file stops the
+// reader rather than running it off the end
+bool getVarint(const uchar*& p, const uchar* end, quint64& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uchar b = *p++;
+        value |= quint64(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+template <typename T>
+bool getVarint(const uchar*& p, const uchar* end, T& value)
+{
+    quint64 v;
+    if (!getVarint(p, end, v))
+        return false;
+    value = T(v);
+    return true;
+}
+
+quint64 getFixed(const uchar* p, int bytes)
+{
+    quint64 value = 0;
+    for (int i = 0; i < bytes; ++i)
+        value |= quint64(p[i]) << (8 * i);
+    return value;
+}
+
+//a block's tag and payload, false if it doesn't fit in what's left of the file
+bool readBlock(const uchar* data, qint64 end, qint64 offset, char& tag, const uchar*& payload, qint64& next)
+{
+    const uchar* p = data + offset;
+    const uchar* limit = data + end;
+    quint64 length;
+    if (p >= limit)
+        return false;
+    tag = char(*p++);
+    if (!getVarint(p, limit, length) || length > quint64(limit - p))
+        return false;
+    payload = p;
+    next = (p - data) + qint64(length);
+    return true;
+}
+
+}
+
+ArchiveHop::ArchiveHop(const ProbeResult& result)
+: address(result.address)
+, rttUs(result.rttUs)
+, ttl(result.flags & ProbeResult::Echo ? quint16(result.seq) : result.ttl)
+, icmpStatus(quint16(result.icmpType << 8 | result.icmpCode))
+, recvTTL(result.recvTTL)
+{
+    if (result.flags & ProbeResult::TimedOut)
+        flags |= TimedOut;
+    if (result.flags & ProbeResult::Shared)
+        flags |= Shared;
+    if (result.flags & ProbeResult::Echo)
+        flags |= Echo;
+}
+
+bool ArchiveTrace::nextHop(ArchiveHop& hop)
+{
+    if (mHopsLeft <= 0 || mPos >= mEnd)
+        return false;
+
+    quint8 coding = *mPos++;
+    quint64 value;
+    hop = ArchiveHop();
+    hop.flags = coding & (ArchiveHop::TimedOut | ArchiveHop::Shared | ArchiveHop::Echo);
+
+    if (!getVarint(mPos, mEnd, value))
+        return false;
+    mTTL = quint16(mTTL + unzigzag(value));
+    hop.ttl = mTTL;
+
+    if (!hop.timedOut()) {
+        if (!(coding & SameAddress)) {
+            if (!getVarint(mPos, mEnd, value))
+                return false;
+            mAddress ^= quint32(value);
+        }
+        hop.address = mAddress;
+
+        if (!getVarint(mPos, mEnd, value))
+            return false;
+        mRttUs = quint32(mRttUs + unzigzag(value));
+        hop.rttUs = mRttUs;
+
+        hop.icmpStatus = TIME_EXCEEDED_STATUS;
+        if (!(coding & TimeExceeded) && !getVarint(mPos, mEnd, hop.icmpStatus))
+            return false;
+    }
+
+    if (coding & HasStatus) {
+        if (!getVarint(mPos, mEnd, hop.status) || !getVarint(mPos, mEnd, hop.recvTTL))
+            return false;
+    }
+
+    --mHopsLeft;
+    return true;
+}
+
+TraceArchiveReader::~TraceArchiveReader()
+{
+    close();
+}
+
+bool TraceArchiveReader::open(const QString& fileName)
+{
+    close();
+
+    mFile.setFileName(fileName);
+    if (!mFile.open(QIODevice::ReadOnly)) {
+        mError = mFile.errorString();
+        return false;
+    }
+    mSize = mFile.size();
+    if (mSize < ARCHIVE_HEADER_SIZE) {
+        mError = "not a trace archive";
+        close();
+        return false;
+    }
+
+    //the pages come in as a scan touches them, a file bigger than memory is fine
+    mData = mFile.map(0, mSize);
+    if (!mData) {
+        mError = mFile.errorString();
+        close();
+        return false;
+    }
+    if (memcmp(mData, ARCHIVE_MAGIC, sizeof (ARCHIVE_MAGIC)) || mData[4] != ARCHIVE_VERSION) {
+        mError = "not a trace archive";
+        close();
+        return false;
+    }
+
+    if (!readIndexChain())
+        scanBlocks();
+    rewind();
+    return true;
+}
+
+void TraceArchiveReader::close()
+{
+    if (mData)
+        mFile.unmap(const_cast<uchar*>(mData));
+    mFile.close();
+    mData = nullptr;
+    mSize = mEnd = 0;
+    mLastIndex = 0;
+    mTraceCount = 0;
+    mTruncated = false;
+    mChunks.clear();
+    mTail.clear();
+    mPos = mPrevStartMs = 0;
+    mNumber = 0;
+}
+
+bool TraceArchiveReader::readIndexChain()
+{
+    if (mSize < ARCHIVE_HEADER_SIZE + ARCHIVE_FOOTER_SIZE)
+        return false;
+
+    const uchar* footer = mData + mSize - ARCHIVE_FOOTER_SIZE;
+    if (footer[0] != BLOCK_FOOTER || memcmp(footer + 12, ARCHIVE_MAGIC, sizeof (ARCHIVE_MAGIC)))
+        return false;
+    qint64 end = mSize - ARCHIVE_FOOTER_SIZE;
+    qint64 last = qint64(getFixed(footer + 4, 8));
+
+    //back from the last index to the first, each one knows the one before it
+    QVector<Chunk> chunks;
+    for (qint64 offset = last; offset; ) {
+        char tag;
+        const uchar* p;
+        qint64 next;
+        if (offset < ARCHIVE_HEADER_SIZE || offset >= end
+            || !readBlock(mData, end, offset, tag, p, next) || tag != BLOCK_INDEX)
+            return false;
+
+        const uchar* limit = mData + next;
+        Chunk chunk;
+        quint64 prev;
+        if (!getVarint(p, limit, chunk.firstTrace) || !getVarint(p, limit, chunk.count)
+            || !getVarint(p, limit, prev) || qint64(prev) >= offset)
+            return false;
+        chunk.indexOffset = offset;
+        chunks.append(chunk);
+        offset = qint64(prev);
+    }
+    std::reverse(chunks.begin(), chunks.end());
+
+    mChunks = chunks;
+    mEnd = end;
+    mLastIndex = last;
+    mTraceCount = chunks.isEmpty() ? 0 : chunks.last().firstTrace + chunks.last().count;
+    return true;
+}
+
+void TraceArchiveReader::scanBlocks()
+{
+    //only the block headers and the first field of each record are read, the rest is skipped
+    mChunks.clear();
+    mTail.clear();
+    quint64 number = 0;
+    qint64 prevStartMs = 0;
+    qint64 offset = ARCHIVE_HEADER_SIZE;
+    while (offset < mSize) {
+        char tag;
+        const uchar* p;
+        qint64 next;
+        if (!readBlock(mData, mSize, offset, tag, p, next))
+            break;
+
+        if (tag == BLOCK_RECORD) {
+            quint64 delta;
+            if (!getVarint(p, mData + next, delta))
+                break;
+            prevStartMs += unzigzag(delta);
+            mTail.append(TailRecord{offset, prevStartMs});
+            ++number;
+        } else if (tag == BLOCK_INDEX) {
+            Chunk chunk;
+            const uchar* limit = mData + next;
+            if (!getVarint(p, limit, chunk.firstTrace) || !getVarint(p, limit, chunk.count))
+                break;
+            chunk.indexOffset = offset;
+            mChunks.append(chunk);
+            mTail.clear();
+            mLastIndex = offset;
+            prevStartMs = 0;
+        } else {
+            break;
+        }
+        offset = next;
+    }
+
+    mEnd = offset;
+    mTruncated = offset < mSize;
+    mTraceCount = number;
+}
+
+void TraceArchiveReader::rewind()
+{
+    mPos = ARCHIVE_HEADER_SIZE;
+    mPrevStartMs = 0;
+    mNumber = 0;
+}
+
+bool TraceArchiveReader::seek(quint64 number)
+{
+    if (!mData || number >= mTraceCount)
+        return false;
+
+    auto chunk = std::upper_bound(mChunks.constBegin(), mChunks.constEnd(), number,
+                                  [](quint64 n, const Chunk& c) { return n < c.firstTrace; });
+    if (chunk != mChunks.constBegin()) {
+        --chunk;
+        if (number < chunk->firstTrace + chunk->count)
+            return seekChunk(*chunk, int(number - chunk->firstTrace));
+    }
+
+    //past the last index
+    quint64 indexed = mChunks.isEmpty() ? 0 : mChunks.last().firstTrace + mChunks.last().count;
+    int k = int(number - indexed);
+    if (k >= mTail.size())
+        return false;
+    mPos = mTail[k].offset;
+    mPrevStartMs = k ? mTail[k - 1].startMs : 0;
+    mNumber = number;
+    return true;
+}
+
+bool TraceArchiveReader::seekChunk(const Chunk& chunk, int k)
+{
+    char tag;
+    const uchar* p;
+    qint64 next;
+    if (!readBlock(mData, mEnd, chunk.indexOffset, tag, p, next))
+        return false;
+
+    const uchar* limit = mData + next;
+    quint64 skip;
+    for (int i = 0; i < 3; ++i) {
+        if (!getVarint(p, limit, skip))
+            return false;
+    }
+
+    //the entries are deltas too, from the first record of the chunk up to the k-th
+    qint64 offset = 0;
+    qint64 startMs = 0;
+    qint64 prevStartMs = 0;
+    for (int i = 0; i <= k; ++i) {
+        quint64 offsetDelta, startDelta;
+        if (!getVarint(p, limit, offsetDelta) || !getVarint(p, limit, startDelta))
+            return false;
+        prevStartMs = startMs;
+        offset += qint64(offsetDelta);
+        startMs += unzigzag(startDelta);
+    }
+
+    mPos = offset;
+    mPrevStartMs = k ? prevStartMs : 0;
+    mNumber = chunk.firstTrace + k;
+    return true;
+}
+
+bool TraceArchiveReader::next(ArchiveTrace& trace)
+{
+    while (mPos < mEnd) {
+        char tag;
+        const uchar* p;
+        qint64 next;
+        if (!readBlock(mData, mEnd, mPos, tag, p, next))
+            return false;
+        mPos = next;
+
+        //start times begin again from 0 after every index
+        if (tag == BLOCK_INDEX) {
+            mPrevStartMs = 0;
+            continue;
+        }
+        if (tag != BLOCK_RECORD)
+            return false;
+
+        const uchar* limit = mData + next;
+        quint64 startDelta, nameLength;
+        if (!getVarint(p, limit, startDelta)
+            || !getVarint(p, limit, trace.mDurationMs)
+            || limit - p < 4)
+            return false;
+        trace.mDestination = quint32(getFixed(p, 4));
+        p += 4;
+        if (!getVarint(p, limit, trace.mCycle)
+            || !getVarint(p, limit, nameLength)
+            || nameLength > quint64(limit - p))
+            return false;
+        trace.mName = reinterpret_cast<const char*>(p);
+        trace.mNameLength = int(nameLength);
+        p += nameLength;
+        if (!getVarint(p, limit, trace.mHopCount))
+            return false;
+
+        mPrevStartMs += unzigzag(startDelta);
+        trace.mStartMs = mPrevStartMs;
+        trace.mNumber = mNumber++;
+        trace.mPos = p;
+        trace.mEnd = limit;
+        trace.mHopsLeft = trace.mHopCount;
+        trace.mTTL = 0;
+        trace.mAddress = 0;
+        trace.mRttUs = 0;
+        return true;
+    }
+    return false;
+}
+
+TraceArchiveWriter::TraceArchiveWriter(int indexInterval)
+: mIndexInterval(qMax(1, indexInterval))
+{
+    mBuffer.reserve(ARCHIVE_WRITE_BUFFER);
+    mRecord.reserve(256);
+}
+
+TraceArchiveWriter::~TraceArchiveWriter()
+{
+    close();
+}
+
+bool TraceArchiveWriter::open(const QString& fileName)
+{
+    close();
+
+    //a reader works out where the last writer left off
+    qint64 end = 0;
+    if (QFile::exists(fileName) && QFile(fileName).size() > 0) {
+        TraceArchiveReader reader;
+        if (!reader.open(fileName)) {
+            mError = reader.errorString();
+            return false;
+        }
+        end = reader.mEnd;
+        mTraces = reader.mTraceCount;
+        mLastIndex = reader.mLastIndex;
+        mUnindexed = reader.mTail;
+        mPrevStartMs = mUnindexed.isEmpty() ? 0 : mUnindexed.last().startMs;
+    }
+
+    mFile.setFileName(fileName);
+    if (!mFile.open(QIODevice::ReadWrite)) {
+        mError = mFile.errorString();
+        return false;
+    }
+
+    if (!end) {
+        mFile.resize(0);
+        mBuffer.append(ARCHIVE_MAGIC, sizeof (ARCHIVE_MAGIC));
+        putFixed(mBuffer, ARCHIVE_VERSION, 4);
+        mOffset = ARCHIVE_HEADER_SIZE;
+    } else {
+        //the footer, or whatever half a block a crash left, goes
+        mFile.resize(end);
+        mFile.seek(end);
+        mOffset = end;
+    }
+    return true;
+}
+
+void TraceArchiveWriter::close()
+{
+    if (!mFile.isOpen())
+        return;
+
+    writeIndex();
+    mBuffer.append(BLOCK_FOOTER);
+    putFixed(mBuffer, 0, 3);
+    putFixed(mBuffer, quint64(mLastIndex), 8);
+    mBuffer.append(ARCHIVE_MAGIC, sizeof (ARCHIVE_MAGIC));
+    flush();
+    mFile.close();
+
+    mPending.clear();
+    mUnindexed.clear();
+    mOffset = mPrevStartMs = mLastIndex = 0;
+    mTraces = 0;
+}
+
+void TraceArchiveWriter::addHop(int trace, const ArchiveHop& hop)
+{
+    Pending& p = mPending[trace];
+    if (!p.count)
+        p.firstMs = QDateTime::currentMSecsSinceEpoch();
+
+    quint8 coding = hop.flags & (ArchiveHop::TimedOut | ArchiveHop::Shared | ArchiveHop::Echo);
+    bool timedOut = hop.timedOut();
+    if (!timedOut && p.count && hop.address == p.address)
+        coding |= SameAddress;
+    if (!timedOut && hop.icmpStatus == TIME_EXCEEDED_STATUS)
+        coding |= TimeExceeded;
+    if (hop.status || hop.recvTTL)
+        coding |= HasStatus;
+
+    p.hops.append(char(coding));
+    putVarint(p.hops, zigzag(qint64(hop.ttl) - p.ttl));
+    p.ttl = hop.ttl;
+
+    if (!timedOut) {
+        if (!(coding & SameAddress)) {
+            putVarint(p.hops, hop.address ^ p.address);
+            p.address = hop.address;
+        }
+        putVarint(p.hops, zigzag(qint64(hop.rttUs) - p.rttUs));
+        p.rttUs = hop.rttUs;
+        if (!(coding & TimeExceeded))
+            putVarint(p.hops, hop.icmpStatus);
+    }
+
+    if (coding & HasStatus) {
+        putVarint(p.hops, hop.status);
+        putVarint(p.hops, hop.recvTTL);
+    }
+    ++p.count;
+}
+
+bool TraceArchiveWriter::endTrace(int trace, const ArchiveTraceHeader& header)
+{
+    if (!mFile.isOpen())
+        return false;
+
+    Pending p = mPending.take(trace);
+    qint64 nowMs = QDateTime::currentMSecsSinceEpoch();
+    qint64 startMs = header.startMs ? header.startMs : (p.count ? p.firstMs : nowMs);
+    quint32 durationMs = header.durationMs ? header.durationMs : quint32(qMax<qint64>(0, nowMs - startMs));
+
+    mRecord.resize(0);
+    putVarint(mRecord, zigzag(startMs - mPrevStartMs));
+    putVarint(mRecord, durationMs);
+    putFixed(mRecord, header.destination, 4);
+    putVarint(mRecord, header.cycle);
+    putVarint(mRecord, quint64(header.name.size()));
+    mRecord.append(header.name);
+    putVarint(mRecord, quint64(p.count));
+    mRecord.append(p.hops);
+
+    mUnindexed.append(TraceArchiveReader::TailRecord{mOffset, startMs});
+    appendBlock(BLOCK_RECORD, mRecord);
+    mPrevStartMs = startMs;
+    ++mTraces;
+
+    if (mUnindexed.size() >= mIndexInterval)
+        writeIndex();
+    if (mBuffer.size() >= ARCHIVE_WRITE_BUFFER)
+        return flush();
+    return true;
+}
+
+void TraceArchiveWriter::discardTrace(int trace)
+{
+    mPending.remove(trace);
+}
+
+bool TraceArchiveWriter::flush()
+{
+    if (mBuffer.isEmpty())
+        return true;
+    bool written = mFile.write(mBuffer) == mBuffer.size();
+    if (!written)
+        mError = mFile.errorString();
+    mBuffer.resize(0);
+    return written && mFile.flush();
+}
+
+void TraceArchiveWriter::appendBlock(char tag, const QByteArray& payload)
+{
+    int before = mBuffer.size();
+    mBuffer.append(tag);
+    putVarint(mBuffer, quint64(payload.size()));
+    mBuffer.append(payload);
+    mOffset += mBuffer.size() - before;
+}
+
+void TraceArchiveWriter::writeIndex()
+{
+    if (mUnindexed.isEmpty())
+        return;
+
+    //first trace, count, the index before this one, then offset and start time per record
+    QByteArray index;
+    putVarint(index, mTraces - quint64(mUnindexed.size()));
+    putVarint(index, quint64(mUnindexed.size()));
+    putVarint(index, quint64(mLastIndex));
+    qint64 offset = 0;
+    qint64 startMs = 0;
+    for (const TraceArchiveReader::TailRecord& record : mUnindexed) {
+        putVarint(index, quint64(record.offset - offset));
+        putVarint(index, zigzag(record.startMs - startMs));
+        offset = record.offset;
+        startMs = record.startMs;
+    }
+
+    mLastIndex = mOffset;
+    appendBlock(BLOCK_INDEX, index);
+    mUnindexed.clear();
+    mPrevStartMs = 0;
+}
@@ -0,0 +1,196 @@
+#ifndef TRACEARCHIVE_H
+#define TRACEARCHIVE_H
+
+#include "iphlpr.h"
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QLatin1String>
+#include <QVector>
+
+//append-only binary file of finished traces, for keeping millions of them around.
+// after an 8 byte header the file is a run of blocks, each a tag byte, a varint length
+// and the payload:
+//  'R' one trace: its header, then its probes delta coded against the one before
+//      (ttl and rtt as zigzag varints, the address xored with the last one that answered)
+//  'I' an index of the records since the last index, every ARCHIVE_INDEX_INTERVAL traces
+// a writer that's closed properly ends the file with a fixed size footer pointing at the
+// last index, so a reader can find any trace without touching the records in between.
+// without one (the writer died) the reader walks the block headers instead
+
+//one probe as the archive keeps it, the fields of Ping plus the flags of ProbeResult
+struct ArchiveHop
+{
+    enum Flags {
+        TimedOut        = 0x01,
+        Shared          = 0x02,
+        Echo            = 0x04,
+    };
+
+    quint32 address = 0;        //host order, 0 for a timeout
+    quint32 rttUs = 0;
+    quint32 status = 0;         //as Ping's, 0 is an answer
+    quint16 ttl = 0;            //or the seq of an echo
+    quint16 icmpStatus = 0;     //icmp type << 8 | code
+    quint8 recvTTL = 0;
+    quint8 flags = 0;
+
+    ArchiveHop() = default;
+    explicit ArchiveHop(const ProbeResult& result);
+    bool timedOut() const { return flags & TimedOut; }
+};
+
+struct ArchiveTraceHeader
+{
+    qint64 startMs = 0;         //since the epoch, 0 takes the time of the first probe added
+    quint32 durationMs = 0;     //0 takes the time from the first probe to endTrace
+    quint32 destination = 0;    //host order, 0 if only the name is known
+    quint32 cycle = 0;          //of a continuous trace
+    QByteArray name;
+};
+
+//a trace record in a mapped archive. nothing is copied out of the file, the probes are
+// decoded one at a time by nextHop
+class ArchiveTrace
+{
+public:
+    quint64 number() const { return mNumber; }      //position in the archive, from 0
+    qint64 startMs() const { return mStartMs; }
+    quint32 durationMs() const { return mDurationMs; }
+    quint32 destination() const { return mDestination; }
+    quint32 cycle() const { return mCycle; }
+    QLatin1String name() const { return QLatin1String(mName, mNameLength); }
+    int hopCount() const { return mHopCount; }
+
+    //the next probe of the trace, false after the last one or at a corrupt one
+    bool nextHop(ArchiveHop& hop);
+
+private:
+    friend class TraceArchiveReader;
+
+    quint64 mNumber = 0;
+    qint64 mStartMs = 0;
+    quint32 mDurationMs = 0;
+    quint32 mDestination = 0;
+    quint32 mCycle = 0;
+    const char* mName = nullptr;
+    int mNameLength = 0;
+    int mHopCount = 0;
+
+    //where nextHop is and what the next probe is coded against
+    const uchar* mPos = nullptr;
+    const uchar* mEnd = nullptr;
+    int mHopsLeft = 0;
+    quint16 mTTL = 0;
+    quint32 mAddress = 0;
+    quint32 mRttUs = 0;
+};
+
+class TraceArchiveReader
+{
+public:
+    TraceArchiveReader() = default;
+    ~TraceArchiveReader();
+
+    bool open(const QString& fileName);
+    void close();
+    bool isOpen() const { return mData; }
+    QString errorString() const { return mError; }
+
+    quint64 traceCount() const { return mTraceCount; }
+    //the file ends in the middle of a block, a writer died there
+    bool truncated() const { return mTruncated; }
+
+    //next() goes through the traces in order from wherever rewind() or seek() left it
+    void rewind();
+    bool seek(quint64 number);
+    bool next(ArchiveTrace& trace);
+
+private:
+    friend class TraceArchiveWriter;
+
+    //one index block and the records it covers
+    struct Chunk
+    {
+        quint64 firstTrace;
+        int count;
+        qint64 indexOffset;
+    };
+    //a record after the last index block
+    struct TailRecord
+    {
+        qint64 offset;
+        qint64 startMs;
+    };
+
+    bool readIndexChain();
+    void scanBlocks();
+    bool seekChunk(const Chunk& chunk, int k);
+
+    QFile mFile;
+    const uchar* mData = nullptr;
+    qint64 mSize = 0;
+    qint64 mEnd = 0;                //past the last whole block, the footer isn't part of it
+    qint64 mLastIndex = 0;
+    quint64 mTraceCount = 0;
+    bool mTruncated = false;
+    QVector<Chunk> mChunks;
+    QVector<TailRecord> mTail;
+    QString mError;
+
+    qint64 mPos = 0;
+    qint64 mPrevStartMs = 0;        //record start times are deltas from the one before
+    quint64 mNumber = 0;
+};
+
+class TraceArchiveWriter
+{
+public:
+    explicit TraceArchiveWriter(int indexInterval = ARCHIVE_INDEX_INTERVAL);
+    ~TraceArchiveWriter();
+
+    //creates the file or appends to it. a tail left by a writer that died is cut back to
+    // the last whole record and its records go in the next index
+    bool open(const QString& fileName);
+    //writes the last index and the footer
+    void close();
+    bool isOpen() const { return mFile.isOpen(); }
+    QString errorString() const { return mError; }
+    quint64 traceCount() const { return mTraces; }
+
+    //the probes of a trace build up in memory until endTrace writes the record, so the
+    // traces of a batch can finish in any order. trace is whatever the caller numbers them by
+    void addHop(int trace, const ArchiveHop& hop);
+    bool endTrace(int trace, const ArchiveTraceHeader& header);
+    void discardTrace(int trace);
+    bool flush();
+
+private:
+    struct Pending
+    {
+        QByteArray hops;
+        int count = 0;
+        qint64 firstMs = 0;
+        quint16 ttl = 0;
+        quint32 address = 0;
+        quint32 rttUs = 0;
+    };
+
+    void appendBlock(char tag, const QByteArray& payload);
+    void writeIndex();
+
+    QFile mFile;
+    QString mError;
+    int mIndexInterval;
+    QByteArray mBuffer;             //written on flush, once it passes ARCHIVE_WRITE_BUFFER or at close
+    QByteArray mRecord;             //reused for every record
+    QHash<int, Pending> mPending;
+    qint64 mOffset = 0;             //of the end of mBuffer in the file
+    qint64 mPrevStartMs = 0;
+    qint64 mLastIndex = 0;
+    quint64 mTraces = 0;
+    QVector<TraceArchiveReader::TailRecord> mUnindexed;
+};
+
+#endif // TRACEARCHIVE_H
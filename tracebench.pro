@@ -0,0 +1,15 @@
+# benchmarks for the probe hot path, run against a simulated network so no privileges
+# or network are needed:
+#   qmake tracebench.pro && make && ./traceroute-bench --thresholds bench-thresholds.json
+QT       += core network
+QT       -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = traceroute-bench
+
+include(traceroute.pri)
+
+SOURCES += \
+    bench.cpp
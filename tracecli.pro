@@ -0,0 +1,19 @@
+# headless build, no QtGui/QtWidgets so it runs on servers without a display:
+#   qmake tracecli.pro && make
+QT       += core network
+QT       -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = traceroute-cli
+
+include(traceroute.pri)
+
+SOURCES += \
+    cli.cpp
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
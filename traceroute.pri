@@ -0,0 +1,45 @@
+# the probing engine, everything but a front end. shared by the gui and the headless cli
+
+SOURCES += \
+    $$PWD/checksum.cpp \
+    $$PWD/dnscache.cpp \
+    $$PWD/hopstats.cpp \
+    $$PWD/inflight.cpp \
+    $$PWD/iphlpr.cpp \
+    $$PWD/metrics.cpp \
+    $$PWD/pacer.cpp \
+    $$PWD/pingsweep.cpp \
+    $$PWD/probe.cpp \
+    $$PWD/probeio.cpp \
+    $$PWD/probetransport.cpp \
+    $$PWD/resultring.cpp \
+    $$PWD/simnetwork.cpp \
+    $$PWD/stopset.cpp \
+    $$PWD/timingwheel.cpp \
+    $$PWD/tracearchive.cpp \
+    $$PWD/tracesched.cpp \
+    $$PWD/tracestate.cpp \
+    $$PWD/unixiphlpr.cpp
+
+HEADERS += \
+    $$PWD/checksum.h \
+    $$PWD/dnscache.h \
+    $$PWD/hopstats.h \
+    $$PWD/inflight.h \
+    $$PWD/iphlpr.h \
+    $$PWD/metrics.h \
+    $$PWD/pacer.h \
+    $$PWD/pingsweep.h \
+    $$PWD/probe.h \
+    $$PWD/probeio.h \
+    $$PWD/probetransport.h \
+    $$PWD/resultring.h \
+    $$PWD/simnetwork.h \
+    $$PWD/stopset.h \
+    $$PWD/timingwheel.h \
+    $$PWD/tracearchive.h \
+    $$PWD/tracesched.h \
+    $$PWD/tracestate.h \
+    $$PWD/unixiphlpr.h
+
+INCLUDEPATH += $$PWD
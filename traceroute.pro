@@ -8,16 +8,14 @@ CONFIG += c++17
 # In order to do so, uncomment the following line.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
+include(traceroute.pri)
+
 SOURCES += \
-    iphlpr.cpp \
     main.cpp \
-    mainwindow.cpp \
-    unixiphlpr.cpp
+    mainwindow.cpp
 
 HEADERS += \
-    iphlpr.h \
-    mainwindow.h \
-    unixiphlpr.h
+    mainwindow.h
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
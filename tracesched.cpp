@@ -0,0 +1,340 @@
+#include "tracesched.h"
+#include "metrics.h"
+#include "pacer.h"
+
+#include <QDebug>
+#include <QThread>
+
+#include <climits>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static quint64 identityKey(quint32 destination, int block)
+{
+    return (quint64(destination) << 32) | quint32(block);
+}
+
+TraceScheduler::TraceScheduler(const TraceOptions& options, const QVector<QHostAddress>& targets, int maxConcurrent, ResultRing* results)
+: QObject()
+, mOptions(options)
+, mTargets(targets)
+, mMaxConcurrent(qMax(1, maxConcurrent))
+, mResults(results)
+{
+    //every probe of a trace gets its own tag, seq starts at 1
+    mBlockSize = qMax(1, TraceState::tagsPerTrace(mOptions));
+    mMaxBlocks = qBound(1, (0xffff - mOptions.destinationPort) / mBlockSize, 64);
+
+    mPending.reserve(mTargets.size());
+    for (int i = 0; i < mTargets.size(); ++i)
+        mPending.append(i);
+}
+
+TraceScheduler::~TraceScheduler()
+{
+    qDeleteAll(mActive);
+}
+
+void TraceScheduler::stop()
+{
+    mShouldStop = true;
+    mWakeup.signal();
+}
+
+bool TraceScheduler::openTransport()
+{
+    //a sweep can have thousands of replies land at once. without the privileges for an
+    // icmp socket they come off the error queue, as they do for a single trace
+    mTransport.reset(ProbeTransport::create());
+    mTransport->setWakeup(&mWakeup);
+    if (!mTransport->open(mOptions.receiveBackend == TraceOptions::IcmpSocket
+                          ? ProbeTransport::IcmpSocketOrErrorQueue : ProbeTransport::ErrorQueue,
+                          4 * 1024 * 1024))
+        return false;
+    mSourcePort = mTransport->sourcePort();
+
+    //rtts come from kernel timestamps so a busy loop doesn't inflate them
+    if (mTransport->hasTxTimestamps())
+        mSendBatch.trackTxTimestamps(PROBE_TX_RING * 16);
+    return true;
+}
+
+void TraceScheduler::admit()
+{
+    //anything we can't place this round goes to the back of the queue
+    for (int attempts = mPending.size(); attempts > 0 && mActive.size() < mMaxConcurrent; --attempts) {
+        int id = mPending.takeFirst();
+        quint32 destination = mTargets[id].toIPv4Address();
+
+        quint64 used = mBlocksInUse.value(destination);
+        int block = 0;
+        while (block < mMaxBlocks && (used & (quint64(1) << block)))
+            ++block;
+        if (block == mMaxBlocks) {
+            //every port block for this host is busy, try again once one frees up
+            mPending.append(id);
+            continue;
+        }
+        mBlocksInUse[destination] = used | (quint64(1) << block);
+
+        TraceOptions options = mOptions;
+        options.destinationPort += block * mBlockSize;
+        Trace* trace = new Trace(id, block, options, destination, mSourcePort, &mInFlight, &mStopSet);
+        if (mOptions.paris || mOptions.multipath)
+            trace->source = mTransport->sourceAddressFor(destination);
+        mActive.append(trace);
+        mByIdentity.insert(identityKey(destination, block), trace);
+    }
+}
+
+void TraceScheduler::retire(int index)
+{
+    Trace* trace = mActive[index];
+    quint32 destination = trace->state.destination();
+
+    mByIdentity.remove(identityKey(destination, trace->block));
+    quint64 used = mBlocksInUse.value(destination) & ~(quint64(1) << trace->block);
+    if (used)
+        mBlocksInUse[destination] = used;
+    else
+        mBlocksInUse.remove(destination);
+
+    emit traceDone(trace->id);
+
+    mActive[index] = mActive.last();
+    mActive.removeLast();
+    delete trace;
+}
+
+void TraceScheduler::flush()
+{
+    //the probes still queued go out once the transport says the buffer drained
+    if (!mSendBatch.isEmpty()) {
+        qint64 syscallStart = EngineMetrics::clockNs();
+        int sent = mTransport->send(mSendBatch);
+        EngineMetrics::record(EngineMetrics::SyscallNs, EngineMetrics::clockNs() - syscallStart);
+        EngineMetrics::add(EngineMetrics::ProbesSent, qMax(0, sent));
+    }
+    mSendBlocked = !mSendBatch.isEmpty();
+}
+
+void TraceScheduler::sendProbes(qint64 nowNs)
+{
+    //whatever didn't fit last time goes first
+    flush();
+    if (mSendBlocked)
+        return;
+
+    //tokens come out of the process-wide budget a batch at a time, the leftover goes back
+    char probe[64] = {0};
+    int tokens = 0;
+    for (Trace* trace : mActive) {
+        int ttl;
+        quint16 tag;
+        quint16 dport;
+        for (int sent = 0; sent < mOptions.sendBatch; ++sent) {
+            if (!tokens && !(tokens = TokenBucket::global().take(mSendBatch.capacity())))
+                break;
+            if (!trace->state.nextProbe(nowNs, ttl, tag, dport))
+                break;
+            --tokens;
+
+            if (trace->source)
+                fillParisProbe(probe, sizeof (probe), trace->source, trace->state.destination(), mSourcePort, dport, tag);
+            mSendBatch.add(trace->state.destination(), dport, ttl, probe, sizeof (probe), tag);
+            if (!mSendBatch.isFull())
+                continue;
+
+            flush();
+            if (mSendBlocked) {
+                TokenBucket::global().giveBack(tokens);
+                return;
+            }
+        }
+        //out of budget, the rest wait for the next round
+        if (!tokens && TokenBucket::global().waitNs())
+            break;
+    }
+    TokenBucket::global().giveBack(tokens);
+    flush();
+}
+
+void TraceScheduler::drainReplies(qint64 nowNs, qint64 wokeNs)
+{
+    int received;
+    int total = 0, matched = 0, foreign = 0;
+    do {
+        qint64 syscallStart = EngineMetrics::clockNs();
+        received = mTransport->receive(mRecvBatch);
+        qint64 parseStart = EngineMetrics::clockNs();
+        EngineMetrics::record(EngineMetrics::SyscallNs, parseStart - syscallStart);
+        if (received > 0) {
+            EngineMetrics::record(EngineMetrics::WakeupToParseNs, parseStart - wokeNs);
+            total += received;
+        }
+
+        for (int i = 0; i < received; ++i) {
+            ProbeReply reply;
+            if (!parseProbeReply(mRecvBatch.data(i), mRecvBatch.length(i), mRecvBatch.from(i), reply)
+                || reply.sourcePort != mSourcePort) {
+                ++foreign;
+                continue;
+            }
+            quint16 tag = probeTag(reply, mOptions.paris || mOptions.multipath);
+            if (tag <= mOptions.destinationPort) {
+                ++foreign;
+                continue;
+            }
+            reply.timestampNs = mRecvBatch.timestamp(i);
+
+            int block = (tag - mOptions.destinationPort - 1) / mBlockSize;
+            Trace* trace = mByIdentity.value(identityKey(reply.destination, block));
+            if (trace && trace->state.handleReply(reply, nowNs))
+                ++matched;
+        }
+    } while (received == mRecvBatch.capacity());
+
+    EngineMetrics::add(EngineMetrics::RepliesReceived, total);
+    EngineMetrics::add(EngineMetrics::RepliesMatched, matched);
+    EngineMetrics::add(EngineMetrics::ForeignIcmp, foreign);
+    EngineMetrics::add(EngineMetrics::UnmatchedReplies, total - matched - foreign);
+}
+
+void TraceScheduler::drainErrorQueue(qint64 nowNs, qint64 wokeNs)
+{
+    //transmit timestamps come first for any probe, its icmp error can only follow
+    QueuedError queued[PROBE_IO_BATCH];
+    int count;
+    int received = 0, matched = 0, foreign = 0;
+    while (true) {
+        qint64 syscallStart = EngineMetrics::clockNs();
+        count = mTransport->readErrors(mSendBatch, queued, PROBE_IO_BATCH);
+        qint64 parseStart = EngineMetrics::clockNs();
+        EngineMetrics::record(EngineMetrics::SyscallNs, parseStart - syscallStart);
+        if (count <= 0)
+            break;
+
+        for (int i = 0; i < count; ++i) {
+            if (!queued[i].isIcmp) {
+                if (queued[i].port <= mOptions.destinationPort)
+                    continue;
+                int block = (queued[i].port - mOptions.destinationPort - 1) / mBlockSize;
+                Trace* trace = mByIdentity.value(identityKey(queued[i].destination, block));
+                if (trace)
+                    trace->state.stampProbe(queued[i].port, queued[i].timestampNs);
+                continue;
+            }
+            if (!received)
+                EngineMetrics::record(EngineMetrics::WakeupToParseNs, parseStart - wokeNs);
+            ++received;
+
+            //the kernel matched it to our socket already, the tag still says which trace
+            ProbeReply reply;
+            if (!probeReplyFromError(queued[i], mSourcePort, reply)) {
+                ++foreign;
+                continue;
+            }
+            quint16 tag = probeTag(reply, mOptions.paris || mOptions.multipath);
+            if (tag <= mOptions.destinationPort) {
+                ++foreign;
+                continue;
+            }
+
+            int block = (tag - mOptions.destinationPort - 1) / mBlockSize;
+            Trace* trace = mByIdentity.value(identityKey(reply.destination, block));
+            if (trace && trace->state.handleReply(reply, nowNs))
+                ++matched;
+        }
+    }
+
+    EngineMetrics::add(EngineMetrics::RepliesReceived, received);
+    EngineMetrics::add(EngineMetrics::RepliesMatched, matched);
+    EngineMetrics::add(EngineMetrics::ForeignIcmp, foreign);
+    EngineMetrics::add(EngineMetrics::UnmatchedReplies, received - matched - foreign);
+}
+
+int TraceScheduler::waitTimeoutMS(qint64 nowNs) const
+{
+    qint64 wake = mInFlight.nextDeadline();
+    if (!mSendBlocked) {
+        qint64 sendAt = -1;
+        for (const Trace* trace : mActive) {
+            qint64 at = trace->state.nextSendNs(nowNs);
+            if (at >= 0 && (sendAt < 0 || at < sendAt))
+                sendAt = at;
+            if (sendAt == nowNs)
+                break;
+        }
+
+        //nothing goes out before the process-wide budget has a token for it
+        if (sendAt >= 0) {
+            sendAt = qMax(sendAt, nowNs + TokenBucket::global().waitNs());
+            if (wake < 0 || sendAt < wake)
+                wake = sendAt;
+        }
+    }
+
+    //nothing due is a full send buffer, Writable ends that wait. stop() signals the wakeup
+    if (wake < 0)
+        return -1;
+    return (int) qBound<qint64>(0, (wake - nowNs + 999999) / 1000000, INT_MAX);
+}
+
+void TraceScheduler::process()
+{
+    if (!openTransport()) {
+        mTransport.reset();
+        emit error("can't open the probe sockets");
+        return;
+    }
+
+    qDebug() << "Begin batch of" << mTargets.size() << "traces from port" << mSourcePort;
+
+    while (!mShouldStop) {
+        admit();
+        if (mActive.isEmpty())
+            break;
+
+        if (!mSendBlocked)
+            sendProbes(mTransport->clockNs());
+
+        int ready = mTransport->wait(waitTimeoutMS(mTransport->clockNs()), mSendBlocked);
+        qint64 wokeNs = EngineMetrics::clockNs();
+        if (ready < 0) {
+            emit error("waiting on the probe sockets failed: " + qt_error_string());
+            break;
+        }
+
+        //transmit timestamps, taken before the replies they belong to. on the error queue
+        // backend the replies are in there as well
+        if (ready & ProbeTransport::Errors)
+            drainErrorQueue(mTransport->clockNs(), wokeNs);
+        if (ready & ProbeTransport::Writable)
+            mSendBlocked = false;
+        if (ready & ProbeTransport::Replies)
+            drainReplies(mTransport->clockNs(), wokeNs);
+
+        TraceState::expireAll(mInFlight, mTransport->clockNs());
+        for (int i = mActive.size() - 1; i >= 0; --i) {
+            Trace* trace = mActive[i];
+
+            HopProbe result;
+            int timeouts = 0;
+            while (trace->state.takeResult(result)) {
+                timeouts += result.timedOut;
+                mResults->push(toProbeResult(result, trace->id));
+            }
+            EngineMetrics::add(EngineMetrics::Timeouts, timeouts);
+
+            if (trace->state.isFinished())
+                retire(i);
+        }
+
+        if (mResults->needsWakeup())
+            emit resultsReady();
+    }
+
+    mTransport->close();
+    thread()->quit();
+}
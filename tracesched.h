@@ -0,0 +1,82 @@
+#ifndef TRACESCHED_H
+#define TRACESCHED_H
+
+#include "stopset.h"
+#include "tracestate.h"
+#include "probeio.h"
+#include "probetransport.h"
+#include "resultring.h"
+
+#include <QObject>
+#include <QHash>
+#include <QHostAddress>
+#include <QList>
+#include <QScopedPointer>
+#include <QVector>
+
+//runs a whole batch of traces on one thread over one send and one receive socket.
+// every trace is a TraceState; a probe is told apart by the destination it was sent
+// to plus a block of destination ports handed to its trace, so two traces to the
+// same host don't step on each other
+class TraceScheduler: public QObject
+{
+    Q_OBJECT
+
+    struct Trace
+    {
+        Trace(int id, int block, const TraceOptions& options, quint32 destination, quint16 sourcePort,
+              InFlightTable* inFlight, StopSet* stopSet)
+        : id(id), block(block), state(options, destination, sourcePort, inFlight, stopSet)
+        {}
+
+        int id;
+        int block;
+        quint32 source = 0;     //paris only, see fillParisProbe
+        TraceState state;
+    };
+
+    TraceOptions mOptions;
+    QVector<QHostAddress> mTargets;
+    int mMaxConcurrent;
+    ResultRing* mResults;
+    QList<int> mPending;                    //target indexes not started yet
+    int mBlockSize;
+    int mMaxBlocks;
+
+    QScopedPointer<ProbeTransport> mTransport;
+    quint16 mSourcePort = 0;
+    bool mSendBlocked = false;
+    SendBatch mSendBatch;
+    RecvBatch mRecvBatch;
+    std::atomic_bool mShouldStop{false};
+    Wakeup mWakeup;                         //the transport's wait ends on it, stop() signals it
+
+    InFlightTable mInFlight;                //every probe of every trace, with its timeout
+    StopSet mStopSet;                       //near-side hops learned so far, with doubletreeTTL set
+    QVector<Trace*> mActive;
+    QHash<quint64, Trace*> mByIdentity;     //(destination, port block) -> trace
+    QHash<quint32, quint64> mBlocksInUse;   //destination -> bitmask of port blocks
+
+    bool openTransport();
+    void admit();
+    void sendProbes(qint64 nowNs);
+    void flush();
+    //wokeNs is when the wait returned, on EngineMetrics' clock
+    void drainReplies(qint64 nowNs, qint64 wokeNs);
+    //transmit timestamps, and the replies themselves without an icmp socket
+    void drainErrorQueue(qint64 nowNs, qint64 wokeNs);
+    void retire(int index);
+    int waitTimeoutMS(qint64 nowNs) const;
+public:
+    TraceScheduler(const TraceOptions& options, const QVector<QHostAddress>& targets, int maxConcurrent, ResultRing* results);
+    virtual ~TraceScheduler();
+public slots:
+    void process();
+    void stop();
+signals:
+    void resultsReady();                        //the ring crossed its watermark, results are indexed by trace id
+    void traceDone(int trace);                  //its results are in the ring by now
+    void error(const QString& message);         //the batch stops, traces still out never finish
+};
+
+#endif // TRACESCHED_H
@@ -0,0 +1,470 @@
+#include "tracestate.h"
+#include "pacer.h"
+#include "stopset.h"
+
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+
+#include <cmath>
+
+TraceState::TraceState(const TraceOptions& options, quint32 destination, quint16 sourcePort,
+                       InFlightTable* inFlight, StopSet* stopSet)
+: mOptions(options)
+, mDestination(destination)
+, mSourcePort(sourcePort)
+, mTimeoutNs(qint64(options.timeoutPerHopMS) * 1000000)
+, mMinTimeoutNs(qMin(mTimeoutNs, qint64(options.minTimeoutMS) * 1000000))
+, mInFlight(inFlight)
+, mStopSet(stopSet)
+{
+    mOptions.numProbesPerHop = qMax(1, mOptions.numProbesPerHop);
+    mOptions.paris = mOptions.paris || mOptions.multipath;
+    mOptions.maxProbesPerHop = qMax(mOptions.numProbesPerHop, mOptions.maxProbesPerHop);
+    mOptions.maxOutstanding = qMax(1, mOptions.maxOutstanding);
+    mOptions.queuePerTTL = qMax(1, mOptions.queuePerTTL);
+
+    mLastTTL = mOptions.maxTTL;
+    mNextEmitTTL = mOptions.startTTL;
+
+    //without a stop set there's nothing to stop at, so no point starting in the middle
+    mSplitTTL = mOptions.startTTL;
+    if (mStopSet && mOptions.doubletreeTTL > mOptions.startTTL)
+        mSplitTTL = qMin(mOptions.doubletreeTTL, mOptions.maxTTL);
+    mNextSendTTL = mSplitTTL;
+    mBackTTL = mSplitTTL > mOptions.startTTL ? mSplitTTL - 1 : mOptions.startTTL - 1;
+
+    mHops.resize(qMax(0, mOptions.maxTTL - mOptions.startTTL + 1));
+    //multipath hops grow past this as interfaces turn up
+    for (Hop& h : mHops) {
+        h.target = mOptions.numProbesPerHop;
+        h.probes.resize(h.target);
+        h.tags.resize(h.target);
+    }
+
+    if (!mInFlight) {
+        mOwnInFlight.reset(new InFlightTable(mOptions.maxOutstanding));
+        mInFlight = mOwnInFlight.data();
+    }
+}
+
+TraceState::~TraceState()
+{
+    //a shared table outlives us, it mustn't time out probes for a trace that's gone
+    if (!mOwnInFlight)
+        dropOutstanding(mOptions.startTTL, mOptions.maxTTL);
+}
+
+qint64 TraceState::sendableAt(const Hop& h, qint64 nowNs) const
+{
+    if ((h.sent >= h.target && !h.resend) || h.outstanding >= mOptions.queuePerTTL)
+        return -1;
+    return qMax(nowNs, h.lastSentNs + h.spacingNs);
+}
+
+qint64 TraceState::nextSendNs(qint64 nowNs) const
+{
+    if (mOutstanding >= mOptions.maxOutstanding)
+        return -1;
+
+    qint64 next = -1;
+    if (mBackTTL >= mOptions.startTTL && mBackTTL <= mLastTTL)
+        next = sendableAt(hop(mBackTTL), nowNs);
+
+    for (int ttl = mNextSendTTL; ttl <= mLastTTL && next != nowNs; ++ttl) {
+        qint64 at = sendableAt(hop(ttl), nowNs);
+        if (at >= 0 && (next < 0 || at < next))
+            next = at;
+    }
+    return next;
+}
+
+bool TraceState::nextProbe(qint64 nowNs, int& ttl, quint16& tag, quint16& destinationPort)
+{
+    if (mOutstanding >= mOptions.maxOutstanding)
+        return false;
+
+    //backwards goes one hop at a time, the answer decides whether there is a next one
+    if (mBackTTL >= mOptions.startTTL && mBackTTL <= mLastTTL) {
+        if (sendableAt(hop(mBackTTL), nowNs) == nowNs) {
+            if (!claimProbe(mBackTTL, nowNs, tag, destinationPort))
+                return false;
+            ttl = mBackTTL;
+            return true;
+        }
+    }
+
+    for (int t = mNextSendTTL; t <= mLastTTL; ++t) {
+        if (sendableAt(hop(t), nowNs) != nowNs)
+            continue;
+        if (!claimProbe(t, nowNs, tag, destinationPort))
+            return false;
+
+        while (mNextSendTTL <= mLastTTL
+               && hop(mNextSendTTL).sent >= hop(mNextSendTTL).target
+               && !hop(mNextSendTTL).resend)
+            ++mNextSendTTL;
+
+        ttl = t;
+        return true;
+    }
+    return false;
+}
+
+bool TraceState::claimProbe(int ttl, qint64 nowNs, quint16& tag, quint16& destinationPort)
+{
+    Hop& h = hop(ttl);
+
+    //a resend takes the slot of the probe it replaces, so the hop's results stay in order
+    int index = h.sent;
+    if (h.resend) {
+        index = 0;
+        while (h.tags[index] || h.probes[index].ttl)
+            ++index;
+    }
+
+    quint16 next = mOptions.destinationPort + mOptions.tagOffset + ++mSeq;
+    InFlightProbe probe;
+    probe.id = probeId(next);
+    probe.owner = this;
+    probe.ttl = ttl;
+    probe.index = index;
+    probe.sentNs = nowNs;
+    probe.txNs = probeClockNs();
+    if (!mInFlight->insert(probe, nowNs + timeoutFor(ttl)))
+        return false;
+
+    h.tags[index] = next;
+    if (index == h.sent)
+        ++h.sent;
+    else
+        --h.resend;
+    h.lastSentNs = nowNs;
+    ++h.outstanding;
+    ++mOutstanding;
+
+    //the n-th probe of every hop rides the same flow, so a hop's flows pick up where the last hop's left off
+    tag = next;
+    destinationPort = next;
+    if (mOptions.multipath)
+        destinationPort = mOptions.destinationPort + index;
+    else if (mOptions.paris)
+        destinationPort = mOptions.destinationPort;
+    return true;
+}
+
+void TraceState::reopen(int ttl)
+{
+    if (ttl >= mSplitTTL)
+        mNextSendTTL = qMin(mNextSendTTL, ttl);
+}
+
+void TraceState::complete(const InFlightProbe& probe, const HopProbe& result)
+{
+    Hop& h = hop(probe.ttl);
+    --h.outstanding;
+    ++h.done;
+    --mOutstanding;
+    h.probes[probe.index] = result;
+}
+
+void TraceState::stampProbe(quint16 tag, qint64 txNs)
+{
+    InFlightProbe* probe = mInFlight->find(probeId(tag));
+    if (probe && probe->owner == this)
+        probe->txNs = txNs;
+}
+
+bool TraceState::handleReply(const ProbeReply& reply, qint64 nowNs)
+{
+    if (reply.destination != mDestination || reply.sourcePort != mSourcePort)
+        return false;
+
+    //paris probes all go to one port, a reply to any other isn't ours
+    if (mOptions.paris && !mOptions.multipath && reply.destinationPort != mOptions.destinationPort)
+        return false;
+
+    quint64 id = probeId(probeTag(reply, mOptions.paris));
+    const InFlightProbe* found = mInFlight->find(id);
+    if (!found || found->owner != this)
+        return false;
+
+    InFlightProbe probe;
+    mInFlight->take(id, &probe);
+
+    HopProbe result;
+    result.ttl = probe.ttl;
+    result.address = reply.from;
+    if (reply.timestampNs && reply.timestampNs >= probe.txNs)
+        result.rttNs = reply.timestampNs - probe.txNs;
+    else
+        result.rttNs = nowNs - probe.sentNs;
+    result.icmpType = reply.icmpType;
+    result.icmpCode = reply.icmpCode;
+    result.recvTTL = reply.recvTTL;
+    complete(probe, result);
+
+    if (mOptions.adaptiveTimeout) {
+        hop(probe.ttl).rtt.addSample(result.rttNs);
+        mRtt.addSample(result.rttNs);
+    }
+
+    //a new interface means more flows before we can rule out yet another one
+    if (mOptions.multipath) {
+        Hop& h = hop(probe.ttl);
+        if (!h.interfaces.contains(reply.from)) {
+            h.interfaces.append(reply.from);
+            int target = qMin(mOptions.maxProbesPerHop,
+                              multipathProbes(h.interfaces.size(), mOptions.multipathConfidence));
+            if (target > h.target) {
+                //every slot up to the target exists, takeResult and the resend scan walk them
+                h.target = target;
+                h.probes.resize(target);
+                h.tags.resize(target);
+                reopen(probe.ttl);
+            }
+        }
+    }
+
+    if (mOptions.rateLimitRetries > 0) {
+        Hop& h = hop(probe.ttl);
+        if (!h.responder)
+            h.responder = reply.from;
+        h.spacingNs = ResponderPacer::global().answered(reply.from);
+    }
+
+    //the destination answered, nothing past this ttl is interesting anymore
+    if (reply.icmpType == ICMP_UNREACH
+        && reply.icmpCode == ICMP_UNREACH_PORT
+        && probe.ttl < mLastTTL) {
+        int lastTTL = mLastTTL;
+        mLastTTL = probe.ttl;
+        dropOutstanding(mLastTTL + 1, lastTTL);
+    }
+
+    if (mOptions.adaptiveTimeout)
+        rearmOutstanding();
+    advanceBackward();
+    return true;
+}
+
+qint64 TraceState::timeoutFor(int ttl) const
+{
+    if (!mOptions.adaptiveTimeout)
+        return mTimeoutNs;
+
+    //until something has answered we have nothing to go on
+    const RttEstimator& estimate = hop(ttl).rtt.hasSample() ? hop(ttl).rtt : mRtt;
+    if (!estimate.hasSample())
+        return mTimeoutNs;
+    return qBound(mMinTimeoutNs, estimate.timeoutNs(), mTimeoutNs);
+}
+
+void TraceState::rearmOutstanding()
+{
+    int left = mOutstanding;
+    for (int ttl = mNextEmitTTL; ttl <= mLastTTL && left > 0; ++ttl) {
+        const Hop& h = hop(ttl);
+        if (!h.outstanding)
+            continue;
+        left -= h.outstanding;
+
+        qint64 timeout = timeoutFor(ttl);
+        for (int i = 0; i < h.sent; ++i) {
+            if (h.probes[i].ttl != 0)
+                continue;
+            quint64 id = probeId(h.tags[i]);
+            const InFlightProbe* probe = mInFlight->find(id);
+            if (probe)
+                mInFlight->reschedule(id, probe->sentNs + timeout);
+        }
+    }
+}
+
+void TraceState::dropOutstanding(int fromTTL, int toTTL)
+{
+    for (int ttl = qMax(fromTTL, mOptions.startTTL); ttl <= toTTL && mOutstanding; ++ttl) {
+        Hop& h = hop(ttl);
+        for (int i = 0; i < h.sent && h.outstanding; ++i) {
+            //ttl is only filled in once the probe is done
+            if (h.probes[i].ttl == 0 && mInFlight->take(probeId(h.tags[i]))) {
+                --h.outstanding;
+                --mOutstanding;
+            }
+        }
+    }
+}
+
+void TraceState::timeOut(const InFlightProbe& probe)
+{
+    //lost on a hop that otherwise answers, which is what a router's icmp rate limit looks like
+    Hop& h = hop(probe.ttl);
+    qint64 spacingNs;
+    if (h.responder
+        && h.retries < mOptions.rateLimitRetries
+        && ResponderPacer::global().lost(h.responder, spacingNs)) {
+        h.spacingNs = spacingNs;
+        h.tags[probe.index] = 0;
+        ++h.resend;
+        ++h.retries;
+        --h.outstanding;
+        --mOutstanding;
+        reopen(probe.ttl);
+        return;
+    }
+
+    HopProbe result;
+    result.ttl = probe.ttl;
+    result.timedOut = true;
+    complete(probe, result);
+    advanceBackward();
+}
+
+void TraceState::advanceBackward()
+{
+    if (mBackTTL < mOptions.startTTL)
+        return;
+
+    for (;;) {
+        //the destination is nearer than where we started
+        mBackTTL = qMin(mBackTTL, mLastTTL);
+        const Hop& h = hop(mBackTTL);
+        if (h.done < h.target)
+            return;
+
+        //first hop someone else already went through, the rest of the way back is theirs
+        QVector<HopProbe> nearSide;
+        for (const HopProbe& probe : h.probes) {
+            if (probe.timedOut || !mStopSet->nearSide(mBackTTL, probe.address, nearSide))
+                continue;
+            for (int i = 0; i < nearSide.size(); ++i) {
+                Hop& known = hop(mOptions.startTTL + i);
+                for (HopProbe& copy : known.probes) {
+                    copy = nearSide[i];
+                    copy.shared = true;
+                }
+                known.target = known.sent = known.done = known.probes.size();
+            }
+            finishBackward();
+            return;
+        }
+
+        if (mBackTTL == mOptions.startTTL)
+            break;
+        --mBackTTL;
+    }
+    finishBackward();
+}
+
+void TraceState::finishBackward()
+{
+    mBackTTL = mOptions.startTTL - 1;
+
+    //whoever comes later can stop at any of our near side's hops
+    QVector<HopProbe> path;
+    for (int ttl = mOptions.startTTL; ttl <= qMin(mSplitTTL, mLastTTL); ++ttl) {
+        const Hop& h = hop(ttl);
+        const HopProbe* answer = &h.probes[0];
+        for (const HopProbe& probe : h.probes) {
+            if (!probe.timedOut) {
+                answer = &probe;
+                break;
+            }
+        }
+        path.append(*answer);
+    }
+    mStopSet->learn(mOptions.startTTL, path);
+}
+
+void TraceState::expireAll(InFlightTable& inFlight, qint64 nowNs)
+{
+    for (const InFlightProbe& probe : inFlight.expire(nowNs))
+        probe.owner->timeOut(probe);
+}
+
+bool TraceState::takeResult(HopProbe& result)
+{
+    while (mNextEmitTTL <= mLastTTL) {
+        const Hop& h = hop(mNextEmitTTL);
+        if (mNextEmitIndex < h.target) {
+            //ttl is only filled in once the probe is done
+            if (h.probes[mNextEmitIndex].ttl == 0)
+                return false;
+            result = h.probes[mNextEmitIndex++];
+            return true;
+        }
+        checkNullHop(h);
+        ++mNextEmitTTL;
+        mNextEmitIndex = 0;
+    }
+    return false;
+}
+
+void TraceState::checkNullHop(const Hop& h)
+{
+    bool silent = true;
+    for (const HopProbe& probe : h.probes)
+        silent = silent && probe.timedOut;
+    mNullHops = silent ? mNullHops + 1 : 0;
+
+    //probably a firewall, everything past here would just time out as well
+    if (mOptions.maxConsecutiveNullHops > 0
+        && mNullHops >= mOptions.maxConsecutiveNullHops
+        && mNextEmitTTL < mLastTTL) {
+        int lastTTL = mLastTTL;
+        mLastTTL = mNextEmitTTL;
+        dropOutstanding(mLastTTL + 1, lastTTL);
+    }
+}
+
+int TraceState::tagsPerTrace(const TraceOptions& options)
+{
+    int probes = qMax(1, options.numProbesPerHop);
+    if (options.multipath)
+        probes = qMax(probes, options.maxProbesPerHop);
+    return (options.maxTTL - options.startTTL + 1) * (probes + qMax(0, options.rateLimitRetries));
+}
+
+int TraceState::multipathProbes(int interfaces, int confidence)
+{
+    //with k+1 equally likely next hops, n probes all miss one of them with probability
+    // at most (k+1) * (k/(k+1))^n. the smallest n that brings that under 1 - confidence
+    double alpha = 1.0 - qBound(1, confidence, 99) / 100.0;
+    int k = qMax(1, interfaces);
+    return (int) std::ceil(std::log(alpha / (k + 1)) / std::log(double(k) / (k + 1)));
+}
+
+bool TraceState::isFinished() const
+{
+    return mNextEmitTTL > mLastTTL;
+}
+
+void RttEstimator::addSample(qint64 rttNs)
+{
+    if (!hasSample()) {
+        mSrttNs = rttNs;
+        mRttVarNs = rttNs / 2;
+        return;
+    }
+    //beta 1/4, alpha 1/8
+    mRttVarNs += (qAbs(mSrttNs - rttNs) - mRttVarNs) / 4;
+    mSrttNs += (rttNs - mSrttNs) / 8;
+}
+
+ProbeResult toProbeResult(const HopProbe& probe, int index)
+{
+    ProbeResult result;
+    result.index = index;
+    result.ttl = probe.ttl;
+    if (probe.shared)
+        result.flags |= ProbeResult::Shared;
+    if (probe.timedOut) {
+        result.flags |= ProbeResult::TimedOut;
+    } else {
+        result.address = probe.address;
+        result.rttUs = probe.rttNs / 1000;
+        result.icmpType = probe.icmpType;
+        result.icmpCode = probe.icmpCode;
+        result.recvTTL = probe.recvTTL;
+    }
+    return result;
+}
@@ -0,0 +1,191 @@
+#ifndef TRACESTATE_H
+#define TRACESTATE_H
+
+#include "iphlpr.h"
+#include "probe.h"
+#include "inflight.h"
+
+#include <QScopedPointer>
+#include <QVector>
+
+struct TraceOptions
+{
+    //where replies are read from. the icmp socket sees every icmp message on the box,
+    // the error queue only the errors for our own udp socket and needs no privileges
+    enum ReceiveBackend { IcmpSocket, ErrorQueue };
+
+    QString destinationHostname;
+    quint32 destinationAddress = 0;                 //host order, what destinationHostname resolved to, see HostResolver
+    int destinationPort;
+    int tagOffset = 0;                              //tags start past destinationPort + tagOffset, the flow stays where it is
+    int startTTL;
+    int maxTTL;
+    int timeoutPerHopMS;
+    int totalTimeout;
+    int numProbesPerHop;
+    int maxOutstanding = MAX_OUTSTANDING_PINGS;     //probes in flight across all ttls, 1 is the old hop-by-hop trace
+    int queuePerTTL = MAX_QUEUE_PER_TTL;            //probes in flight for any one ttl
+    int sendBatch = PACKET_SEND_BATCHES;            //batches: probes a trace gets per pass, so none hogs the send batch
+    ReceiveBackend receiveBackend = ErrorQueue;     //works unprivileged, IcmpSocket takes CAP_NET_RAW
+    bool adaptiveTimeout = true;                    //timeoutPerHopMS becomes the ceiling
+    int minTimeoutMS = MIN_HOP_TIMEOUT;
+    int maxConsecutiveNullHops = MAX_CONSECUTIVE_NULL_HOPS; //<= 0 keeps going to maxTTL
+    int doubletreeTTL = 0;                          //with a StopSet: first ttl probed, 0 starts at startTTL as usual
+    int rateLimitRetries = MAX_RATE_LIMIT_RETRIES;  //see ResponderPacer, 0 leaves responders alone
+    bool paris = false;                             //one flow per trace, probes told apart by their udp checksum
+    bool multipath = false;                         //mda: enough flows per hop to find every interface, implies paris
+    int multipathConfidence = MDA_CONFIDENCE;       //percent
+    int maxProbesPerHop = MDA_MAX_PROBES_PER_HOP;   //multipath only
+    bool continuous = false;                        //keep probing the path, a cycle at a time, until stopped
+    int cycleIntervalMS = CONTINUOUS_CYCLE_INTERVAL;
+    int cycles = 0;                                 //continuous traces stop after this many, 0 runs until stopped
+};
+
+//smoothed rtt and rtt variance as tcp keeps them (rfc 6298), the timeout is srtt + 4 * rttvar
+class RttEstimator
+{
+public:
+    bool hasSample() const { return mSrttNs >= 0; }
+    void addSample(qint64 rttNs);
+    qint64 timeoutNs() const { return mSrttNs + qMax<qint64>(1000000, 4 * mRttVarNs); }
+
+private:
+    qint64 mSrttNs = -1;
+    qint64 mRttVarNs = 0;
+};
+
+//one probe's outcome, address is 0 when it timed out
+struct HopProbe
+{
+    int ttl = 0;
+    quint32 address = 0;
+    qint64 rttNs = 0;
+    quint8 icmpType = 0;
+    quint8 icmpCode = 0;
+    quint8 recvTTL = 0;         //left on the reply, 0 if the backend can't see it
+    bool timedOut = false;
+    bool shared = false;        //copied from another trace's near side
+};
+
+//what gets emitted for a finished probe, index is the trace within a batch
+ProbeResult toProbeResult(const HopProbe& probe, int index = 0);
+
+class StopSet;
+
+//bookkeeping for a single trace with several ttls probed at once.
+// the owner does the socket work, this decides what to send next,
+// matches replies back to their ttl by destination port and hands
+// finished probes back in ttl order. probes in flight live in an InFlightTable,
+// one per trace unless the owner shares one between all of its traces.
+// given a StopSet and a doubletreeTTL the trace probes outward from that ttl and
+// backward from it one hop at a time, until it reaches a hop the set already knows
+class TraceState
+{
+public:
+    TraceState(const TraceOptions& options, quint32 destination, quint16 sourcePort,
+               InFlightTable* inFlight = nullptr, StopSet* stopSet = nullptr);
+    ~TraceState();
+
+    quint32 destination() const { return mDestination; }
+    quint16 sourcePort() const { return mSourcePort; }
+
+    //claims the next probe to send, false if the window is full or there is nothing left.
+    // tag is what its reply is matched on: the destination port, or for paris probes the
+    // checksum to send it with (fillParisProbe). multipath probes go to a port per flow
+    bool nextProbe(qint64 nowNs, int& ttl, quint16& tag, quint16& destinationPort);
+    //when nextProbe has something next: nowNs if right away, later if the only probes left
+    // go to a responder we're spacing out, -1 if the window is full or there is nothing left
+    qint64 nextSendNs(qint64 nowNs) const;
+
+    //replaces the send time taken in nextProbe with the kernel's transmit timestamp
+    void stampProbe(quint16 tag, qint64 txNs);
+
+    //true if the reply belonged to one of our outstanding probes. the rtt comes from the
+    // kernel timestamps when the reply has one, otherwise from nowNs
+    bool handleReply(const ProbeReply& reply, qint64 nowNs);
+    //times out whatever is due in the table, for every trace sharing it
+    void expire(qint64 nowNs) { expireAll(*mInFlight, nowNs); }
+    static void expireAll(InFlightTable& inFlight, qint64 nowNs);
+
+    //earliest time an outstanding probe times out, -1 if nothing is out. with a shared
+    // table that's across all of its traces
+    qint64 nextDeadline() const { return mInFlight->nextDeadline(); }
+
+    //pops the next finished probe in ttl order
+    bool takeResult(HopProbe& result);
+    bool isFinished() const;
+    //the destination's ttl once it answered, else where the trace gave up
+    int lastTTL() const { return mLastTTL; }
+
+    //tags a trace goes through, each trace of a batch gets a block of this many
+    static int tagsPerTrace(const TraceOptions& options);
+    //mda's stopping rule: probes a hop needs before we can say, with confidence percent,
+    // that the interfaces we've seen are all of them
+    static int multipathProbes(int interfaces, int confidence);
+
+private:
+    Q_DISABLE_COPY(TraceState)
+
+    struct Hop
+    {
+        QVector<HopProbe> probes;
+        QVector<quint16> tags;      //destination port each probe went to, its checksum if paris
+        RttEstimator rtt;
+        int sent = 0;
+        int outstanding = 0;
+        int done = 0;
+        quint32 responder = 0;      //whoever answered it first
+        qint64 spacingNs = 0;       //between probes, while the responder looks rate limited
+        qint64 lastSentNs = 0;
+        int target = 0;             //probes it gets and slots in probes/tags, multipath raises it as interfaces turn up
+        int resend = 0;             //lost probes waiting to go out again, their tag is 0
+        int retries = 0;
+        QVector<quint32> interfaces;    //multipath only, every address that answered
+    };
+
+    Hop& hop(int ttl) { return mHops[ttl - mOptions.startTTL]; }
+    const Hop& hop(int ttl) const { return mHops[ttl - mOptions.startTTL]; }
+    quint64 probeId(quint16 tag) const { return InFlightTable::probeId(mDestination, mSourcePort, tag); }
+    void complete(const InFlightProbe& probe, const HopProbe& result);
+    void timeOut(const InFlightProbe& probe);
+    //how long a probe to ttl gets: the hop's own estimate, else the trace's, within the floor and ceiling
+    qint64 timeoutFor(int ttl) const;
+    //pulls in (or pushes out) the deadlines of what's in flight after the estimate moved
+    void rearmOutstanding();
+    //a run of silent hops long enough ends the trace there
+    void checkNullHop(const Hop& h);
+    //when the hop can take its next probe, -1 if it has nothing to send or its queue is full
+    qint64 sendableAt(const Hop& h, qint64 nowNs) const;
+    bool claimProbe(int ttl, qint64 nowNs, quint16& tag, quint16& destinationPort);
+    //a ttl behind the outward cursor got more to send
+    void reopen(int ttl);
+    //moves the backward phase along once the hop it waits on is done
+    void advanceBackward();
+    void finishBackward();
+    //forgets the probes still out for every ttl from fromTTL on
+    void dropOutstanding(int fromTTL, int toTTL);
+
+    TraceOptions mOptions;
+    quint32 mDestination;
+    quint16 mSourcePort;
+    quint16 mSeq = 0;
+    qint64 mTimeoutNs;
+    qint64 mMinTimeoutNs;
+    RttEstimator mRtt;
+    int mNullHops = 0;          //silent hops in a row, in ttl order
+
+    int mLastTTL;               //drops to the destination's ttl once it answers
+    int mNextSendTTL;           //lowest ttl that still has probes to send, going outward
+    int mSplitTTL;              //where outward probing started
+    int mBackTTL;               //hop the backward phase waits on, below startTTL once it's over
+    int mNextEmitTTL;           //next ttl handed back through takeResult
+    int mNextEmitIndex = 0;
+
+    QVector<Hop> mHops;
+    int mOutstanding = 0;
+    InFlightTable* mInFlight;
+    QScopedPointer<InFlightTable> mOwnInFlight;
+    StopSet* mStopSet;
+};
+
+#endif // TRACESTATE_H
@@ -1,14 +1,25 @@
 #include "unixiphlpr.h"
+#include "dnscache.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "probe.h"
+#include "probeio.h"
+#include "pingsweep.h"
+#include "tracesched.h"
+#include "tracearchive.h"
+#include "resultring.h"
 
-#include <QHostInfo>
+#include <QCoreApplication>
 #include <QDebug>
 #include <QThread>
+#include <QMetaMethod>
+#include <QPointer>
+#include <QTimer>
 
 #include <netinet/in.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/udp.h>
 #include <unistd.h>
-#include <poll.h>
 #include <arpa/inet.h>
 
 const char *
@@ -28,315 +39,1084 @@ icmp_type(u_char t)
     return(ttab[t]);
 }
 
-/*
- * Checksum routine for Internet Protocol family headers (C Version)
- */
-static u_short
-in_cksum(u_short *addr, int len)
-{
-    int nleft = len;
-    u_short *w = addr;
-    u_short answer;
-    int sum = 0;
-    
-    /*
-     *  Our algorithm is simple, using a 32 bit accumulator (sum),
-     *  we add sequential 16 bit words to it, and at the end, fold
-     *  back all the carry bits from the top 16 bits into the lower
-     *  16 bits.
-     */
-    while (nleft > 1)  {
-        sum += *w++;
-        nleft -= 2;
-    }
-    
-    /* mop up an odd byte, if necessary */
-    if (nleft == 1)
-        sum += *(u_char *)w;
-    
-    /*
-     * add back carry outs from top 16 bits to low 16 bits
-     */
-    sum = (sum >> 16) + (sum & 0xffff);	/* add hi 16 to low 16 */
-    sum += (sum >> 16);			/* add carry */
-    answer = ~sum;				/* truncate to 16 bits */
-    return (answer);
-}
-
 IpHelperObject* IpHelperObject::Create(QObject* parent) {
     return new UnixIpHelper(parent);
 }
 
 UnixIpHelper::UnixIpHelper(QObject *parent)
 : IpHelperObject{parent}
-, m_traceWorker{nullptr}
-, m_traceThread{nullptr}
+, m_drainTimer{new QTimer(this)}
+{
+    connect(m_drainTimer, &QTimer::timeout, this, &UnixIpHelper::drainResults);
+    connect(&ReverseLookupCache::global(), &ReverseLookupCache::resolved, this, &UnixIpHelper::hostResolved);
+}
+
+UnixIpHelper::~UnixIpHelper()
+{
+    // nobody is left to hear how they end
+    cancelAsync(true);
+    for (Session* session : m_sessions) {
+        releaseSession(session);
+        delete session;
+    }
+}
+
+IpSession* UnixIpHelper::session(int handle) const
 {
-    m_hopList.reserve(m_nMaxHops);
+    Session* session = m_sessions.value(handle);
+    return session ? session->object : nullptr;
+}
+
+bool UnixIpHelper::isRunning()
+{
+    return !m_sessions.isEmpty();
 }
 
 int UnixIpHelper::cancelAsync(bool bWait)
 {
-    if (m_traceWorker) {
-        m_traceWorker->stop();
+    const QList<int> handles = m_sessions.keys();
+    for (int handle : handles)
+        cancelSession(handle, bWait);
+    return 0;
+}
+
+int UnixIpHelper::cancelSession(int handle, bool bWait)
+{
+    Session* session = m_sessions.value(handle);
+    if (!session)
+        return -1;
+    session->canceled = true;
+    
+    // the probing is over, only lookups hold the final back. it goes without them
+    if (session->afterLookups) {
+        lookupsDone(session);
+        return 0;
     }
     
-    if (m_traceThread) {
-        m_traceThread->quit();
-        m_traceThread->wait();
+    // nothing runs while names resolve, the lookups are dropped when they come back.
+    // the finals go out now, as startTrace and startBatch would send them once canceled
+    if (session->resolving) {
+        QVariantMap final{{"session", handle}, {"canceled", true}};
+        if (session->kind == Session::Trace) {
+            final["destination"] = session->targets.first();
+            emit traceFinal(final);
+            emit session->object->traceFinal(final);
+        } else if (session->kind == Session::Batch) {
+            final["count"] = session->targets.size();
+            emit batchFinal(final);
+        } else {
+            final["count"] = session->targets.size();
+        }
+        finishSession(session, final);
+        return 0;
+    }
+    
+    // a worker blocked on a full ring would never see the stop
+    if (session->ring)
+        session->ring->close();
+    
+    // the session finishes once its worker says it's done, as if it had ended on its own
+    if (session->worker) {
+        session->worker->stop();
+        if (bWait)
+            session->worker->waitIdle();
     }
+    if (session->scheduler)
+        session->scheduler->stop();
+    if (session->sweeper)
+        session->sweeper->stop();
+    if (session->thread && bWait)
+        session->thread->wait();
+    return 0;
 }
 
-void TraceWorker::process()
+UnixIpHelper::Session* UnixIpHelper::createSession(Session::Kind kind, const QStringList& targets, const QVariantMap& mapOptions)
 {
-    mDNSLookupId = QHostInfo::lookupHost(mOptions.destinationHostname, this, &TraceWorker::trace);
+    Session* session = new Session;
+    session->kind = kind;
+    session->handle = m_nextHandle++;
+    session->object = new IpSession(session->handle, this);
+    session->targets = targets;
+    session->options = mapOptions;
+    session->lookups = kind != Session::Ping && mapOptions.value("lookup", true).toBool();
+    session->waitForLookups = mapOptions.value("flags", TRACE_FLAGS_DEFAULT).toInt() & TRACE_FLAGS_WAITFORLOOKUP;
+    m_sessions.insert(session->handle, session);
+    return session;
 }
 
-void TraceWorker::stop()
+void UnixIpHelper::finishSession(Session* session, const QVariantMap& final)
 {
-    qDebug() << "begin stop";
-    mShouldStop = true;
+    drainSession(session);
+    m_sessions.remove(session->handle);
+    releaseSession(session);
     
-    if (mDNSLookupId) {
-        QHostInfo::abortHostLookup(mDNSLookupId);
-        mDNSLookupId = 0;
-    }
+    // the timer picks up whatever is below the watermark, for as long as there is a ring
+    bool draining = false;
+    for (const Session* s : m_sessions)
+        draining |= s->ring != nullptr;
+    if (!draining)
+        m_drainTimer->stop();
     
-    if (mRcvsock != -1)
-        close(mRcvsock);
-    if (mSndsock != -1)
-        close(mSndsock);
-    qDebug() << "endstop";
+    // gone from the helper before anyone hears of it, a slot that cancels everything won't find it
+    IpSession* object = session->object;
+    delete session;
+    emit object->finished(final);
+    object->deleteLater();
 }
 
-void TraceWorker::trace(const QHostInfo& hostInfo)
+void UnixIpHelper::releaseSession(Session* session)
 {
-    
-    if (hostInfo.error() != QHostInfo::NoError) {
-        emit error();
-        return;
+    // back to the pool, its next trace may be for someone else
+    if (session->worker) {
+        session->worker->disconnect(this);
+        TraceWorkerPool::global().release(session->worker);
+        session->worker = nullptr;
     }
     
-    // TODO: what if the ip is v6?
-    auto destinationAddress = hostInfo.addresses().first();
+    delete session->thread;
+    session->thread = nullptr;
+    delete session->scheduler;
+    session->scheduler = nullptr;
+    delete session->sweeper;
+    session->sweeper = nullptr;
     
-    qDebug() << "Begin trace for " << destinationAddress.toString();
+    delete session->ring;
+    session->ring = nullptr;
+    closeArchive(session->archive);
+}
+
+TraceWorkerPool::TraceWorkerPool(QObject* parent)
+: QObject(parent)
+{
+}
+
+TraceWorkerPool::~TraceWorkerPool()
+{
+    // anything still tracing is stopped, the application is going away
+    for (TraceWorker* worker : mWorkers) {
+        worker->stop();
+        retire(worker);
+    }
+}
+
+TraceWorkerPool& TraceWorkerPool::global()
+{
+    static QPointer<TraceWorkerPool> pool;
+    if (!pool)
+        pool = new TraceWorkerPool(QCoreApplication::instance());
+    return *pool;
+}
+
+TraceWorker* TraceWorkerPool::acquire()
+{
+    if (!mIdle.isEmpty())
+        return mIdle.takeLast();
     
-    // create a raw icmp socket
-    mRcvsock = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
-    if (mRcvsock < 0) {
-        emit error();
+    // its event loop is where the traces get posted to, it sits in there between them
+    QThread* thread = new QThread();
+    thread->setObjectName("Trace thread");
+    TraceWorker* worker = new TraceWorker();
+    worker->moveToThread(thread);
+    thread->start();
+    mWorkers.append(worker);
+    return worker;
+}
+
+void TraceWorkerPool::release(TraceWorker* worker)
+{
+    if (mIdle.size() < TRACE_WORKERS_IDLE) {
+        mIdle.append(worker);
         return;
     }
+    mWorkers.removeOne(worker);
+    retire(worker);
+}
+
+void TraceWorkerPool::retire(TraceWorker* worker)
+{
+    QThread* thread = worker->thread();
+    thread->quit();
+    thread->wait();
+    delete worker;
+    delete thread;
+}
+
+void TraceWorker::start(const TraceOptions& options, ResultRing* results)
+{
+    {
+        QMutexLocker locker(&mBusyLock);
+        mBusy = true;
+    }
+    mOptions = options;
+    mResults = results;
+    mShouldStop = false;
+    mWakeup.clear();
     
-    mSndsock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (mSndsock < 0) {
-        emit error();
+    // posting it is what hands the fields above over to the worker's thread
+    QMetaObject::invokeMethod(this, "process", Qt::QueuedConnection);
+}
+
+bool TraceWorker::waitIdle(unsigned long timeoutMS)
+{
+    QMutexLocker locker(&mBusyLock);
+    while (mBusy) {
+        if (!mIdle.wait(&mBusyLock, timeoutMS))
+            return false;
+    }
+    return true;
+}
+
+void TraceWorker::finish()
+{
+    {
+        QMutexLocker locker(&mBusyLock);
+        mBusy = false;
+        mIdle.wakeAll();
+    }
+    emit finished();
+}
+
+void TraceWorker::process()
+{
+    if (mShouldStop) {
+        finish();
         return;
     }
+    trace();
+}
+
+void TraceWorker::stop()
+{
+    mShouldStop = true;
+    mWakeup.signal();
+}
+
+void TraceWorker::trace()
+{
+    QHostAddress destinationAddress(mOptions.destinationAddress);
     
-    sockaddr_in destsa;
-    memset(&destsa, 0, sizeof (destsa));
-    destsa.sin_family = AF_INET;
-    destsa.sin_addr.s_addr = htonl(destinationAddress.toIPv4Address());
-    int identity = getpid() & 0xffff;
-    int sport = identity | 0x8000;
+    qDebug() << "Begin trace for " << destinationAddress.toString();
     
-    sockaddr_in bindsa;
-    memset(&bindsa, 0, sizeof (bindsa));
-    bindsa.sin_family = AF_INET;
-    bindsa.sin_port = htons(sport);
-    if (bind(mSndsock, (sockaddr*) &bindsa, sizeof (bindsa)) < 0) {
-        emit error();
+    // replies off an icmp socket, unless we were asked for the error queue.
+    // without the privileges for one the transport falls back to the error queue as well
+    mTransport.reset(ProbeTransport::create());
+    mTransport->setWakeup(&mWakeup);
+    if (!mTransport->open(mOptions.receiveBackend == TraceOptions::IcmpSocket
+                          ? ProbeTransport::IcmpSocketOrErrorQueue : ProbeTransport::ErrorQueue,
+                          1024 * 1024)) {
+        mTransport.reset();
+        emit error("can't open the probe sockets");
+        finish();
         return;
     }
+    int sport = mTransport->sourcePort();
+    
+    // paris probes carry a checksum we work out, which takes the address the kernel sends from
+    mSourceAddress = mOptions.paris || mOptions.multipath ? mTransport->sourceAddressFor(destinationAddress.toIPv4Address()) : 0;
+    
+    // one sendmmsg takes as much of the window as it can, not a probe at a time
+    SendBatch sendBatch(qBound(1, mOptions.maxOutstanding, PROBE_IO_BATCH));
+    RecvBatch recvBatch;
     
-    short seq = 0;
+    // rtts come from kernel timestamps so they don't include our own wakeup latency
+    if (mTransport->hasTxTimestamps())
+        sendBatch.trackTxTimestamps(mOptions.maxOutstanding * 4);
     
-    for (int ttl = mOptions.startTTL; ttl <= mOptions.maxTTL && !mShouldStop; ++ttl) {
-        if (setsockopt(mSndsock, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl)) < 0) {
-            emit error();
-            return;
+    // a continuous trace probes the path again every cycle. each cycle gets its own block of
+    // tags, so a late reply can't pass for one of the next cycle's. only the tags move, a paris
+    // or multipath trace keeps its destination ports and with them the flows it measures
+    TraceOptions options = mOptions;
+    // as many blocks as fit below 65535, tags past it would wrap onto another cycle's
+    int tagBlock = qMax(1, TraceState::tagsPerTrace(mOptions));
+    int tagBlocks = qBound(1, (0xffff - mOptions.destinationPort) / tagBlock, CONTINUOUS_TAG_BLOCKS);
+    qint64 cycleNs = qint64(qMax(1, mOptions.cycleIntervalMS)) * 1000000;
+    
+    for (int cycle = 0; !mShouldStop; ++cycle) {
+        qint64 cycleStart = mTransport->clockNs();
+        options.tagOffset = (cycle % tagBlocks) * tagBlock;
+        TraceState state(options, destinationAddress.toIPv4Address(), sport);
+        if (!runCycle(state, sendBatch, recvBatch, cycle))
+            break;
+        emit cycleDone(cycle);
+        
+        if (!mOptions.continuous || (mOptions.cycles > 0 && cycle + 1 >= mOptions.cycles))
+            break;
+        
+        // the next cycle goes a hop past where this one ended, a path that grows is followed a hop at a time
+        options.maxTTL = qMin(mOptions.maxTTL, state.lastTTL() + 1);
+        
+        // stop() signals the wakeup, which cuts the nap short
+        qint64 left;
+        while (!mShouldStop && (left = cycleStart + cycleNs - mTransport->clockNs()) > 0)
+            mTransport->sleepMs((left + 999999) / 1000000);
+    }
+    
+    // the transport goes with the trace, the thread stays for the next one
+    mTransport.reset();
+    finish();
+}
+
+bool TraceWorker::runCycle(TraceState& state, SendBatch& sendBatch, RecvBatch& recvBatch, int cycle)
+{
+    char probe[64] = {0};
+    while (!mShouldStop && !state.isFinished()) {
+        // fill the window, a batch at a time so replies don't sit in the socket for long.
+        // every probe needs a token from the process-wide budget, whatever we don't use goes back
+        int ttl;
+        quint16 tag;
+        quint16 dport;
+        int tokens = TokenBucket::global().take(sendBatch.capacity() - sendBatch.size());
+        while (tokens > 0 && state.nextProbe(mTransport->clockNs(), ttl, tag, dport)) {
+            probeDebug() << "send probe ttl:"  << ttl << "sport:" << state.sourcePort() << "dport:" << dport << "tag:" << tag;
+            if (mSourceAddress)
+                fillParisProbe(probe, sizeof (probe), mSourceAddress, state.destination(), state.sourcePort(), dport, tag);
+            sendBatch.add(state.destination(), dport, ttl, probe, sizeof (probe), tag);
+            --tokens;
         }
+        TokenBucket::global().giveBack(tokens);
+        if (!sendBatch.isEmpty()) {
+            qint64 syscallStart = EngineMetrics::clockNs();
+            int sent = mTransport->send(sendBatch);
+            EngineMetrics::record(EngineMetrics::SyscallNs, EngineMetrics::clockNs() - syscallStart);
+            EngineMetrics::add(EngineMetrics::ProbesSent, qMax(0, sent));
+        }
+        
+        // sleep until the next probe may go out or the oldest one expires, whichever is first
+        qint64 now = mTransport->clockNs();
+        qint64 wake = state.nextDeadline();
+        qint64 sendAt = sendBatch.isEmpty() ? state.nextSendNs(now) : -1;
+        if (sendAt >= 0) {
+            sendAt = qMax(sendAt, now + TokenBucket::global().waitNs());
+            if (wake < 0 || sendAt < wake)
+                wake = sendAt;
+        }
+        int timeoutMS = 0;
+        if (wake >= 0)
+            timeoutMS = qMax<qint64>(0, (wake - now + 999999) / 1000000);
+        
+        // a leftover batch means the send buffer was full, wake up once it drains.
+        // stop() signals the wakeup, there's no need to look at the flag any sooner
+        int ready = mTransport->wait(timeoutMS, !sendBatch.isEmpty());
+        if (ready < 0) {
+            if (!mShouldStop)
+                emit error("waiting on the probe sockets failed: " + qt_error_string());
+            return false;
+        }
+        
+        qint64 wokeNs = EngineMetrics::clockNs();
+        if (ready & ProbeTransport::Errors)
+            drainErrorQueue(state, sendBatch, wokeNs);
+        
+        if ((ready & ProbeTransport::Replies) && !drainReplies(state, recvBatch, wokeNs)) {
+            if (!mShouldStop)
+                emit error("reading replies failed: " + qt_error_string());
+            return false;
+        }
+        
+        state.expire(mTransport->clockNs());
+        emitResults(state, cycle);
+    }
+    return !mShouldStop;
+}
+
+void TraceWorker::drainErrorQueue(TraceState& state, SendBatch& sendBatch, qint64 wokeNs)
+{
+    // transmit timestamps come first for any probe, its icmp error can only follow
+    QueuedError queued[PROBE_IO_BATCH];
+    int count;
+    int received = 0, matched = 0, foreign = 0;
+    while (true) {
+        qint64 syscallStart = EngineMetrics::clockNs();
+        count = mTransport->readErrors(sendBatch, queued, PROBE_IO_BATCH);
+        qint64 parseStart = EngineMetrics::clockNs();
+        EngineMetrics::record(EngineMetrics::SyscallNs, parseStart - syscallStart);
+        if (count <= 0)
+            break;
+        EngineMetrics::record(EngineMetrics::WakeupToParseNs, parseStart - wokeNs);
         
-        for (int i = 0; i < mOptions.numProbesPerHop; ++i) {
-            // prepare probe
-            char probe[64] = {0};
-            destsa.sin_port = htons(mOptions.destinationPort + ++seq);
-            qDebug() << "send probe ttl:"  << ttl << "sport:" << sport << "dport:" << ntohs(destsa.sin_port);
-            auto bytesWritten = sendto(mSndsock, probe, sizeof (probe), 0, (sockaddr*) &destsa, sizeof(destsa));
-            if (bytesWritten < 0 || bytesWritten != sizeof (probe)) {
-                emit error();
-                return;
+        qint64 now = mTransport->clockNs();
+        for (int i = 0; i < count; ++i) {
+            if (!queued[i].isIcmp) {
+                state.stampProbe(queued[i].port, queued[i].timestampNs);
+                continue;
             }
+            ++received;
             
-            QElapsedTimer timer;
-            timer.start();
+            ProbeReply reply;
+            if (!probeReplyFromError(queued[i], state.sourcePort(), reply)) {
+                probeDebug() << "unrecognized icmp type" << icmp_type(queued[i].icmpType);
+                ++foreign;
+                continue;
+            }
             
-            while(true) {
-                if (timer.elapsed() >= mOptions.timeoutPerHopMS) {
-                    qDebug() << "timer expired for ttl:" << ttl;
-                    emit ping(ttl, "*", 0);
-                    break;
-                }
-                
-                
-                fd_set fdset;
-                FD_ZERO(&fdset);
-                FD_SET(mRcvsock, &fdset);
-                
-                timeval timeout;
-                int remainingTimeout = mOptions.timeoutPerHopMS - timer.elapsed();
-                timeout.tv_sec = remainingTimeout/1000;
-                timeout.tv_usec = (remainingTimeout - timeout.tv_sec * 1000) * 1000;
-                int nready = select(mRcvsock + 1, &fdset, NULL, NULL, &timeout);
-                
-                if (nready == -1 && nready == EINVAL) {
-                    emit error();
-                    return;
-                }
-                
-                if (nready == 0) {
-                    qDebug() << "select timeout ";
-                    continue;
-                }
-                
-                if (FD_ISSET(mRcvsock, &fdset)) {
-                    char ippacket[IP_MAXPACKET] = {0};
-                    sockaddr_in fromsa;
-                    memset(&fromsa, 0, sizeof(fromsa));
-                    socklen_t fromlen = sizeof(fromsa);
-                    int bytesRead = recvfrom(mRcvsock, ippacket, sizeof (ippacket), 0, (sockaddr*) &fromsa, &fromlen);
-                    if (bytesRead < 0) {
-                        if (errno == EBADF
-                            && mShouldStop) {
-                            break;
-                        }
-                        if (errno == EINTR) {
-                            qDebug() << "EINTR";
-                            continue;
-                        }
-                        else {
-                            emit error();
-                            break;
-                        }
-                    }
-                    
-                    ip* iphdr = (ip *) ippacket;
-                    int iphdrlen = iphdr->ip_hl << 2;
-                    
-                    icmp* icmphdr = (icmp*) ((char*)&ippacket[0] + iphdrlen);
-                    
-                    if (bytesRead - iphdrlen < ICMP_MINLEN)
-                        continue;
-                    
-                    if ((icmphdr->icmp_type == ICMP_TIMXCEED &&
-                         icmphdr->icmp_code == ICMP_TIMXCEED_INTRANS)
-                        || icmphdr->icmp_type == ICMP_UNREACH) {
-                        ip* innerIpHdr = (ip*) &icmphdr->icmp_ip;
-                        int innerIpHdrLen = innerIpHdr->ip_hl << 2;
-                        
-                        if (bytesRead - (innerIpHdr - iphdr) - innerIpHdrLen < 4)
-                            continue;
-                        
-                        udphdr* udp = (udphdr*) (((char*)innerIpHdr) + innerIpHdrLen);
-                        
-                        if (innerIpHdr->ip_p == IPPROTO_UDP
-                            && udp->uh_sport == htons(sport)
-                            && udp->uh_dport == destsa.sin_port) {
-                            qDebug() << ttl << "response from " << QHostAddress(ntohl(fromsa.sin_addr.s_addr)).toString();
-                            emit ping(ttl, inet_ntoa(fromsa.sin_addr), timer.elapsed());
-                            
-                            if (icmphdr->icmp_code == ICMP_UNREACH_PORT) {
-                                mShouldStop = true;
-                            }
-                            break;
-                        }
-                        
-                        continue;
-                        
-                    } else {
-                        qDebug() << "unrecognized icmp type" << icmp_type((uchar)icmphdr->icmp_type);
-                        continue;
-                    }
-                }
+            if (state.handleReply(reply, now)) {
+                probeDebug() << "response from " << QHostAddress(reply.from).toString() << "dport:" << reply.destinationPort;
+                ++matched;
             }
         }
     }
+    EngineMetrics::add(EngineMetrics::RepliesReceived, received);
+    EngineMetrics::add(EngineMetrics::RepliesMatched, matched);
+    EngineMetrics::add(EngineMetrics::ForeignIcmp, foreign);
+    EngineMetrics::add(EngineMetrics::UnmatchedReplies, received - matched - foreign);
+}
+
+bool TraceWorker::drainReplies(TraceState& state, RecvBatch& recvBatch, qint64 wokeNs)
+{
+    // drain everything that is queued, several ttls may have answered
+    int received;
+    int total = 0, matched = 0, foreign = 0;
+    do {
+        qint64 syscallStart = EngineMetrics::clockNs();
+        received = mTransport->receive(recvBatch);
+        qint64 parseStart = EngineMetrics::clockNs();
+        EngineMetrics::record(EngineMetrics::SyscallNs, parseStart - syscallStart);
+        if (received < 0)
+            return false;
+        if (received)
+            EngineMetrics::record(EngineMetrics::WakeupToParseNs, parseStart - wokeNs);
+        total += received;
+        
+        qint64 now = mTransport->clockNs();
+        for (int i = 0; i < received; ++i) {
+            const char* ippacket = recvBatch.data(i);
+            int bytesRead = recvBatch.length(i);
+            
+            ProbeReply reply;
+            if (!parseProbeReply(ippacket, bytesRead, recvBatch.from(i), reply)) {
+                int iphdrlen = (ippacket[0] & 0x0f) << 2;
+                if (bytesRead > iphdrlen)
+                    probeDebug() << "unrecognized icmp type" << icmp_type((uchar)ippacket[iphdrlen]);
+                ++foreign;
+                continue;
+            }
+            reply.timestampNs = recvBatch.timestamp(i);
+            
+            if (state.handleReply(reply, now)) {
+                probeDebug() << "response from " << QHostAddress(reply.from).toString() << "dport:" << reply.destinationPort;
+                ++matched;
+            }
+        }
+    } while (received == recvBatch.capacity());
     
-    
-    
-    close(mRcvsock);
-    close(mSndsock);
-    mRcvsock = mSndsock = -1;
-    
-    thread()->quit();
+    EngineMetrics::add(EngineMetrics::RepliesReceived, total);
+    EngineMetrics::add(EngineMetrics::RepliesMatched, matched);
+    EngineMetrics::add(EngineMetrics::ForeignIcmp, foreign);
+    EngineMetrics::add(EngineMetrics::UnmatchedReplies, total - matched - foreign);
+    return true;
 }
 
-int UnixIpHelper::asyncTrace(const QString& strAddress, const QVariantMap& mapOptions)
+void TraceWorker::emitResults(TraceState& state, int cycle)
 {
-    if (strAddress.isEmpty() || isRunning()) {
-        return -1;
+    HopProbe result;
+    int timeouts = 0;
+    while (state.takeResult(result)) {
+        if (result.timedOut) {
+            probeDebug() << "timer expired for ttl:" << result.ttl;
+            ++timeouts;
+        }
+        ProbeResult probeResult = toProbeResult(result);
+        probeResult.seq = cycle;
+        mResults->push(probeResult);
     }
+    EngineMetrics::add(EngineMetrics::Timeouts, timeouts);
     
-    m_traceThread = new QThread();
-    m_traceThread->setObjectName("Trace thread");
-    
+    if (mResults->needsWakeup())
+        emit resultsReady();
+}
+
+TraceOptions UnixIpHelper::traceOptions(const QString& strAddress, const QVariantMap& mapOptions) const
+{
     TraceOptions options;
     options.destinationHostname = strAddress;
     options.startTTL = 1;
     options.maxTTL = 64;
-    options.numProbesPerHop = 1;
+    options.numProbesPerHop = mapOptions.value("probesPerHop", 1).toInt();
     options.destinationPort = 33434;
-    options.timeoutPerHopMS = 3000;
-    m_traceWorker = new TraceWorker(options);
-    m_traceWorker->moveToThread(m_traceThread);
+    options.timeoutPerHopMS = mapOptions.value("timeout", 3000).toInt();
+    options.minTimeoutMS = mapOptions.value("minTimeout", MIN_HOP_TIMEOUT).toInt();
+    options.adaptiveTimeout = mapOptions.value("adaptiveTimeout", true).toBool();
+    options.maxConsecutiveNullHops = mapOptions.value("maxConsecutiveNullHops", m_maxConsecutiveNullHops).toInt();
+    options.doubletreeTTL = mapOptions.value("doubletree", DOUBLETREE_SPLIT_TTL).toInt();   //batches only, 0 probes every trace from the first hop
+    options.rateLimitRetries = mapOptions.value("rateLimitRetries", MAX_RATE_LIMIT_RETRIES).toInt();
+    options.maxOutstanding = mapOptions.value("maxOutstanding", m_maxOutstanding).toInt();
+    options.queuePerTTL = mapOptions.value("queuePerTTL", m_nQueuePerTTL).toInt();
+    options.sendBatch = mapOptions.value("sendBatch", PACKET_SEND_BATCHES).toInt();
+    if (mapOptions.value("receive").toString() == "icmp")
+        options.receiveBackend = TraceOptions::IcmpSocket;
+    options.paris = mapOptions.value("paris", false).toBool();
+    options.multipath = mapOptions.value("multipath", false).toBool();
+    options.multipathConfidence = mapOptions.value("multipathConfidence", MDA_CONFIDENCE).toInt();
+    options.maxProbesPerHop = mapOptions.value("maxProbesPerHop", MDA_MAX_PROBES_PER_HOP).toInt();
+    options.continuous = mapOptions.value("continuous", false).toBool();
+    options.cycleIntervalMS = mapOptions.value("cycleInterval", CONTINUOUS_CYCLE_INTERVAL).toInt();
+    options.cycles = mapOptions.value("cycles", 0).toInt();
+    return options;
+}
+
+int UnixIpHelper::asyncTrace(const QString& strAddress, const QVariantMap& mapOptions)
+{
+    if (strAddress.isEmpty()) {
+        return -1;
+    }
     
-    connect(m_traceThread, &QThread::started, m_traceWorker, &TraceWorker::process);
-    connect(m_traceWorker, &TraceWorker::error, m_traceThread, &QThread::quit);
-    connect(m_traceWorker, &TraceWorker::error, this, &UnixIpHelper::handleError);
-    connect(m_traceThread, &QThread::finished, this, &UnixIpHelper::traceWorkerFinished);
-    connect(m_traceWorker, &TraceWorker::ping, this, &UnixIpHelper::ping);
-    m_traceThread->start();
+    Session* session = createSession(Session::Trace, QStringList{strAddress}, mapOptions);
+    int handle = session->handle;
+    resolveTargets(session, [this](Session* session) { startTrace(session); });
+    return handle;
+}
+
+void UnixIpHelper::startTrace(Session* session)
+{
+    int handle = session->handle;
+    const HostResolver::Result& resolved = session->resolved.first();
+    if (!resolved.ok() || session->canceled) {
+        QVariantMap final{{"session", handle}, {"destination", session->targets.first()}};
+        resolved.toMap(final);
+        if (session->canceled)
+            final["canceled"] = true;
+        emit traceFinal(final);
+        emit session->object->traceFinal(final);
+        finishSession(session, final);
+        return;
+    }
     
-    m_bIsRunning = true;
+    session->archive = openArchive(session->options);
+    session->ring = createResultRing(session->options);
+    session->worker = TraceWorkerPool::global().acquire();
     
-    return 0;
+    connect(session->worker, &TraceWorker::error, this, [this, handle](const QString& message) { sessionError(handle, message); });
+    connect(session->worker, &TraceWorker::finished, this, [this, handle]() { traceWorkerFinished(handle); });
+    connect(session->worker, &TraceWorker::resultsReady, this, [this, handle]() { sessionResultsReady(handle); });
+    connect(session->worker, &TraceWorker::cycleDone, this, [this, handle](int cycle) { traceCycleDone(handle, cycle); });
+    TraceOptions options = traceOptions(session->targets.first(), session->options);
+    options.destinationAddress = resolved.address.toIPv4Address();
+    session->worker->start(options, session->ring);
+}
+
+bool UnixIpHelper::wantsResultMap() const
+{
+    static const QMetaMethod pingResultSignal = QMetaMethod::fromSignal(&IpHelperObject::pingResult);
+    return isSignalConnected(pingResultSignal);
+}
+
+void UnixIpHelper::ping(Session* session, ProbeResult& result)
+{
+    if (result.ttl >= session->hopStats.size())
+        session->hopStats.resize(result.ttl + 1);
+    session->hopStats[result.ttl].add(result, result.seq);
+    if (session->archive)
+        session->archive->addHop(0, ArchiveHop(result));
+    lookupHost(session, result.address);
+    
+    emit probeResult(result);
+    
+    if (wantsResultMap()) {
+        QVariantMap map;
+        result.toMap(map);
+        emit pingResult(map);
+    }
+}
+
+ResultRing* UnixIpHelper::createResultRing(const QVariantMap& mapOptions)
+{
+    QString overflow = mapOptions.value("overflow").toString();
+    ResultRing::Overflow policy = ResultRing::Block;
+    if (overflow == "dropOldest")
+        policy = ResultRing::DropOldest;
+    else if (overflow == "countDropped")
+        policy = ResultRing::CountDropped;
+    
+    // the timer picks up whatever is below the watermark
+    m_drainTimer->start(mapOptions.value("drainInterval", RESULT_DRAIN_INTERVAL).toInt());
+    
+    return new ResultRing(mapOptions.value("resultBuffer", RESULT_RING_SIZE).toInt(),
+                          policy,
+                          mapOptions.value("drainWatermark", RESULT_DRAIN_WATERMARK).toInt());
+}
+
+TraceArchiveWriter* UnixIpHelper::openArchive(const QVariantMap& mapOptions)
+{
+    QString fileName = mapOptions.value("archive").toString();
+    if (fileName.isEmpty())
+        return nullptr;
+    
+    TraceArchiveWriter* archive = new TraceArchiveWriter(mapOptions.value("archiveIndexInterval", ARCHIVE_INDEX_INTERVAL).toInt());
+    if (!archive->open(fileName)) {
+        qDebug() << "no archive" << fileName << archive->errorString();
+        delete archive;
+        return nullptr;
+    }
+    return archive;
+}
+
+void UnixIpHelper::closeArchive(TraceArchiveWriter*& archive)
+{
+    delete archive;     //closing writes the index and footer
+    archive = nullptr;
 }
 
-void UnixIpHelper::ping(int distance, QString address, int rtt)
+void UnixIpHelper::drainResults()
 {
-    QVariantMap map;
-    map["ttl"] = distance;
-    map["rtt"] = rtt;
-    map["address"] = address;
-    emit pingResult(map);
+    // a slot may cancel a session, which can end it there and then
+    const QList<int> handles = m_sessions.keys();
+    for (int handle : handles)
+        sessionResultsReady(handle);
 }
 
-void UnixIpHelper::handleError()
+void UnixIpHelper::sessionResultsReady(int handle)
 {
+    Session* session = m_sessions.value(handle);
+    if (session)
+        drainSession(session);
+}
+
+void UnixIpHelper::drainSession(Session* session)
+{
+    ResultRing* ring = session->ring;
+    if (!ring)
+        return;
+    
+    // a batch at a time so a busy worker can't keep us here forever
+    m_drained.resize(0);
+    if (!ring->drain(m_drained, ring->capacity()))
+        return;
+    
+    ResultHandler handler = &UnixIpHelper::ping;
+    if (session->kind == Session::Batch)
+        handler = &UnixIpHelper::batchPing;
+    else if (session->kind == Session::Ping)
+        handler = &UnixIpHelper::pingEcho;
+    
+    for (ProbeResult& result : m_drained) {
+        result.session = session->handle;
+        (this->*handler)(session, result);
+    }
+    emit probeResults(m_drained);
+    emit session->object->probeResults(m_drained);
+}
 
+void UnixIpHelper::sessionError(int handle, const QString& message)
+{
+    Session* session = m_sessions.value(handle);
+    if (!session)
+        return;
+    
+    qDebug() << "session" << handle << message;
+    if (session->error.isEmpty())
+        session->error = message;
 }
 
-void UnixIpHelper::traceWorkerFinished()
+void UnixIpHelper::traceCycleDone(int handle, int cycle)
 {
-    emit traceFinal(QVariantMap{{}});
+    Session* session = m_sessions.value(handle);
+    if (!session)
+        return;
     
-    disconnect();
+    // the hops this cycle got to, anything past them is from a longer path some cycles ago
+    drainSession(session);
+    for (const HopStats& stats : session->hopStats) {
+        if (stats.lastCycle() != cycle)
+            continue;
+        QVariantMap map;
+        stats.toMap(map);
+        map["session"] = handle;
+        QString host = session->hosts.value(stats.address());
+        if (!host.isEmpty())
+            map["host"] = host;
+        emit traceHop(map);
+        emit session->object->traceHop(map);
+    }
+    session->cycles = cycle + 1;
     
-    delete m_traceThread;
-    m_traceThread = nullptr;
+    // a record per cycle, a continuous trace is a run of them
+    if (session->archive) {
+        ArchiveTraceHeader header;
+        header.destination = session->resolved.first().address.toIPv4Address();
+        header.cycle = cycle;
+        header.name = session->targets.first().toUtf8();
+        session->archive->endTrace(0, header);
+    }
+}
+
+void UnixIpHelper::traceWorkerFinished(int handle)
+{
+    Session* session = m_sessions.value(handle);
+    if (!session)
+        return;
+    
+    // the last hops are in, their names may not be
+    drainSession(session);
+    waitForLookups(session, [this, handle]() { finishTrace(handle); });
+}
+
+void UnixIpHelper::finishTrace(int handle)
+{
+    Session* session = m_sessions.value(handle);
+    if (!session)
+        return;
     
-    delete m_traceWorker;
-    m_traceWorker = nullptr;
+    QVariantMap final;
+    final["session"] = handle;
+    final["destination"] = session->targets.first();
+    session->resolved.first().toMap(final);
+    final["cycles"] = session->cycles;
+    if (session->ring && session->ring->dropped())
+        final["dropped"] = session->ring->dropped();
+    if (session->canceled)
+        final["canceled"] = true;
+    if (!session->error.isEmpty())
+        final["error"] = session->error;
+    QVariantMap hosts;
+    for (auto it = session->hosts.constBegin(); it != session->hosts.constEnd(); ++it) {
+        if (!it.value().isEmpty())
+            hosts[QHostAddress(it.key()).toString()] = it.value();
+    }
+    final["hosts"] = hosts;
+    drainSession(session);
+    closeArchive(session->archive);
+    emit traceFinal(final);
+    emit session->object->traceFinal(final);
     
-    m_bIsRunning = false;
+    finishSession(session, final);
     qDebug() << "trace worker finished";
 }
 
+void UnixIpHelper::resolveTargets(Session* session, std::function<void(Session* session)> done)
+{
+    // literals and cached names need no lookup, but done still comes from the event loop:
+    // the caller hands out the handle first, a failed target can't end the session before that
+    session->resolving = true;
+    int handle = session->handle;
+    HostResolver::global().resolve(session->targets, this, [this, handle, done](const QVector<HostResolver::Result>& results) {
+        Session* session = m_sessions.value(handle);
+        if (!session)
+            return; // canceled
+        
+        session->resolving = false;
+        session->resolved = results;
+        for (int i = 0; i < results.size(); ++i) {
+            if (!results[i].ok())
+                continue;
+            session->addresses.append(results[i].address);
+            session->index.append(i);
+        }
+        done(session);
+    });
+}
+
+int UnixIpHelper::asyncTraceBatch(const QStringList& addresses, const QVariantMap& mapOptions)
+{
+    if (addresses.isEmpty()) {
+        return -1;
+    }
+    
+    Session* session = createSession(Session::Batch, addresses, mapOptions);
+    int handle = session->handle;
+    resolveTargets(session, [this, handle](Session* session) {
+        for (int i = 0; i < session->resolved.size(); ++i) {
+            if (session->resolved[i].ok())
+                continue;
+            QVariantMap map{{"session", handle}, {"trace", i}, {"destination", session->targets[i]}};
+            session->resolved[i].toMap(map);
+            emit traceFinal(map);
+            emit session->object->traceFinal(map);
+        }
+        startBatch(session);
+    });
+    
+    return handle;
+}
+
+void UnixIpHelper::startBatch(Session* session)
+{
+    int handle = session->handle;
+    if (session->addresses.isEmpty() || session->canceled) {
+        QVariantMap final{{"session", handle}, {"count", session->targets.size()}};
+        if (session->canceled)
+            final["canceled"] = true;
+        emit batchFinal(final);
+        finishSession(session, final);
+        return;
+    }
+    
+    session->thread = new QThread();
+    session->thread->setObjectName("Trace batch thread");
+    
+    int maxConcurrent = session->options.value("maxConcurrent", DEFAULT_BATCH_CONCURRENCY).toInt();
+    session->ring = createResultRing(session->options);
+    session->archive = openArchive(session->options);
+    session->scheduler = new TraceScheduler(traceOptions(QString(), session->options), session->addresses, maxConcurrent, session->ring);
+    session->scheduler->moveToThread(session->thread);
+    
+    connect(session->thread, &QThread::started, session->scheduler, &TraceScheduler::process);
+    connect(session->scheduler, &TraceScheduler::error, session->thread, &QThread::quit);
+    connect(session->scheduler, &TraceScheduler::error, this, [this, handle](const QString& message) { sessionError(handle, message); });
+    connect(session->thread, &QThread::finished, this, [this, handle]() { batchWorkerFinished(handle); });
+    connect(session->scheduler, &TraceScheduler::resultsReady, this, [this, handle]() { sessionResultsReady(handle); });
+    connect(session->scheduler, &TraceScheduler::traceDone, this, [this, handle](int trace) { batchTraceDone(handle, trace); });
+    session->thread->start();
+}
+
+void UnixIpHelper::batchPing(Session* session, ProbeResult& result)
+{
+    // the scheduler numbers the traces it was handed, callers know them by their index into the batch
+    result.index = session->index[result.index];
+    if (session->archive)
+        session->archive->addHop(result.index, ArchiveHop(result));
+    lookupHost(session, result.address);
+    emit probeResult(result);
+    
+    if (wantsResultMap()) {
+        QVariantMap map;
+        result.toMap(map);
+        map["trace"] = result.index;
+        map["destination"] = session->targets[result.index];
+        emit pingResult(map);
+    }
+}
+
+void UnixIpHelper::batchTraceDone(int handle, int trace)
+{
+    Session* session = m_sessions.value(handle);
+    if (!session)
+        return;
+    
+    // its last hops are still in the ring, they go out before the final
+    drainSession(session);
+    int i = session->index[trace];
+    if (session->archive) {
+        ArchiveTraceHeader header;
+        header.destination = session->addresses[trace].toIPv4Address();
+        header.name = session->targets[i].toUtf8();
+        session->archive->endTrace(i, header);
+    }
+    QVariantMap map{{"session", handle}, {"trace", i}, {"destination", session->targets[i]}};
+    session->resolved[i].toMap(map);
+    emit traceFinal(map);
+    emit session->object->traceFinal(map);
+}
+
+void UnixIpHelper::batchWorkerFinished(int handle)
+{
+    Session* session = m_sessions.value(handle);
+    if (!session)
+        return;
+    
+    // every traceFinal is out, the names of their hops come before batchFinal
+    drainSession(session);
+    waitForLookups(session, [this, handle]() { finishBatch(handle); });
+}
+
+void UnixIpHelper::finishBatch(int handle)
+{
+    Session* session = m_sessions.value(handle);
+    if (!session)
+        return;
+    
+    QVariantMap final{{"session", handle}, {"count", session->targets.size()}};
+    if (session->ring && session->ring->dropped())
+        final["dropped"] = session->ring->dropped();
+    if (session->canceled)
+        final["canceled"] = true;
+    if (!session->error.isEmpty())
+        final["error"] = session->error;
+    drainSession(session);
+    closeArchive(session->archive);
+    emit batchFinal(final);
+    
+    finishSession(session, final);
+    qDebug() << "trace batch finished";
+}
+
 int UnixIpHelper::asyncPing(const QString& strAddress, const QVariantMap& mapOptions)
 {
+    if (strAddress.isEmpty()) {
+        return -1;
+    }
+    return asyncPingBatch(QStringList{strAddress}, mapOptions);
+}
+
+int UnixIpHelper::asyncPingBatch(const QStringList& addresses, const QVariantMap& mapOptions)
+{
+    if (addresses.isEmpty()) {
+        return -1;
+    }
+    
+    PingOptions options;
+    options.count = mapOptions.value("count", DEFAULT_ICMP_COUNT).toInt();
+    options.size = mapOptions.value("size", DEFAULT_ICMP_SIZE).toInt();
+    options.timeoutMS = mapOptions.value("timeout", m_nTimeout).toInt();
+    options.intervalMS = mapOptions.value("interval", PACKET_INTERVAL).toInt();
+    options.rate = mapOptions.value("rate", DEFAULT_PING_RATE).toInt();
+    
+    Session* session = createSession(Session::Ping, addresses, mapOptions);
+    int handle = session->handle;
+    resolveTargets(session, [this, handle, options](Session* session) {
+        for (int i = 0; i < session->resolved.size(); ++i) {
+            if (session->resolved[i].ok())
+                continue;
+            QVariantMap map{{"session", handle}, {"target", i}, {"destination", session->targets[i]}};
+            session->resolved[i].toMap(map);
+            emit pingFinal(map);
+            emit session->object->pingFinal(map);
+        }
+        startPing(session, options);
+    });
+    
+    return handle;
+}
+
+void UnixIpHelper::startPing(Session* session, const PingOptions& options)
+{
+    int handle = session->handle;
+    if (session->addresses.isEmpty() || session->canceled) {
+        QVariantMap final{{"session", handle}, {"count", session->targets.size()}};
+        if (session->canceled)
+            final["canceled"] = true;
+        finishSession(session, final);
+        return;
+    }
+    
+    session->thread = new QThread();
+    session->thread->setObjectName("Ping thread");
+    
+    session->ring = createResultRing(session->options);
+    session->sweeper = new PingSweeper(options, session->addresses, session->ring);
+    session->sweeper->moveToThread(session->thread);
+    
+    connect(session->thread, &QThread::started, session->sweeper, &PingSweeper::process);
+    connect(session->sweeper, &PingSweeper::error, session->thread, &QThread::quit);
+    connect(session->sweeper, &PingSweeper::error, this, [this, handle](const QString& message) { sessionError(handle, message); });
+    connect(session->thread, &QThread::finished, this, [this, handle]() { pingWorkerFinished(handle); });
+    connect(session->sweeper, &PingSweeper::resultsReady, this, [this, handle]() { sessionResultsReady(handle); });
+    connect(session->sweeper, &PingSweeper::targetDone, this, [this, handle](int target, const QVariantMap& stats) { pingTargetDone(handle, target, stats); });
+    session->thread->start();
+}
+
+void UnixIpHelper::pingEcho(Session* session, ProbeResult& result)
+{
+    result.index = session->index[result.index];
+    emit probeResult(result);
     
+    if (wantsResultMap()) {
+        QVariantMap map;
+        result.toMap(map);
+        map["target"] = result.index;
+        map["destination"] = session->targets[result.index];
+        emit pingResult(map);
+    }
+}
+
+void UnixIpHelper::pingTargetDone(int handle, int target, const QVariantMap& stats)
+{
+    Session* session = m_sessions.value(handle);
+    if (!session)
+        return;
+    
+    drainSession(session);
+    int i = session->index[target];
+    QVariantMap map = stats;
+    map["session"] = handle;
+    map["target"] = i;
+    map["destination"] = session->targets[i];
+    session->resolved[i].toMap(map);
+    emit pingFinal(map);
+    emit session->object->pingFinal(map);
+}
+
+void UnixIpHelper::pingWorkerFinished(int handle)
+{
+    Session* session = m_sessions.value(handle);
+    if (!session)
+        return;
+    
+    QVariantMap final{{"session", handle}, {"count", session->targets.size()}};
+    if (session->ring && session->ring->dropped())
+        final["dropped"] = session->ring->dropped();
+    if (session->canceled)
+        final["canceled"] = true;
+    if (!session->error.isEmpty())
+        final["error"] = session->error;
+    finishSession(session, final);
+    qDebug() << "ping sweep finished";
+}
+
+void UnixIpHelper::lookupHost(Session* session, quint32 address)
+{
+    // a timeout has no address, and a session asks about each one once
+    if (!session->lookups || !address || session->hosts.contains(address))
+        return;
+    
+    QString name;
+    ReverseLookupCache& cache = ReverseLookupCache::global();
+    if (cache.lookup(address, &name)) {
+        session->hosts.insert(address, name);
+        emitHost(session, address, name);
+        return;
+    }
+    
+    session->hosts.insert(address, QString());
+    if (!cache.isPending(address))
+        return;    // the queue is full, the address stays a number
+    m_lookupWaiters[address].append(session->handle);
+    ++session->lookupsOut;
+}
+
+void UnixIpHelper::hostResolved(quint32 address, const QString& name)
+{
+    // the cache answers everyone, this helper only cares about what its sessions asked
+    auto it = m_lookupWaiters.find(address);
+    if (it == m_lookupWaiters.end())
+        return;
+    const QVector<int> handles = *it;
+    m_lookupWaiters.erase(it);
+    
+    emit hostLookup(QVariantMap{{"address", QHostAddress(address).toString()}, {"host", name}});
+    for (int handle : handles) {
+        Session* session = m_sessions.value(handle);
+        if (!session)
+            continue;
+        session->hosts[address] = name;
+        --session->lookupsOut;
+        emitHost(session, address, name);
+        if (!session->lookupsOut && session->afterLookups)
+            lookupsDone(session);
+    }
+}
+
+void UnixIpHelper::emitHost(Session* session, quint32 address, const QString& name)
+{
+    if (name.isEmpty())
+        return;
+    QVariantMap map{{"session", session->handle}, {"address", QHostAddress(address).toString()}, {"host", name}};
+    emit traceHost(map);
+    emit session->object->traceHost(map);
+}
+
+void UnixIpHelper::waitForLookups(Session* session, std::function<void()> then)
+{
+    if (!session->waitForLookups || !session->lookupsOut || session->canceled) {
+        then();
+        return;
+    }
+    
+    // a resolver that doesn't answer doesn't get to hold the final back for long
+    session->afterLookups = then;
+    int handle = session->handle;
+    QTimer::singleShot(DNS_LOOKUP_WAIT, this, [this, handle]() {
+        Session* session = m_sessions.value(handle);
+        if (session && session->afterLookups)
+            lookupsDone(session);
+    });
+}
+
+void UnixIpHelper::lookupsDone(Session* session)
+{
+    // it's done with once it runs, it may well take the session with it
+    std::function<void()> then;
+    then.swap(session->afterLookups);
+    then();
 }
 
 void UnixIpHelper::trace()
@@ -1,66 +1,208 @@
 #ifndef UNIXIPHELPER_H
 #define UNIXIPHELPER_H
 
+#include "dnscache.h"
+#include "hopstats.h"
 #include "iphlpr.h"
+#include "pingsweep.h"
+#include "probetransport.h"
+#include "tracestate.h"
 
+#include <QHash>
 #include <QHostAddress>
-#include <QHostInfo>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QWaitCondition>
 
-struct TraceOptions
-{
-    QString destinationHostname;
-    int destinationPort;
-    int startTTL;
-    int maxTTL;
-    int timeoutPerHopMS;
-    int totalTimeout;
-    int numProbesPerHop;
-};
+#include <climits>
 
+class QTimer;
+class RecvBatch;
+class ResultRing;
+class SendBatch;
+
+//runs one trace at a time on a thread of its own, as many as it's handed. they come out of
+// TraceWorkerPool, the thread stays up between traces
 class TraceWorker: public QObject
 {
     Q_OBJECT
 
     TraceOptions mOptions;
-    int mDNSLookupId = 0;
-    int mRcvsock = -1;
-    int mSndsock = -1;
+    ResultRing* mResults = nullptr;
+    QScopedPointer<ProbeTransport> mTransport;
+    quint32 mSourceAddress = 0;     //paris only, what their checksums are worked out with
     std::atomic_bool mShouldStop{false};
-public:
-    TraceWorker(const TraceOptions& options): QObject()
-    , mOptions(options)
-    {}
+    Wakeup mWakeup;                 //the transport's waits end on it, stop() signals it
 
+    //start() to finish(), waitIdle() waits on it
+    QMutex mBusyLock;
+    QWaitCondition mIdle;
+    bool mBusy = false;
+
+    //the trace of options.destinationAddress, every cycle of it
+    void trace();
+    //one pass over the path, results carry the cycle in seq. false if it was stopped or failed
+    bool runCycle(TraceState& state, SendBatch& sendBatch, RecvBatch& recvBatch, int cycle);
+    void emitResults(TraceState& state, int cycle);
+    //wokeNs is when the wait returned, on EngineMetrics' clock
+    void drainErrorQueue(TraceState& state, SendBatch& sendBatch, qint64 wokeNs);
+    bool drainReplies(TraceState& state, RecvBatch& recvBatch, qint64 wokeNs);
+    void finish();
+public:
+    TraceWorker(): QObject() {}
     virtual ~TraceWorker(){}
+
+    //from the thread that owns the pool, while the worker is idle. options carry the address,
+    // names are resolved before a trace gets here. the trace starts on the worker's thread,
+    // finished() says when it's over
+    void start(const TraceOptions& options, ResultRing* results);
+    //until the trace that's running has finished, true if it did within timeoutMS
+    bool waitIdle(unsigned long timeoutMS = ULONG_MAX);
 public slots:
     void process();
-    void trace(const QHostInfo&);
+    //from any thread, the trace loop wakes up for it at once
     void stop();
 signals:
-    void ping(int distance, QString address, int rtt);
-    void error();
+    void resultsReady();        //the ring crossed its watermark
+    void cycleDone(int cycle);  //every result of the cycle is in the ring
+    void error(const QString& message);
+    void finished();            //the worker is idle again, after error() as well
 };
 
+//trace workers with their threads. a trace takes one and hands it back when it's finished,
+// so back to back traces don't pay for a thread each. up to TRACE_WORKERS_IDLE stay around
+// idle, blocked in their event loop until the next trace is posted to them. lives on the
+// gui thread and goes with the application
+class TraceWorkerPool: public QObject
+{
+    Q_OBJECT
+
+    QVector<TraceWorker*> mIdle;
+    QVector<TraceWorker*> mWorkers;     //idle or not
+
+    explicit TraceWorkerPool(QObject* parent);
+    void retire(TraceWorker* worker);
+public:
+    virtual ~TraceWorkerPool();
+
+    static TraceWorkerPool& global();
+
+    TraceWorker* acquire();
+    //once it has finished. whoever had it has disconnected from it by now
+    void release(TraceWorker* worker);
+};
+
+#include <functional>
+
+class TraceArchiveWriter;
+class TraceScheduler;
+
 class UnixIpHelper : public IpHelperObject
 {
     Q_OBJECT
 public:
     explicit UnixIpHelper(QObject *parent = nullptr);
-    virtual ~UnixIpHelper() {}
+    virtual ~UnixIpHelper();
+
+    virtual IpSession* session(int handle) const override;
 
 public slots:
     virtual int asyncPing(const QString& strAddress, const QVariantMap& mapOptions = QVariantMap()) override;
     virtual int asyncTrace(const QString& strAddress, const QVariantMap& mapOptions = QVariantMap()) override;
+    virtual int asyncTraceBatch(const QStringList& addresses, const QVariantMap& mapOptions = QVariantMap()) override;
+    virtual int asyncPingBatch(const QStringList& addresses, const QVariantMap& mapOptions = QVariantMap()) override;
 
     virtual int cancelAsync(bool bWait = true) override;
-
-    virtual void ping(int distance, QString address, int rtt);
+    virtual int cancelSession(int handle, bool bWait = true) override;
+    virtual bool isRunning() override;
 
 private slots:
     void trace();
-    void handleError();
-    void traceWorkerFinished();
+    void drainResults();
 private:
+    //everything one async call has going, by its handle. a single trace has a worker out of
+    // TraceWorkerPool, a batch or a ping sweep a thread of its own
+    struct Session
+    {
+        enum Kind { Trace, Batch, Ping };
+
+        Kind kind = Trace;
+        int handle = 0;
+        IpSession* object = nullptr;        //what the caller connects to
+        QStringList targets;                //as the caller named them
+        QVector<HostResolver::Result> resolved; //by target, what each name came to
+        QVector<QHostAddress> addresses;    //what the worker probes
+        QVector<int> index;                 //worker trace or target id -> index into targets
+        QVariantMap options;
+        bool resolving = false;
+        bool canceled = false;
+        QString error;                      //what stopped the worker early, if anything
+        ResultRing* ring = nullptr;
+        TraceArchiveWriter* archive = nullptr;
+
+        //reverse lookups of hop addresses, traces and batches
+        bool lookups = false;               //mapOptions "lookup"
+        bool waitForLookups = false;        //TRACE_FLAGS_WAITFORLOOKUP
+        QHash<quint32, QString> hosts;      //every address that answered, its name once there is one
+        int lookupsOut = 0;                 //of those, still being looked up
+        std::function<void()> afterLookups; //what's waiting for them, see waitForLookups
+
+        //single traces
+        QVector<HopStats> hopStats;         //by ttl, over every cycle
+        int cycles = 0;
+        TraceWorker* worker = nullptr;
+
+        //batches and ping sweeps
+        QThread* thread = nullptr;
+        TraceScheduler* scheduler = nullptr;
+        PingSweeper* sweeper = nullptr;
+    };
+
+    TraceOptions traceOptions(const QString& strAddress, const QVariantMap& mapOptions) const;
+    //resolves the session's targets through HostResolver and calls done once all of them are
+    // settled, with resolved, addresses and index filled in. not at all once the session is gone
+    void resolveTargets(Session* session, std::function<void(Session* session)> done);
+    void startTrace(Session* session);
+    void startBatch(Session* session);
+    void startPing(Session* session, const PingOptions& options);
+    Session* createSession(Session::Kind kind, const QStringList& targets, const QVariantMap& mapOptions);
+    //drains what's left and emits the session's finished, then it's gone
+    void finishSession(Session* session, const QVariantMap& final);
+    //the worker back to the pool, the thread, ring and archive deleted, nothing emitted
+    void releaseSession(Session* session);
+    //per worker signal, looked up by handle: a finished session ignores late ones
+    void sessionResultsReady(int handle);
+    //the first error sticks, the finals carry it as "error"
+    void sessionError(int handle, const QString& message);
+    void traceCycleDone(int handle, int cycle);
+    void traceWorkerFinished(int handle);
+    void batchTraceDone(int handle, int trace);
+    void batchWorkerFinished(int handle);
+    void pingTargetDone(int handle, int target, const QVariantMap& stats);
+    void pingWorkerFinished(int handle);
+    void finishTrace(int handle);
+    void finishBatch(int handle);
+    //the name of a hop address from the cache, or a lookup the session waits for
+    void lookupHost(Session* session, quint32 address);
+    void hostResolved(quint32 address, const QString& name);
+    void emitHost(Session* session, quint32 address, const QString& name);
+    //then runs once the session's lookups are in, DNS_LOOKUP_WAIT at most. right away without
+    // TRACE_FLAGS_WAITFORLOOKUP, or with nothing out
+    void waitForLookups(Session* session, std::function<void()> then);
+    void lookupsDone(Session* session);
+    //pingResult is only worth building a map for when someone listens to it
+    bool wantsResultMap() const;
+    //per result of each worker: put the caller's index on it and emit probeResult/pingResult
+    void ping(Session* session, ProbeResult& result);
+    void batchPing(Session* session, ProbeResult& result);
+    void pingEcho(Session* session, ProbeResult& result);
+    typedef void (UnixIpHelper::*ResultHandler)(Session* session, ProbeResult& result);
+    void drainSession(Session* session);
+    ResultRing* createResultRing(const QVariantMap& mapOptions);
+    //the writer for mapOptions "archive", null if there's none or it won't open
+    TraceArchiveWriter* openArchive(const QVariantMap& mapOptions);
+    void closeArchive(TraceArchiveWriter*& archive);
+
     QHostAddress m_destinationAddress;
 
     int m_ttl;					//REVIEW: max or total ttl for each hop????
@@ -73,14 +215,14 @@ private:
     int m_maxToRemoveAtEnd = MAX_NULL_HOPS_REMOVE_ATEND;
     int m_ipFlags;
     int m_origStartingTTL;      //record for computing hops
-    bool m_bCanceled = false;
-    bool m_bIsRunning = false;
-
-    //running storage for the trace
-    QVector<QVector<Ping> > m_hopList;
-    QList<int> m_pingsPerHop;         //how many do we have out there for this TTL/hop
-    TraceWorker* m_traceWorker;
-    QThread* m_traceThread;
+
+    QHash<int, Session*> m_sessions;
+    int m_nextHandle = 1;                     //handles are never reused, a late signal finds nothing
+    QHash<quint32, QVector<int> > m_lookupWaiters;   //address -> the sessions waiting for its name
+
+    //every worker writes its results into its session's ring, drained here on a timer or on resultsReady
+    QTimer* m_drainTimer;
+    QVector<ProbeResult> m_drained;           //reused for every drain
 };
 
 #endif // UNIXIPHELPER_H